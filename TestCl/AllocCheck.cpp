@@ -0,0 +1,100 @@
+// Copyright 2023, All rights reserved
+
+#include "AllocCheck.h"
+
+#ifdef ULS_ALLOC_CHECK
+
+#include "Log.h"
+#include "Metrics.h"
+#include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <new>
+
+static thread_local uint64_t t_AllocCount = 0;
+static std::atomic<uint64_t> g_AllocTotal(0);
+static std::atomic<uint32_t> g_AllocFrames(0);
+
+static void* AllocCounted(size_t n)
+{
+    t_AllocCount++;
+    g_AllocTotal.fetch_add(1, std::memory_order_relaxed);
+    return malloc(n ? n : 1);
+}
+
+void* operator new(size_t n)
+{
+    void* p = AllocCounted(n);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t n)
+{
+    void* p = AllocCounted(n);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t n, const std::nothrow_t&) noexcept { return AllocCounted(n); }
+void* operator new[](size_t n, const std::nothrow_t&) noexcept { return AllocCounted(n); }
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { free(p); }
+
+uint64_t AllocThreadCount()
+{
+    return t_AllocCount;
+}
+
+uint64_t AllocTotalCount()
+{
+    return g_AllocTotal.load(std::memory_order_relaxed);
+}
+
+bool AllocCheckBuilt()
+{
+    return true;
+}
+
+CAllocFrameCheck::CAllocFrameCheck()
+    : m_Start(t_AllocCount)
+{
+}
+
+CAllocFrameCheck::~CAllocFrameCheck()
+{
+    uint64_t n = t_AllocCount - m_Start;
+
+    if (g_AllocFrames.fetch_add(1, std::memory_order_relaxed) < ALLOC_CHECK_WARMUP || !n)
+        return;
+
+    MetricInc(METRIC_FRAME_ALLOCS);
+    LOG_WARN("Capture path made %llu heap allocations during one frame", (unsigned long long)n);
+    assert(!"heap allocation in steady state capture");
+}
+
+#else
+
+uint64_t AllocThreadCount()
+{
+    return 0;
+}
+
+uint64_t AllocTotalCount()
+{
+    return 0;
+}
+
+bool AllocCheckBuilt()
+{
+    return false;
+}
+
+#endif
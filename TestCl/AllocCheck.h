@@ -0,0 +1,40 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Heap allocation accounting for the capture path.
+//
+// Built with ULS_ALLOC_CHECK, the library replaces operator new / delete with
+// versions that count allocations per thread. Only the library's own C++
+// allocations are seen (the replacement is local to the module); hidapi's
+// mallocs are not.
+//
+// CAllocFrameCheck brackets one capture. After ALLOC_CHECK_WARMUP frames
+// (first use of the log, trace and recorder paths allocates) any allocation
+// made on the capture thread during a frame counts in METRIC_FRAME_ALLOCS, is
+// logged, and fails an assert in debug builds.
+//
+// Without ULS_ALLOC_CHECK all of this compiles to nothing and the counts stay 0.
+///////////////////////////////////////////////////////////////////////////////
+
+#define ALLOC_CHECK_WARMUP	4
+
+uint64_t AllocThreadCount();			// Allocations made so far by the calling thread
+uint64_t AllocTotalCount();				// By all threads
+bool AllocCheckBuilt();
+
+class CAllocFrameCheck {
+public:
+#ifdef ULS_ALLOC_CHECK
+    CAllocFrameCheck();
+    ~CAllocFrameCheck();
+
+protected:
+    uint64_t m_Start;
+#else
+    CAllocFrameCheck() {}
+#endif
+};
@@ -0,0 +1,174 @@
+// Copyright 2023, All rights reserved
+
+#include "AutoExposure.h"
+#include "DarkCache.h"
+#include "Log.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#define AE_MIN_SIGNAL		8			// Counts above the offset worth scaling from
+
+CAutoExposure::CAutoExposure()
+    : m_Chan(1), m_LastValue(0), m_Samples(0)
+{
+    DefaultParams(&m_Params);
+    for (int i = 0; i < 4; i++)
+        m_Offset[i] = DARK_PEDESTAL;
+    ClearCache();
+}
+
+void CAutoExposure::DefaultParams(AeParams* p)
+{
+    p->percentile = 95.0f;
+    p->target = 3000;				// About 3/4 of the 12 bit ADC range
+    p->tolerance = 300;
+    p->max_saturated = 0;
+    p->max_captures = 4;
+}
+
+int CAutoExposure::Slot(int chan, int gain)
+{
+    if (chan < 1 || chan > 4)
+        return -1;
+    return (chan - 1) * 2 + (gain ? 1 : 0);
+}
+
+float CAutoExposure::Clamp(float t)
+{
+    return t < AE_MIN_INT_TIME ? AE_MIN_INT_TIME : t > AE_MAX_INT_TIME ? AE_MAX_INT_TIME : t;
+}
+
+int CAutoExposure::Percentile(const int (*frame)[FRAME_MAX_SIZE], int size, float pct)
+{
+    int v[FRAME_MAX_SIZE * FRAME_MAX_SIZE];
+    int n = 0;
+    for (int r = 0; r < size; r++) {
+        for (int c = 0; c < size; c++)
+            v[n++] = frame[r][c];
+    }
+
+    int k = (int)(pct * (n - 1) / 100.0f + 0.5f);
+    k = k < 0 ? 0 : k >= n ? n - 1 : k;
+    std::nth_element(v, v + k, v + n);
+    return v[k];
+}
+
+float CAutoExposure::Start(int chan, int gain, float current, const AeParams& params)
+{
+    m_Params = params;
+    m_Chan = chan;
+    m_Samples = 0;
+
+    float t = Cached(chan, gain);
+    return Clamp(t > 0 ? t : current);
+}
+
+float CAutoExposure::Update(const int (*frame)[FRAME_MAX_SIZE], int size, const FrameStats& stats, float int_time, bool* converged)
+{
+    int v = Percentile(frame, size, m_Params.percentile);
+    m_LastValue = v;
+
+    if (stats.saturated > m_Params.max_saturated) {
+        *converged = false;
+        return Clamp(int_time / AE_SATURATED_STEP);
+    }
+
+    if (std::abs(v - m_Params.target) <= m_Params.tolerance) {
+        *converged = true;
+        return int_time;
+    }
+    *converged = false;
+
+    // Keep the two most recent unsaturated samples at different times
+    if (m_Samples && m_SampleTime[m_Samples - 1] == int_time)
+        m_Samples--;
+    if (m_Samples == 2) {
+        m_SampleTime[0] = m_SampleTime[1];
+        m_SampleValue[0] = m_SampleValue[1];
+        m_Samples = 1;
+    }
+    m_SampleTime[m_Samples] = int_time;
+    m_SampleValue[m_Samples] = v;
+    m_Samples++;
+
+    float& offset = m_Offset[m_Chan - 1];
+    if (m_Samples == 2) {
+        float rate = (m_SampleValue[1] - m_SampleValue[0]) / (m_SampleTime[1] - m_SampleTime[0]);
+        float fit = m_SampleValue[1] - rate * m_SampleTime[1];
+        if (rate > 0 && fit >= 0 && fit < m_Params.target)
+            offset = fit;
+    }
+
+    float next;
+    float signal = v - offset;
+    if (signal < AE_MIN_SIGNAL)
+        next = int_time * AE_MAX_STEP;		// Nothing to scale from yet
+    else
+        next = int_time * (m_Params.target - offset) / signal;
+
+    next = std::min(next, int_time * AE_MAX_STEP);
+    next = std::max(next, int_time / AE_MAX_STEP);
+    return Clamp(next);
+}
+
+void CAutoExposure::Store(int chan, int gain, float int_time)
+{
+    int slot = Slot(chan, gain);
+    if (slot >= 0)
+        m_Cache[slot] = int_time;
+}
+
+float CAutoExposure::Cached(int chan, int gain) const
+{
+    int slot = Slot(chan, gain);
+    return slot < 0 ? 0 : m_Cache[slot];
+}
+
+void CAutoExposure::ClearCache()
+{
+    for (int i = 0; i < 4 * 2; i++)
+        m_Cache[i] = 0;
+}
+
+int CAutoExposure::Save(const char* path) const
+{
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        LOG_WARN("Auto exposure: cannot write %s", path);
+        return 0;
+    }
+
+    for (int s = 0; s < 4 * 2; s++) {
+        if (m_Cache[s] > 0)
+            fprintf(f, "%d %d %.3f\n", s / 2 + 1, s & 1, m_Cache[s]);
+    }
+
+    return fclose(f) == 0 ? 1 : 0;
+}
+
+int CAutoExposure::Load(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    float cache[4 * 2];
+    memcpy(cache, m_Cache, sizeof(cache));
+
+    int chan, gain, n = 0;
+    float t;
+    while (fscanf(f, "%d %d %f", &chan, &gain, &t) == 3) {
+        int slot = Slot(chan, gain);
+        if (slot < 0 || !(t >= AE_MIN_INT_TIME && t <= AE_MAX_INT_TIME))
+            continue;
+        cache[slot] = t;
+        n++;
+    }
+    fclose(f);
+
+    memcpy(m_Cache, cache, sizeof(m_Cache));
+    LOG_INFO("Auto exposure: %d cached integration times loaded from %s", n, path);
+    return n;
+}
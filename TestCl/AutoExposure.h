@@ -0,0 +1,86 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include "FrameMeta.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Automatic exposure.
+//
+// The signal of a pixel grows linearly with integration time on top of a
+// fixed offset (the dark level):
+//
+//   value(t) = offset + rate * t
+//
+// Each capture measures one percentile of the frame. The next integration
+// time puts that percentile on the target: with two unsaturated captures the
+// offset and rate are fitted, with one the channel's last known offset is
+// assumed. A frame with more overflow-flagged pixels than allowed cannot be
+// measured and the time is cut by AE_SATURATED_STEP instead.
+//
+// The time chosen is cached per channel and gain and is where the next run
+// starts, so a repeated run usually converges on its first capture. The
+// cache is kept beside trim.dat as text lines "chan gain int_time".
+///////////////////////////////////////////////////////////////////////////////
+
+#define AE_MIN_INT_TIME		1.0f		// ms, SetIntTime() range
+#define AE_MAX_INT_TIME		66000.0f
+#define AE_SATURATED_STEP	4.0f		// Divisor after a saturated capture
+#define AE_MAX_STEP			64.0f		// Largest change per capture either way
+
+struct AeParams {
+    float percentile;				// Of the frame's pixels, 0-100
+    int   target;					// Counts the percentile should read
+    int   tolerance;				// Converged within target +- tolerance
+    int   max_saturated;			// Overflow-flagged pixels allowed
+    int   max_captures;
+};
+
+struct AeResult {
+    float int_time;					// Chosen, and set on the sensor
+    int   value;					// Percentile at that time
+    int   captures;
+    bool  converged;
+};
+
+class CAutoExposure {
+public:
+    CAutoExposure();
+
+    static void DefaultParams(AeParams* p);
+
+    // First integration time to try: the cached one, else 'current'
+    float Start(int chan, int gain, float current, const AeParams& params);
+
+    // Feeds the capture made at 'int_time'. Returns the next time to try;
+    // *converged is set when the frame was on target.
+    float Update(const int (*frame)[FRAME_MAX_SIZE], int size, const FrameStats& stats, float int_time, bool* converged);
+
+    // Value of the configured percentile in the last frame passed to Update()
+    int LastValue() const { return m_LastValue; }
+
+    void Store(int chan, int gain, float int_time);
+    float Cached(int chan, int gain) const;		// 0 if none
+    void ClearCache();
+
+    int Save(const char* path) const;		// 1: success; 0: error
+    int Load(const char* path);				// Entries read, -1 on error
+
+protected:
+    static int Slot(int chan, int gain);
+    static int Percentile(const int (*frame)[FRAME_MAX_SIZE], int size, float pct);
+    static float Clamp(float t);
+
+    AeParams m_Params;
+    int m_Chan;
+    int m_LastValue;
+
+    // Unsaturated samples of the current run
+    float m_SampleTime[2];
+    int m_SampleValue[2];
+    int m_Samples;
+
+    float m_Offset[4];				// Per channel, learned from fits
+    float m_Cache[4 * 2];			// [chan][gain], 0: none
+};
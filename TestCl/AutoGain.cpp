@@ -0,0 +1,60 @@
+// Copyright 2023, All rights reserved
+
+#include "AutoGain.h"
+#include "Log.h"
+#include <cstring>
+
+CAutoGain::CAutoGain()
+{
+    DefaultParams(&m_Params);
+    memset(m_Enabled, 0, sizeof(m_Enabled));
+    memset(m_Quiet, 0, sizeof(m_Quiet));
+    memset(&m_Stats, 0, sizeof(m_Stats));
+}
+
+void CAutoGain::DefaultParams(AutoGainParams* p)
+{
+    p->sat_pixels = 0;
+    p->down_level = 1000;			// About a quarter of the 12 bit ADC range
+    p->hold_frames = 3;
+}
+
+void CAutoGain::SetEnabled(int chan, bool enable)
+{
+    for (int i = 0; i < 4; i++) {
+        if (chan == 0 || chan == i + 1) {
+            m_Enabled[i] = enable;
+            m_Quiet[i] = 0;
+        }
+    }
+}
+
+int CAutoGain::Update(int chan, int gain, const FrameStats& stats)
+{
+    if (!IsEnabled(chan))
+        return gain;
+
+    int& quiet = m_Quiet[chan - 1];
+
+    if (gain == GAIN_HIGH) {
+        quiet = 0;
+        if (stats.saturated <= m_Params.sat_pixels)
+            return GAIN_HIGH;
+
+        m_Stats.to_low++;
+        LOG_INFO("Auto gain: channel %d, %d saturated pixels, to low gain", chan, stats.saturated);
+        return GAIN_LOW;
+    }
+
+    if (stats.saturated || stats.max >= m_Params.down_level) {
+        quiet = 0;
+        return GAIN_LOW;
+    }
+    if (++quiet < m_Params.hold_frames)
+        return GAIN_LOW;
+
+    quiet = 0;
+    m_Stats.to_high++;
+    LOG_INFO("Auto gain: channel %d, maximum %d for %d frames, to high gain", chan, stats.max, m_Params.hold_frames);
+    return GAIN_HIGH;
+}
@@ -0,0 +1,56 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include "FrameMeta.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Automatic gain mode.
+//
+// Per channel, captures run in high gain until a frame has more than
+// sat_pixels pixels flagged as overflow by ADCCorrection; the channel then
+// goes to low gain. It comes back to high gain only after hold_frames
+// consecutive low gain frames whose maximum stays below down_level, which
+// leaves room for the higher gain, so a plate near the threshold does not
+// flip the gain on every frame.
+///////////////////////////////////////////////////////////////////////////////
+
+#define GAIN_HIGH	0		// gain_mode values, as for SetGainMode()
+#define GAIN_LOW	1
+
+struct AutoGainParams {
+    int sat_pixels;					// Overflow pixels tolerated in high gain
+    int down_level;					// Low gain maximum below which high gain would fit
+    int hold_frames;				// Consecutive such frames before going back
+};
+
+struct AutoGainStats {
+    uint32_t to_low;
+    uint32_t to_high;
+    uint32_t recaptures;			// Saturated frames captured again in low gain
+};
+
+class CAutoGain {
+public:
+    CAutoGain();
+
+    static void DefaultParams(AutoGainParams* p);
+    void SetParams(const AutoGainParams& p) { m_Params = p; }
+    const AutoGainParams& Params() const { return m_Params; }
+
+    void SetEnabled(int chan, bool enable);		// chan 0: every channel
+    bool IsEnabled(int chan) const { return chan >= 1 && chan <= 4 && m_Enabled[chan - 1]; }
+
+    // Gain the channel should use after a frame captured at 'gain'
+    int Update(int chan, int gain, const FrameStats& stats);
+
+    void CountRecapture() { m_Stats.recaptures++; }
+    const AutoGainStats& Stats() const { return m_Stats; }
+
+protected:
+    AutoGainParams m_Params;
+    bool m_Enabled[4];
+    int m_Quiet[4];					// Consecutive low gain frames below down_level
+    AutoGainStats m_Stats;
+};
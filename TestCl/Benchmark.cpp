@@ -0,0 +1,451 @@
+// Copyright 2023, All rights reserved
+
+///////////////////////////////////////////////////////////////////////////////
+// Microbenchmarks for the host side processing path:
+//
+//   ADCCorrection / ADCCorrectioni		ns per pixel
+//   row and frame assembly				ns per row, us per frame (12x12 and 24x24)
+//   CTrimReader::Load + Parse			shipped Trim/trim.dat and a synthetic 16 node file
+//   EEPROM restore						CopyEepromBuff + RestoreTrimBuff per node
+//
+// Every input is generated from a fixed seed, so two builds see the same data.
+// Heap allocations are counted through the global operator new.
+//
+// Standalone program, not part of the DLL. Build with TrimReader.cpp and
+// Metrics.cpp only; this file supplies the report buffers HidMgr.cpp would,
+// and a stub for the one CTrimReader member the tree does not define.
+//
+//   Benchmark [--json] [--trim path] [--min-ms n]
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <algorithm>
+
+#include "HidMgr.h"
+#include "TrimReader.h"
+
+BYTE TxData[TxNum + 1];
+BYTE RxData[RxNum + 1];
+BOOL ee_continue = true;
+int chan_num = 1;
+
+extern BYTE EepromBuff[16 + 4 * NUM_EPKT][EPKT_SZ + 1];
+
+// Declared but not defined in this tree; only ReadTrimData() calls it, and
+// that is not measured here
+void CTrimReader::CopyEepromBuffAndRestore() {}
+
+/////////////////////////////////////////////////////////////////////////////
+// Allocation counting
+/////////////////////////////////////////////////////////////////////////////
+
+static std::atomic<uint64_t> g_AllocCount(0);
+
+void* operator new(size_t size)
+{
+    g_AllocCount.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { operator delete(p); }
+void operator delete[](void* p, size_t) noexcept { operator delete[](p); }
+
+/////////////////////////////////////////////////////////////////////////////
+// Harness
+/////////////////////////////////////////////////////////////////////////////
+
+struct BenchResult {
+    std::string name;
+    const char* unit;				// What one 'unit' is: pixel, row, frame, file, node
+    int units_per_op;
+    uint64_t ops;
+    double ns_per_op;				// Median of the timed rounds
+    double ns_per_unit;
+    double allocs_per_op;
+};
+
+static int g_MinMs = 200;			// Minimum time per round
+static std::vector<BenchResult> g_Results;
+static volatile int g_Sink;
+
+static uint32_t g_Seed;
+
+static uint32_t Rand()
+{
+    g_Seed = g_Seed * 1664525u + 1013904223u;
+    return g_Seed >> 8;
+}
+
+static double NowNs()
+{
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Runs op() in rounds of at least g_MinMs, five rounds after a warm up round,
+// and keeps the median round.
+
+template<typename F>
+static void Bench(const char* name, const char* unit, int units_per_op, F op)
+{
+    uint64_t batch = 1;
+
+    // Warm up and size the batch so one round lasts g_MinMs
+    for (;;) {
+        double t0 = NowNs();
+        for (uint64_t i = 0; i < batch; i++)
+            op();
+        double dt = NowNs() - t0;
+        if (dt >= g_MinMs * 1e6 || batch >= (1ull << 40))
+            break;
+        batch = dt < 1e5 ? batch * 10 : (uint64_t)(batch * (g_MinMs * 1e6 * 1.1) / dt) + 1;
+    }
+
+    double rounds[5];
+    uint64_t allocs = 0;
+
+    for (int r = 0; r < 5; r++) {
+        uint64_t a0 = g_AllocCount.load(std::memory_order_relaxed);
+        double t0 = NowNs();
+        for (uint64_t i = 0; i < batch; i++)
+            op();
+        rounds[r] = (NowNs() - t0) / (double)batch;
+        allocs += g_AllocCount.load(std::memory_order_relaxed) - a0;
+    }
+
+    std::sort(rounds, rounds + 5);
+
+    BenchResult res;
+    res.name = name;
+    res.unit = unit;
+    res.units_per_op = units_per_op;
+    res.ops = batch * 5;
+    res.ns_per_op = rounds[2];
+    res.ns_per_unit = rounds[2] / units_per_op;
+    res.allocs_per_op = (double)allocs / (double)(batch * 5);
+    g_Results.push_back(res);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Inputs
+/////////////////////////////////////////////////////////////////////////////
+
+// Fills node n with plausible trim values: small k, offsets of a few counts,
+// fixed pattern noise around 150-250, as in the shipped trim.dat.
+
+static void SyntheticNode(CTrimNode& node, int n)
+{
+    char name[16];
+    snprintf(name, sizeof(name), "%03d", 500 + n);
+    node.name = name;
+
+    for (int i = 0; i < TRIM_IMAGER_SIZE; i++) {
+        node.kb[i][0] = ((int)(Rand() % 600) - 300) / 1000.0;
+        node.kb[i][1] = ((int)(Rand() % 14000) - 7000) / 100.0;
+        node.kb[i][2] = 3.5 + (Rand() % 20) / 10.0;
+        node.kb[i][3] = (int)(Rand() % 44) - 22;
+        node.kb[i][4] = 0;
+        node.kb[i][5] = 0;
+        node.fpn[0][i] = 100 + (Rand() % 15000) / 100.0;
+        node.fpn[1][i] = 130 + (Rand() % 15000) / 100.0;
+    }
+
+    node.tempcal[0] = 29.92;
+    node.tempcal[1] = -19.92;
+    node.rampgen = 0x88;
+    node.auto_v20[0] = 0x08;
+    node.auto_v20[1] = 0x0a;
+    node.auto_v15 = 0x08;
+}
+
+// Writes nodes in the trim.dat text format
+
+static bool WriteTrimFile(const char* path, int nodes)
+{
+    FILE* f = fopen(path, "w");
+    if (!f)
+        return false;
+
+    for (int n = 0; n < nodes; n++) {
+        CTrimNode node;
+        SyntheticNode(node, n);
+
+        fprintf(f, "DEF %s {\n\n\tKb {\n", std::string(node.name).c_str());
+        for (int i = 0; i < TRIM_IMAGER_SIZE; i++) {
+            fprintf(f, "%.9f\t,\t%.9f\t,\t%.1f\t,\t%d%s\n", node.kb[i][0], node.kb[i][1], node.kb[i][2],
+                (int)node.kb[i][3], i < TRIM_IMAGER_SIZE - 1 ? "\t," : "");
+        }
+        fprintf(f, "\t}\n\n");
+
+        for (int g = 0; g < 2; g++) {
+            fprintf(f, "\t%s {\n\t\t", g ? "Fpn_hg" : "Fpn_lg");
+            for (int i = 0; i < TRIM_IMAGER_SIZE; i++)
+                fprintf(f, "%.7f%s", node.fpn[g][i], i < TRIM_IMAGER_SIZE - 1 ? ",\t" : "\n\n");
+            fprintf(f, "\t}\n\n");
+        }
+
+        fprintf(f, "\tAutoV20_lg {\n\t\t0x%02x\n\t}\n\n", node.auto_v20[0]);
+        fprintf(f, "\tAutoV20_hg {\n\t\t0x%02x\n\t}\n\n", node.auto_v20[1]);
+        fprintf(f, "\tRampgen {\n\t\t0x%02x\n\t}\n\n", node.rampgen);
+        fprintf(f, "\tTemp_calib {\n\t\t%.2f, %.2f,  0,0,0,0,0,0,0,0,0,0\n\t}\n}\n\n", node.tempcal[0], node.tempcal[1]);
+    }
+
+    return fclose(f) == 0;
+}
+
+// One row report as the device returns it: GetCmd, pixel data type, row
+// index in [5], then LowByte/HighByte pairs from [6]. High bytes cover the
+// whole ADC range so the overflow/underflow branches are exercised too.
+
+static void SyntheticRowReport(BYTE* rx, int row, int pixels)
+{
+    memset(rx, 0, RxNum);
+    rx[0] = 0xaa;
+    rx[2] = GetCmd;
+    rx[4] = pixels == 12 ? 0x02 : 0x08;
+    rx[5] = (BYTE)row;
+
+    for (int i = 0; i < pixels; i++) {
+        BYTE hb = (BYTE)(Rand() % 200 + 8);
+        BYTE lb = (BYTE)((hb & 0x0f) * 16 + 7 + (int)(Rand() % 17) - 8);
+        rx[6 + 2 * i] = lb;
+        rx[7 + 2 * i] = hb;
+    }
+}
+
+// Row assembly the way the capture path does it: pick the report apart,
+// correct every pixel and store it in the frame with its flag.
+
+static int AssembleRow(CTrimReader& trim, const BYTE* rx, int (*frame)[24], BYTE (*flags)[24], int chan, int gain)
+{
+    int pixels = (rx[4] == 0x02) ? 12 : 24;
+    int row = rx[5];
+    if (row >= pixels)
+        return -1;
+
+    for (int i = 0; i < pixels; i++) {
+        int flag;
+        frame[row][i] = trim.ADCCorrectioni(i, rx[7 + 2 * i], rx[6 + 2 * i], pixels, chan, gain, &flag);
+        flags[row][i] = (BYTE)flag;
+    }
+
+    return row;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Benchmarks
+/////////////////////////////////////////////////////////////////////////////
+
+static void BenchCorrection(CTrimReader& trim)
+{
+    const int N = 144 * 4;
+    static BYTE hb[N], lb[N];
+
+    g_Seed = 1;
+    for (int i = 0; i < N; i++) {
+        hb[i] = (BYTE)(Rand() % 256);
+        lb[i] = (BYTE)((hb[i] & 0x0f) * 16 + 7 + (int)(Rand() % 33) - 16);
+    }
+
+    Bench("ADCCorrectioni", "pixel", N, [&] {
+        int acc = 0, flag;
+        for (int i = 0; i < N; i++)
+            acc += trim.ADCCorrectioni(i % 12, hb[i], lb[i], 12, i / 144 + 1, i & 1, &flag);
+        g_Sink = acc;
+    });
+
+    Bench("ADCCorrection (double)", "pixel", N, [&] {
+        int acc = 0, flag;
+        for (int i = 0; i < N; i++)
+            acc += trim.ADCCorrection(i % 12, hb[i], lb[i], 12, i / 144 + 1, i & 1, &flag);
+        g_Sink = acc;
+    });
+}
+
+static void BenchAssembly(CTrimReader& trim)
+{
+    static int frame[24][24];
+    static BYTE flags[24][24];
+    static BYTE rows12[12][RxNum + 1];
+    static BYTE rows24[24][RxNum + 1];
+
+    g_Seed = 2;
+    for (int r = 0; r < 12; r++)
+        SyntheticRowReport(rows12[r], r, 12);
+    for (int r = 0; r < 24; r++)
+        SyntheticRowReport(rows24[r], r, 24);
+
+    Bench("row assembly 12", "row", 12, [&] {
+        int acc = 0;
+        for (int r = 0; r < 12; r++)
+            acc += AssembleRow(trim, rows12[r], frame, flags, 1, 1);
+        g_Sink = acc + frame[11][11];
+    });
+
+    Bench("frame assembly 12x12", "frame", 1, [&] {
+        memset(frame, 0, sizeof(frame));
+        for (int r = 0; r < 12; r++)
+            AssembleRow(trim, rows12[r], frame, flags, 1, 1);
+        g_Sink = frame[11][11];
+    });
+
+    Bench("frame assembly 24x24", "frame", 1, [&] {
+        memset(frame, 0, sizeof(frame));
+        for (int r = 0; r < 24; r++)
+            AssembleRow(trim, rows24[r], frame, flags, 1, 1);
+        g_Sink = frame[23][23];
+    });
+}
+
+static void BenchTrimLoad(const char* shipped, const char* synthetic)
+{
+    CTrimReader* trim = new CTrimReader;
+    std::string name;
+
+    std::vector<TCHAR> path(shipped, shipped + strlen(shipped) + 1);
+    if (trim->Load(path.data())) {
+        Bench("trim Load+Parse Trim/trim.dat", "file", 1, [&] {
+            trim->Load(path.data());
+            trim->Parse();
+        });
+    }
+    else {
+        fprintf(stderr, "Benchmark: cannot open %s, skipping shipped trim file\n", shipped);
+    }
+
+    std::vector<TCHAR> spath(synthetic, synthetic + strlen(synthetic) + 1);
+    if (trim->Load(spath.data())) {
+        trim->Parse();
+
+        char label[64];
+        snprintf(label, sizeof(label), "trim Load+Parse synthetic 16 node (%d parsed)", trim->NumNode);
+
+        Bench(label, "file", 1, [&] {
+            trim->Load(spath.data());
+            trim->Parse();
+        });
+    }
+
+    delete trim;
+}
+
+static void BenchEeprom(CTrimReader& src)
+{
+    const int nodes = 4;
+    const int pages = 1;					// Header pages ahead of the node pages
+
+    // Serialize nodes the way the calibration program writes the EEPROM, page
+    // by page as OnEEPROMRead would have stored them
+
+    for (int k = 0; k < nodes; k++) {
+        src.Convert2Int(k);
+        src.WriteTrimBuff(k);
+        for (int i = 0; i < NUM_EPKT; i++)
+            memcpy(EepromBuff[pages + k * NUM_EPKT + i], src.Node[k].trim_buff + i * EPKT_SZ, EPKT_SZ);
+    }
+
+    CTrimReader* dst = new CTrimReader;
+
+    Bench("EEPROM CopyEepromBuff+RestoreTrimBuff", "node", nodes, [&] {
+        for (int k = 0; k < nodes; k++) {
+            dst->CopyEepromBuff(k, pages + k * NUM_EPKT);
+            dst->RestoreTrimBuff(k);
+        }
+        g_Sink = dst->Node[nodes - 1].fpni[1][11];
+    });
+
+    delete dst;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Output
+/////////////////////////////////////////////////////////////////////////////
+
+static void PrintText()
+{
+    printf("%-48s %14s %12s %10s %12s\n", "benchmark", "ns/op", "ns/unit", "unit", "allocs/op");
+    for (size_t i = 0; i < g_Results.size(); i++) {
+        const BenchResult& r = g_Results[i];
+        printf("%-48s %14.1f %12.2f %10s %12.2f\n", r.name.c_str(), r.ns_per_op, r.ns_per_unit, r.unit, r.allocs_per_op);
+    }
+}
+
+static void PrintJson()
+{
+    printf("{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < g_Results.size(); i++) {
+        const BenchResult& r = g_Results[i];
+        printf("    {\"name\": \"%s\", \"unit\": \"%s\", \"units_per_op\": %d, \"ops\": %llu, "
+            "\"ns_per_op\": %.3f, \"ns_per_unit\": %.3f, \"allocs_per_op\": %.3f}%s\n",
+            r.name.c_str(), r.unit, r.units_per_op, (unsigned long long)r.ops,
+            r.ns_per_op, r.ns_per_unit, r.allocs_per_op, i + 1 < g_Results.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+int main(int argc, char** argv)
+{
+    bool json = false;
+    const char* trim_path = "Trim/trim.dat";
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--json"))
+            json = true;
+        else if (!strcmp(argv[i], "--trim") && i + 1 < argc)
+            trim_path = argv[++i];
+        else if (!strcmp(argv[i], "--min-ms") && i + 1 < argc)
+            g_MinMs = std::max(1, atoi(argv[++i]));
+        else {
+            fprintf(stderr, "usage: %s [--json] [--trim path] [--min-ms n]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    const char* synthetic = "bench_trim16.tmp";
+    g_Seed = 3;
+    if (!WriteTrimFile(synthetic, 16)) {
+        fprintf(stderr, "Benchmark: cannot write %s\n", synthetic);
+        return 1;
+    }
+
+    // Correction tables for 4 channels, integer version as after an EEPROM read
+    CTrimReader* trim = new CTrimReader;
+    g_Seed = 4;
+    for (int k = 0; k < 4; k++) {
+        SyntheticNode(trim->Node[k], k);
+        trim->Convert2Int(k);
+        trim->Node[k].version = 3;
+    }
+    trim->NumNode = 4;
+
+    BenchCorrection(*trim);
+    BenchAssembly(*trim);
+    BenchTrimLoad(trim_path, synthetic);
+    BenchEeprom(*trim);
+
+    delete trim;
+    remove(synthetic);
+
+    if (json)
+        PrintJson();
+    else
+        PrintText();
+
+    return 0;
+}
@@ -0,0 +1,106 @@
+// Copyright 2023, All rights reserved
+
+#include "BufferPool.h"
+#include "RtSched.h"
+#include <new>
+
+CBufferPool::CBufferPool()
+    : m_Base(NULL), m_BlockBytes(0), m_Count(0), m_Head(0), m_Next(NULL),
+    m_InUse(0), m_HighWater(0), m_Exhausted(0)
+{
+}
+
+CBufferPool::~CBufferPool()
+{
+    Close();
+}
+
+int CBufferPool::Open(size_t block_bytes, int count)
+{
+    Close();
+
+    if (!block_bytes || count <= 0)
+        return 0;
+
+    m_BlockBytes = (block_bytes + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+
+    m_Base = (uint8_t*)::operator new(m_BlockBytes * count, std::align_val_t(POOL_ALIGN), std::nothrow);
+    m_Next = new (std::nothrow) std::atomic<uint32_t>[count];
+    if (!m_Base || !m_Next) {
+        Close();
+        return 0;
+    }
+    m_Count = count;
+
+    // Chain every block: i -> i + 1, last -> empty
+    for (int i = 0; i < count; i++)
+        m_Next[i].store(i + 1 < count ? (uint32_t)(i + 2) : 0, std::memory_order_relaxed);
+    m_Head.store(1, std::memory_order_relaxed);
+
+    m_InUse = 0;
+    m_HighWater = 0;
+    m_Exhausted = 0;
+
+    RtSchedRegisterBuffer(m_Base, m_BlockBytes * count);
+    return 1;
+}
+
+void CBufferPool::Close()
+{
+    if (m_Base) {
+        RtSchedUnregisterBuffer(m_Base);
+        ::operator delete(m_Base, std::align_val_t(POOL_ALIGN));
+    }
+    delete[] m_Next;
+
+    m_Base = NULL;
+    m_Next = NULL;
+    m_Count = 0;
+    m_Head.store(0, std::memory_order_relaxed);
+}
+
+void* CBufferPool::Acquire()
+{
+    uint64_t head = m_Head.load(std::memory_order_acquire);
+
+    for (;;) {
+        uint32_t idx = (uint32_t)head;
+        if (!idx) {
+            m_Exhausted.fetch_add(1, std::memory_order_relaxed);
+            return NULL;
+        }
+
+        uint64_t next = ((head >> 32) + 1) << 32 | m_Next[idx - 1].load(std::memory_order_relaxed);
+        if (m_Head.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire)) {
+            int used = m_InUse.fetch_add(1, std::memory_order_relaxed) + 1;
+            int high = m_HighWater.load(std::memory_order_relaxed);
+            while (used > high && !m_HighWater.compare_exchange_weak(high, used, std::memory_order_relaxed))
+                ;
+            return m_Base + (size_t)(idx - 1) * m_BlockBytes;
+        }
+    }
+}
+
+void CBufferPool::Release(void* block)
+{
+    if (!block)
+        return;
+
+    uint32_t idx = (uint32_t)(((uint8_t*)block - m_Base) / m_BlockBytes) + 1;
+    uint64_t head = m_Head.load(std::memory_order_relaxed);
+
+    do {
+        m_Next[idx - 1].store((uint32_t)head, std::memory_order_relaxed);
+    } while (!m_Head.compare_exchange_weak(head, (head & 0xffffffff00000000ull) | idx,
+        std::memory_order_release, std::memory_order_relaxed));
+
+    m_InUse.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void CBufferPool::GetStats(BufferPoolStats* stats) const
+{
+    stats->capacity = m_Count;
+    stats->in_use = m_InUse.load(std::memory_order_relaxed);
+    stats->high_water = m_HighWater.load(std::memory_order_relaxed);
+    stats->exhausted = m_Exhausted.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,59 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+///////////////////////////////////////////////////////////////////////////////
+// Fixed-size block pool.
+//
+// Open() makes the one allocation the pool ever does: count blocks of
+// block_bytes, cache line aligned, registered with RtSched so they are locked
+// along with the library's other buffers. Acquire() and Release() pop and
+// push a lock-free free list and may be called from any thread. An empty pool
+// returns NULL from Acquire() and counts the miss; it never grows.
+//
+// Open() and Close() must not race with Acquire() / Release().
+///////////////////////////////////////////////////////////////////////////////
+
+#define POOL_ALIGN		64
+
+struct BufferPoolStats {
+    int capacity;
+    int in_use;
+    int high_water;
+    uint32_t exhausted;				// Acquire() calls that found the pool empty
+};
+
+class CBufferPool {
+public:
+    CBufferPool();
+    ~CBufferPool();
+
+    int  Open(size_t block_bytes, int count);		// 1: success; 0: error
+    void Close();
+    bool IsOpen() const { return m_Base != NULL; }
+
+    void* Acquire();
+    void  Release(void* block);
+
+    int  Capacity() const { return m_Count; }
+    int  InUse() const { return m_InUse.load(std::memory_order_relaxed); }
+    void GetStats(BufferPoolStats* stats) const;
+
+protected:
+    uint8_t* m_Base;
+    size_t m_BlockBytes;
+    int m_Count;
+
+    // Free list head: block index + 1 in the low 32 bits (0: empty), a tag
+    // bumped on every pop in the high 32 bits against ABA
+    std::atomic<uint64_t> m_Head;
+    std::atomic<uint32_t>* m_Next;
+
+    std::atomic<int> m_InUse;
+    std::atomic<int> m_HighWater;
+    std::atomic<uint32_t> m_Exhausted;
+};
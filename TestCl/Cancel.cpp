@@ -0,0 +1,111 @@
+// Copyright 2023, All rights reserved
+
+#include "Cancel.h"
+#include <atomic>
+#include <mutex>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#endif
+
+static std::atomic<bool> g_CancelPending(false);
+static std::once_flag g_CancelOnce;
+
+#ifdef _WIN32
+static HANDLE g_CancelEvent = NULL;
+#else
+static int g_CancelFd = -1;
+#endif
+
+static void CancelInit()
+{
+#ifdef _WIN32
+    g_CancelEvent = CreateEvent(NULL, TRUE, FALSE, NULL);		// Manual reset
+#else
+    g_CancelFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+}
+
+CancelHandle CancelWaitHandle()
+{
+    std::call_once(g_CancelOnce, CancelInit);
+#ifdef _WIN32
+    return g_CancelEvent;
+#else
+    return g_CancelFd;
+#endif
+}
+
+void CancelSignal()
+{
+    CancelHandle h = CancelWaitHandle();
+
+    g_CancelPending.store(true, std::memory_order_release);
+#ifdef _WIN32
+    SetEvent(h);
+#else
+    uint64_t one = 1;
+    if (write(h, &one, sizeof(one)) < 0) {
+        // Counter saturated, it is signalled anyway
+    }
+#endif
+}
+
+void CancelClear()
+{
+    if (!g_CancelPending.exchange(false, std::memory_order_acq_rel))
+        return;
+
+    CancelHandle h = CancelWaitHandle();
+#ifdef _WIN32
+    ResetEvent(h);
+#else
+    uint64_t v;
+    while (read(h, &v, sizeof(v)) > 0)
+        ;
+#endif
+}
+
+bool CancelPending()
+{
+    return g_CancelPending.load(std::memory_order_acquire);
+}
+
+bool CancelSleepUs(int64_t us)
+{
+    if (CancelPending())
+        return true;
+    if (us <= 0)
+        return false;
+
+    CancelHandle h = CancelWaitHandle();
+
+#ifdef _WIN32
+    // Millisecond granularity, round up so short sleeps still sleep
+    WaitForSingleObject(h, (DWORD)((us + 999) / 1000));
+    return CancelPending();
+#else
+    struct pollfd p;
+    p.fd = h;
+    p.events = POLLIN;
+
+    struct timespec ts;
+    ts.tv_sec = (time_t)(us / 1000000);
+    ts.tv_nsec = (long)(us % 1000000) * 1000;
+
+    ppoll(&p, 1, &ts, NULL);
+    return CancelPending();
+#endif
+}
+
+// Wake anything still blocked on the device when the library goes away
+static struct CCancelExit {
+    ~CCancelExit()
+    {
+        CancelSignal();
+    }
+} g_CancelExit;
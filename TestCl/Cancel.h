@@ -0,0 +1,42 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Capture cancellation.
+//
+// One cancellation object per device: an eventfd on Linux, a manual reset
+// event on Windows. CancelSignal() (cancel_capture(), library unload) sets it;
+// every blocking wait on the capture path waits on it as well as on the
+// device, so a thread blocked in a read or a retry sleep wakes at once rather
+// than at the end of its time out.
+//
+// Interrupting a read needs the transport to wait on the object: HidMgr.cpp
+// (Windows) and DeviceSim do. The Linux hidapi transport is not part of this
+// tree, so on Linux a read blocked on the device still runs to its own time
+// out; the retry sleeps and the checks between frames see the cancel.
+//
+// Only the exports clear it, as they start: get() and the *_capture calls
+// once they know the device is there, the setters too. Nothing below them
+// does, so a cancel reaches every step of a multi-frame operation. A capture
+// that finds it set stops reading, discards the partial frame and returns 1;
+// the loops over several frames check it between frames.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef _WIN32
+typedef void* CancelHandle;				// HANDLE of the event
+#else
+typedef int CancelHandle;				// eventfd
+#endif
+
+void CancelSignal();
+void CancelClear();
+bool CancelPending();
+CancelHandle CancelWaitHandle();		// For transports that wait on the device themselves
+
+// Sleeps up to 'us' microseconds. Returns true, early, if cancelled.
+bool CancelSleepUs(int64_t us);
+inline bool CancelSleep(int ms) { return CancelSleepUs((int64_t)ms * 1000); }
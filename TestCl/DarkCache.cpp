@@ -0,0 +1,172 @@
+// Copyright 2023, All rights reserved
+
+#include "DarkCache.h"
+#include "Log.h"
+#include <cmath>
+#include <cstring>
+
+#define DARK_SLOTS	(4 * 2 * 2)
+
+CDarkCache::CDarkCache()
+    : m_Enabled(true), m_Stores(0),
+      m_Hits(0), m_Interpolated(0), m_Misses(0), m_Invalidations(0)
+{
+    // Allocated once: Store() and Lookup() run on the capture path
+    m_Entries = new Entry[DARK_SLOTS * DARK_BUCKETS];
+    for (int i = 0; i < 4; i++)
+        m_Temperature[i] = NAN;
+    for (int i = 0; i < DARK_SLOTS * DARK_BUCKETS; i++)
+        m_Entries[i].valid = false;
+}
+
+CDarkCache::~CDarkCache()
+{
+    delete[] m_Entries;
+}
+
+int CDarkCache::Slot(int chan, int gain, int size)
+{
+    if (chan < 1 || chan > 4)
+        return -1;
+    return ((chan - 1) * 2 + (gain ? 1 : 0)) * 2 + (size == 24 ? 1 : 0);
+}
+
+int CDarkCache::Bucket(float int_time)
+{
+    return (int)std::floor(std::log2(int_time > 0.01f ? int_time : 0.01f) * 4 + 0.5);
+}
+
+void CDarkCache::Store(int chan, int gain, int size, float int_time, const int (*frame)[FRAME_MAX_SIZE])
+{
+    int slot = Slot(chan, gain, size);
+    if (slot < 0)
+        return;
+
+    Entry* e = &m_Entries[slot * DARK_BUCKETS];
+    int bucket = Bucket(int_time);
+
+    // Same bucket replaces, otherwise a free entry, otherwise the oldest
+    Entry* dst = NULL;
+    for (int i = 0; i < DARK_BUCKETS && !dst; i++) {
+        if (e[i].valid && e[i].bucket == bucket)
+            dst = &e[i];
+    }
+    for (int i = 0; i < DARK_BUCKETS && !dst; i++) {
+        if (!e[i].valid)
+            dst = &e[i];
+    }
+    if (!dst) {
+        dst = &e[0];
+        for (int i = 1; i < DARK_BUCKETS; i++) {
+            if (e[i].age < dst->age)
+                dst = &e[i];
+        }
+    }
+
+    dst->valid = true;
+    dst->bucket = bucket;
+    dst->int_time = int_time;
+    dst->temperature = m_Temperature[chan - 1];
+    dst->age = ++m_Stores;
+    memcpy(dst->pixels, frame, sizeof(dst->pixels));
+
+    LOG_INFO("Dark frame stored: channel %d, gain %d, %dx%d, %.2f ms", chan, gain, size, size, int_time);
+}
+
+bool CDarkCache::Lookup(int chan, int gain, int size, float int_time, int (*out)[FRAME_MAX_SIZE], double* temperature)
+{
+    int slot = Slot(chan, gain, size);
+    if (!m_Enabled || slot < 0)
+        return false;
+
+    const Entry* e = &m_Entries[slot * DARK_BUCKETS];
+    int bucket = Bucket(int_time);
+    const Entry* below = NULL;
+    const Entry* above = NULL;
+
+    for (int i = 0; i < DARK_BUCKETS; i++) {
+        if (!e[i].valid)
+            continue;
+        if (e[i].bucket == bucket) {
+            memcpy(out, e[i].pixels, sizeof(e[i].pixels));
+            if (temperature)
+                *temperature = e[i].temperature;
+            m_Hits.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        if (e[i].int_time < int_time && (!below || e[i].int_time > below->int_time))
+            below = &e[i];
+        if (e[i].int_time > int_time && (!above || e[i].int_time < above->int_time))
+            above = &e[i];
+    }
+
+    if (!below || !above) {
+        m_Misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Dark signal grows linearly with integration time; weight in Q8
+    int w = (int)((int_time - below->int_time) * 256 / (above->int_time - below->int_time) + 0.5f);
+    for (int r = 0; r < size; r++) {
+        for (int c = 0; c < size; c++)
+            out[r][c] = below->pixels[r][c] + (((above->pixels[r][c] - below->pixels[r][c]) * w + 128) >> 8);
+    }
+
+    if (temperature)
+        *temperature = (below->temperature + above->temperature) / 2;	// NAN if either is unknown
+
+    m_Interpolated.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void CDarkCache::Invalidate()
+{
+    int n = 0;
+    for (int i = 0; i < DARK_SLOTS * DARK_BUCKETS; i++) {
+        if (m_Entries[i].valid) {
+            m_Entries[i].valid = false;
+            n++;
+        }
+    }
+
+    if (n) {
+        m_Invalidations.fetch_add(n, std::memory_order_relaxed);
+        LOG_INFO("Dark frames invalidated: %d", n);
+    }
+}
+
+void CDarkCache::NotifyTemperature(int chan, double celsius)
+{
+    if (chan < 1 || chan > 4)
+        return;
+
+    m_Temperature[chan - 1] = celsius;
+
+    // Slots of a channel are consecutive: 2 gains * 2 sizes
+    int n = 0;
+    Entry* e = &m_Entries[Slot(chan, 0, 12) * DARK_BUCKETS];
+    for (int i = 0; i < 2 * 2 * DARK_BUCKETS; i++) {
+        if (e[i].valid && !std::isnan(e[i].temperature) && std::fabs(e[i].temperature - celsius) > DARK_TEMP_TOLERANCE) {
+            e[i].valid = false;
+            n++;
+        }
+    }
+
+    if (n) {
+        m_Invalidations.fetch_add(n, std::memory_order_relaxed);
+        LOG_INFO("Dark frames of channel %d invalidated at %.1f C: %d", chan, celsius, n);
+    }
+}
+
+void CDarkCache::GetStats(DarkCacheStats* out) const
+{
+    out->entries = 0;
+    for (int i = 0; i < DARK_SLOTS * DARK_BUCKETS; i++) {
+        if (m_Entries[i].valid)
+            out->entries++;
+    }
+    out->hits = m_Hits.load(std::memory_order_relaxed);
+    out->interpolated = m_Interpolated.load(std::memory_order_relaxed);
+    out->misses = m_Misses.load(std::memory_order_relaxed);
+    out->invalidations = m_Invalidations.load(std::memory_order_relaxed);
+}
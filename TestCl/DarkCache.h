@@ -0,0 +1,78 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include "FrameMeta.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Dark frame cache.
+//
+// ADCCorrection removes a fixed pattern per column; the dark signal that each
+// pixel builds up over the integration time is left in the frame. The cache
+// holds averaged frames taken with the LEDs off, per channel, gain mode and
+// frame size, at up to DARK_BUCKETS integration times each. Integration times
+// are bucketed in quarter octaves: a capture in a bucket that has a frame uses
+// it, one between two buckets gets a frame interpolated linearly in
+// integration time, anything outside the range covered gets none.
+//
+// Frames go stale when the trim is reloaded or the temperature of their
+// sensor moves more than DARK_TEMP_TOLERANCE from where they were taken.
+///////////////////////////////////////////////////////////////////////////////
+
+#define DARK_BUCKETS			8		// Integration times kept per channel, gain and frame size
+#define DARK_TEMP_TOLERANCE		1.0		// Degrees C
+#define DARK_PEDESTAL			100		// Level a dark pixel is left at, as ADCCorrection's DARK_LEVEL
+
+struct DarkCacheStats {
+    uint32_t entries;
+    uint32_t hits;					// Captures that found a frame for their bucket
+    uint32_t interpolated;			// ... or between two buckets
+    uint32_t misses;
+    uint32_t invalidations;			// Frames dropped for trim or temperature changes
+};
+
+class CDarkCache {
+public:
+    CDarkCache();
+    ~CDarkCache();
+
+    // 'frame' is FRAME_MAX_SIZE wide, averaged, corrected but not dark subtracted
+    void Store(int chan, int gain, int size, float int_time, const int (*frame)[FRAME_MAX_SIZE]);
+
+    // Fills 'out' with the dark frame for the capture; false if none applies.
+    // *temperature, if given, receives where it was taken, NAN if unknown.
+    bool Lookup(int chan, int gain, int size, float int_time, int (*out)[FRAME_MAX_SIZE], double* temperature = NULL);
+
+    void Invalidate();							// All frames, e.g. the trim changed
+    void NotifyTemperature(int chan, double celsius);	// Drops the channel's frames taken at another temperature
+
+    void SetEnabled(bool enable) { m_Enabled = enable; }
+    bool IsEnabled() const { return m_Enabled; }
+
+    void GetStats(DarkCacheStats* out) const;
+
+protected:
+    struct Entry {
+        bool valid;
+        int bucket;
+        float int_time;
+        double temperature;					// NAN if unknown when taken
+        uint32_t age;						// Store() count when taken, oldest is replaced
+        int pixels[FRAME_MAX_SIZE][FRAME_MAX_SIZE];
+    };
+
+    static int Slot(int chan, int gain, int size);
+    static int Bucket(float int_time);
+
+    Entry* m_Entries;						// [4 channels * 2 gains * 2 sizes][DARK_BUCKETS]
+    bool m_Enabled;
+    double m_Temperature[4];				// Per channel, stamped on the frames it stores
+    uint32_t m_Stores;
+
+    std::atomic<uint32_t> m_Hits;
+    std::atomic<uint32_t> m_Interpolated;
+    std::atomic<uint32_t> m_Misses;
+    std::atomic<uint32_t> m_Invalidations;
+};
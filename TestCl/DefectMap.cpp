@@ -0,0 +1,294 @@
+// Copyright 2023, All rights reserved
+
+#include "DefectMap.h"
+#include "Log.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#define DEFECT_HOT_SIGMA		6.0		// Robust sigmas above the median dark level
+#define DEFECT_HOT_MIN			20.0	// ... and at least this many counts
+#define DEFECT_NOISE_FACTOR		4.0		// Times the median dark noise
+#define DEFECT_NOISE_MIN		2.0		// ... and at least this many counts
+#define DEFECT_STUCK_RESPONSE	0.25	// Fraction of the median response to light
+#define DEFECT_MIN_RESPONSE		32.0	// Median response needed to look for stuck pixels
+#define DEFECT_MIN_FRAMES		4
+#define DEFECT_MAD_SIGMA		1.4826	// MAD to standard deviation, normal noise
+
+void CPixelStats::Reset()
+{
+    m_Count = 0;
+    memset(m_Mean, 0, sizeof(m_Mean));
+    memset(m_M2, 0, sizeof(m_M2));
+}
+
+void CPixelStats::Add(const int (*frame)[FRAME_MAX_SIZE], int size)
+{
+    m_Count++;
+    for (int r = 0; r < size; r++) {
+        for (int c = 0; c < size; c++) {
+            double x = frame[r][c];
+            double d = x - m_Mean[r][c];
+            m_Mean[r][c] += d / m_Count;
+            m_M2[r][c] += d * (x - m_Mean[r][c]);
+        }
+    }
+}
+
+// Median of v[0..n), reorders v
+static double Median(double* v, int n)
+{
+    std::nth_element(v, v + n / 2, v + n);
+    return v[n / 2];
+}
+
+CDefectMap::CDefectMap()
+    : m_Enabled(true)
+{
+    Clear();
+}
+
+int CDefectMap::Slot(int chan, int size)
+{
+    if (chan < 1 || chan > 4 || (size != 12 && size != 24))
+        return -1;
+    return (chan - 1) * 2 + (size == 24 ? 1 : 0);
+}
+
+int CDefectMap::Build(int chan, int size, const CPixelStats& dark, const CPixelStats& lit)
+{
+    int slot = Slot(chan, size);
+    if (slot < 0 || dark.Count() < DEFECT_MIN_FRAMES || lit.Count() < DEFECT_MIN_FRAMES)
+        return -1;
+
+    int n = size * size;
+    double level[FRAME_MAX_SIZE * FRAME_MAX_SIZE];
+    double noise[FRAME_MAX_SIZE * FRAME_MAX_SIZE];
+    double response[FRAME_MAX_SIZE * FRAME_MAX_SIZE];
+    double tmp[FRAME_MAX_SIZE * FRAME_MAX_SIZE];
+
+    for (int r = 0; r < size; r++) {
+        for (int c = 0; c < size; c++) {
+            level[r * size + c] = dark.Mean(r, c);
+            noise[r * size + c] = std::sqrt(dark.Variance(r, c));
+            response[r * size + c] = lit.Mean(r, c) - dark.Mean(r, c);
+        }
+    }
+
+    memcpy(tmp, level, n * sizeof(double));
+    double level_med = Median(tmp, n);
+    for (int i = 0; i < n; i++)
+        tmp[i] = std::fabs(level[i] - level_med);
+    double level_sigma = DEFECT_MAD_SIGMA * Median(tmp, n);
+
+    memcpy(tmp, noise, n * sizeof(double));
+    double noise_med = Median(tmp, n);
+
+    memcpy(tmp, response, n * sizeof(double));
+    double response_med = Median(tmp, n);
+
+    double hot = level_med + std::max(DEFECT_HOT_SIGMA * level_sigma, DEFECT_HOT_MIN);
+    double noisy = std::max(DEFECT_NOISE_FACTOR * noise_med, DEFECT_NOISE_MIN);
+    bool check_response = response_med >= DEFECT_MIN_RESPONSE;
+
+    if (!check_response)
+        LOG_WARN("Defect map: channel %d median response %.0f too low to find stuck pixels", chan, response_med);
+
+    int count = 0;
+    for (int r = 0; r < size; r++) {
+        for (int c = 0; c < size; c++) {
+            int i = r * size + c;
+            uint8_t f = 0;
+            if (level[i] > hot) f |= DEFECT_HOT;
+            if (noise[i] > noisy) f |= DEFECT_NOISY;
+            if (check_response && response[i] < DEFECT_STUCK_RESPONSE * response_med) f |= DEFECT_STUCK;
+            m_Map[slot][r][c] = f;
+            if (f)
+                count++;
+        }
+    }
+
+    // A sensor that is mostly "defective" has a setup problem, not bad pixels
+    if (count > n / 4) {
+        LOG_WARN("Defect map: channel %d has %d of %d pixels out of range, map not kept", chan, count, n);
+        memset(m_Map[slot], 0, sizeof(m_Map[slot]));
+        return -1;
+    }
+
+    m_Frames[slot] = dark.Count();
+    BuildFixes(slot);
+
+    LOG_INFO("Defect map built: channel %d, %dx%d, %d defective pixels (dark %.0f +- %.1f, noise %.1f, response %.0f)",
+        chan, size, size, count, level_med, level_sigma, noise_med, response_med);
+    return count;
+}
+
+void CDefectMap::BuildFixes(int slot)
+{
+    int size = slot & 1 ? 24 : 12;
+
+    m_Count[slot] = 0;
+    for (int r = 0; r < size; r++) {
+        Row& row = m_Rows[slot][r];
+        row.count = 0;
+
+        for (int c = 0; c < size; c++) {
+            if (!m_Map[slot][r][c])
+                continue;
+
+            Fix& f = row.fix[row.count++];
+            f.col = (uint8_t)c;
+            f.left = f.right = DEFECT_NONE;
+
+            for (int k = c - 1; k >= 0 && f.left == DEFECT_NONE; k--) {
+                if (!m_Map[slot][r][k])
+                    f.left = (uint8_t)k;
+            }
+            for (int k = c + 1; k < size && f.right == DEFECT_NONE; k++) {
+                if (!m_Map[slot][r][k])
+                    f.right = (uint8_t)k;
+            }
+            m_Count[slot]++;
+        }
+    }
+}
+
+const CDefectMap::Row* CDefectMap::Rows(int chan, int size) const
+{
+    int slot = Slot(chan, size);
+    if (!m_Enabled || slot < 0 || !m_Count[slot])
+        return NULL;
+    return m_Rows[slot];
+}
+
+void CDefectMap::Apply(const Row& row, int* pixels)
+{
+    for (int k = 0; k < row.count; k++) {
+        const Fix& f = row.fix[k];
+        if (f.left != DEFECT_NONE && f.right != DEFECT_NONE)
+            pixels[f.col] = (pixels[f.left] + pixels[f.right] + 1) >> 1;
+        else if (f.left != DEFECT_NONE)
+            pixels[f.col] = pixels[f.left];
+        else if (f.right != DEFECT_NONE)
+            pixels[f.col] = pixels[f.right];
+    }
+}
+
+int CDefectMap::Count(int chan, int size) const
+{
+    int slot = Slot(chan, size);
+    return slot < 0 ? 0 : m_Count[slot];
+}
+
+uint8_t CDefectMap::Flags(int chan, int size, int r, int c) const
+{
+    int slot = Slot(chan, size);
+    if (slot < 0 || r < 0 || r >= size || c < 0 || c >= size)
+        return 0;
+    return m_Map[slot][r][c];
+}
+
+void CDefectMap::Clear()
+{
+    memset(m_Map, 0, sizeof(m_Map));
+    memset(m_Rows, 0, sizeof(m_Rows));
+    memset(m_Count, 0, sizeof(m_Count));
+    memset(m_Frames, 0, sizeof(m_Frames));
+}
+
+int CDefectMap::Save(const char* path) const
+{
+    FILE* f = fopen(path, "wb");
+    if (!f) {
+        LOG_WARN("Defect map: cannot write %s", path);
+        return 0;
+    }
+
+    DefectFileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DEFECTFILE_MAGIC, sizeof(h.magic));
+    h.version = DEFECTFILE_VERSION;
+    for (int s = 0; s < 4 * 2; s++) {
+        if (m_Frames[s])
+            h.count++;
+    }
+
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+
+    for (int s = 0; s < 4 * 2 && ok; s++) {
+        if (!m_Frames[s])
+            continue;
+
+        DefectFileMap m;
+        memset(&m, 0, sizeof(m));
+        m.chan = (uint8_t)(s / 2 + 1);
+        m.size = (uint8_t)(s & 1 ? 24 : 12);
+        m.frames = m_Frames[s];
+        ok = fwrite(&m, sizeof(m), 1, f) == 1;
+
+        for (int r = 0; r < m.size && ok; r++)
+            ok = fwrite(m_Map[s][r], 1, m.size, f) == m.size;
+    }
+
+    if (fclose(f) != 0)
+        ok = false;
+    if (!ok)
+        LOG_WARN("Defect map: error writing %s", path);
+    return ok ? 1 : 0;
+}
+
+int CDefectMap::Load(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return -1;
+
+    DefectFileHeader h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, DEFECTFILE_MAGIC, sizeof(h.magic)) != 0 || h.version != DEFECTFILE_VERSION) {
+        LOG_WARN("Defect map: %s is not a defect file", path);
+        fclose(f);
+        return -1;
+    }
+
+    // Read into a copy so a damaged file leaves the current maps alone
+    uint8_t map[4 * 2][FRAME_MAX_SIZE][FRAME_MAX_SIZE];
+    uint32_t frames[4 * 2];
+    int n = 0;
+
+    memset(map, 0, sizeof(map));
+    memset(frames, 0, sizeof(frames));
+
+    for (uint32_t k = 0; k < h.count; k++) {
+        DefectFileMap m;
+        if (fread(&m, sizeof(m), 1, f) != 1)
+            break;
+
+        int slot = Slot(m.chan, m.size);
+        if (slot < 0)
+            break;
+
+        bool ok = true;
+        for (int r = 0; r < m.size && ok; r++)
+            ok = fread(map[slot][r], 1, m.size, f) == m.size;
+        if (!ok)
+            break;
+
+        frames[slot] = m.frames ? m.frames : 1;
+        n++;
+    }
+    fclose(f);
+
+    if (n != (int)h.count) {
+        LOG_WARN("Defect map: %s is truncated", path);
+        return -1;
+    }
+
+    memcpy(m_Map, map, sizeof(m_Map));
+    memcpy(m_Frames, frames, sizeof(m_Frames));
+    for (int s = 0; s < 4 * 2; s++)
+        BuildFixes(s);
+
+    LOG_INFO("Defect map: %d maps loaded from %s", n, path);
+    return n;
+}
@@ -0,0 +1,110 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include "FrameMeta.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Defective pixel map.
+//
+// A survey captures dark and illuminated frames and keeps a running mean and
+// variance per pixel (Welford). Pixels are then compared with the rest of
+// the sensor, using the median and median absolute deviation so a handful
+// of bad pixels cannot shift the reference:
+//
+//   DEFECT_HOT		dark level far above the sensor's
+//   DEFECT_NOISY	dark noise far above the sensor's (flicker, RTS noise)
+//   DEFECT_STUCK	little or no response to light, or a dead pixel
+//
+// For each row the defective pixels and the nearest good pixels either side
+// of them are listed when the map is built, so correcting a row as it
+// arrives costs nothing for clean rows and an average of two neighbours per
+// defect otherwise. Maps are kept per channel and frame size, and saved per
+// device serial beside trim.dat:
+//
+//   DefectFileHeader
+//   DefectFileMap[count], each followed by size * size uint8_t DEFECT_* flags
+///////////////////////////////////////////////////////////////////////////////
+
+#define DEFECT_HOT			0x01
+#define DEFECT_NOISY		0x02
+#define DEFECT_STUCK		0x04
+
+#define DEFECTFILE_MAGIC	"ULSDEF1"
+#define DEFECTFILE_VERSION	1
+
+struct DefectFileHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t count;					// Maps that follow
+};
+
+struct DefectFileMap {
+    uint8_t  chan;					// 1-4
+    uint8_t  size;					// 12 or 24
+    uint8_t  reserved[2];
+    uint32_t frames;				// Survey frames per phase
+};
+
+// Running mean and variance of every pixel over a series of frames
+class CPixelStats {
+public:
+    void Reset();
+    void Add(const int (*frame)[FRAME_MAX_SIZE], int size);
+
+    uint32_t Count() const { return m_Count; }
+    double Mean(int r, int c) const { return m_Mean[r][c]; }
+    double Variance(int r, int c) const { return m_Count > 1 ? m_M2[r][c] / (m_Count - 1) : 0.0; }
+
+protected:
+    uint32_t m_Count;
+    double m_Mean[FRAME_MAX_SIZE][FRAME_MAX_SIZE];
+    double m_M2[FRAME_MAX_SIZE][FRAME_MAX_SIZE];
+};
+
+class CDefectMap {
+public:
+    // Replacement of one defective pixel by its neighbours in the row
+    struct Fix {
+        uint8_t col;
+        uint8_t left;				// Nearest good pixel either side, DEFECT_NONE if none
+        uint8_t right;
+    };
+    enum { DEFECT_NONE = 0xff };
+
+    struct Row {
+        uint8_t count;
+        Fix fix[FRAME_MAX_SIZE];
+    };
+
+    CDefectMap();
+
+    // Classifies every pixel from a dark and an illuminated survey. Returns
+    // the number of defective pixels, -1 if the surveys are unusable.
+    int Build(int chan, int size, const CPixelStats& dark, const CPixelStats& lit);
+
+    // Replacement list of the capture's map, NULL if none or correction is off
+    const Row* Rows(int chan, int size) const;
+    static void Apply(const Row& row, int* pixels);
+
+    int  Count(int chan, int size) const;
+    uint8_t Flags(int chan, int size, int r, int c) const;
+
+    void Clear();
+    int  Save(const char* path) const;		// 1: success; 0: error
+    int  Load(const char* path);			// Maps read, -1 on error
+
+    void SetEnabled(bool enable) { m_Enabled = enable; }
+    bool IsEnabled() const { return m_Enabled; }
+
+protected:
+    static int Slot(int chan, int size);
+    void BuildFixes(int slot);
+
+    uint8_t m_Map[4 * 2][FRAME_MAX_SIZE][FRAME_MAX_SIZE];	// DEFECT_* per pixel
+    Row m_Rows[4 * 2][FRAME_MAX_SIZE];
+    int m_Count[4 * 2];
+    uint32_t m_Frames[4 * 2];				// 0: no map
+    bool m_Enabled;
+};
@@ -0,0 +1,283 @@
+// Copyright 2023, All rights reserved
+
+#include "DeviceSim.h"
+#include "HidMgr.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Cancel.h"
+#include "InputDrain.h"
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <hidapi/hidapi.h>
+
+// Transport globals, as defined by HidMgr.cpp
+
+BYTE TxData[TxNum + 1];
+BYTE RxData[RxNum + 1];
+
+BOOL g_DeviceDetected = true;
+bool MyDeviceDetected = true;
+BOOL Continue_Flag = false;
+BOOL ee_continue = false;
+
+int chan_num = 1;
+
+extern "C" {
+hid_device* DeviceHandle = NULL;				// No hidapi device behind the simulator
+}
+
+#define SIM_QUEUE_REPORTS	64
+
+static DeviceSimConfig g_SimConfig = { 1000, 200, 0.0, 0.0, 100000, 1 };
+static DeviceSimStats g_SimStats;
+static uint64_t g_SimLastReports = 0;
+
+static BYTE g_SimQueue[SIM_QUEUE_REPORTS][RxNum + 1];
+static int g_SimHead = 0;
+static int g_SimCount = 0;
+
+static uint32_t g_SimRand = 1;
+static uint32_t g_SimFrame = 0;
+
+static uint32_t SimRand()
+{
+    g_SimRand = g_SimRand * 1664525u + 1013904223u;
+    return g_SimRand >> 8;
+}
+
+static double SimUniform()
+{
+    return (double)SimRand() / (double)(1u << 24);
+}
+
+// Sleeps most of the way and spins the rest: report latencies are well below
+// the scheduler's sleep granularity. Like the real transport's waits, gives up
+// when the capture is cancelled; returns true if it did.
+
+static bool SimWait(int us)
+{
+    if (us <= 0)
+        return CancelPending();
+
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + std::chrono::microseconds(us);
+    if (us > 200 && CancelSleepUs(us - 100))
+        return true;
+    while (std::chrono::steady_clock::now() < end) {
+        if (CancelPending())
+            return true;
+    }
+    return false;
+}
+
+static BYTE* SimPush()
+{
+    if (g_SimCount >= SIM_QUEUE_REPORTS)
+        return NULL;
+
+    BYTE* r = g_SimQueue[(g_SimHead + g_SimCount) % SIM_QUEUE_REPORTS];
+    g_SimCount++;
+    memset(r, 0, RxNum + 1);
+    r[0] = 0xaa;
+    return r;
+}
+
+// A slowly moving scene plus a little noise, split into the ADC's high byte
+// and a low byte consistent with it
+
+static void SimRow(BYTE* r, BYTE type, int row, int pixels)
+{
+    r[2] = GetCmd;
+    r[4] = type;
+    r[5] = (BYTE)row;
+
+    for (int i = 0; i < pixels; i++) {
+        int v = 600 + 40 * row + 25 * i + (int)((g_SimFrame * 7) % 64) + (int)(SimRand() % 16);
+        BYTE hb = (BYTE)(v >> 4);
+        BYTE lb = (BYTE)((hb & 0x0f) * 16 + (v & 0x0f));
+        r[6 + 2 * i] = lb;
+        r[7 + 2 * i] = hb;
+    }
+}
+
+static void SimCapture(BYTE type)
+{
+    int pixels;
+
+    if (type == 0x01 || type == 0x02 || type == 0x12 || type == 0x22 || type == 0x32 || type == 0x03)
+        pixels = 12;
+    else if (type == 0x07 || type == 0x08 || type == 0x0b)
+        pixels = 24;
+    else
+        return;
+
+    int timeout_row = -1;
+    if (g_SimConfig.sensor_timeout > 0 && SimUniform() < g_SimConfig.sensor_timeout)
+        timeout_row = (int)(SimRand() % pixels);
+
+    for (int row = 0; row < pixels; row++) {
+        if (row == timeout_row) {
+            BYTE* r = SimPush();
+            if (r) {
+                r[2] = GetCmd;
+                r[4] = type;
+                r[5] = 0xf1;
+            }
+            g_SimStats.sensor_timeouts++;
+            break;
+        }
+
+        if (g_SimConfig.row_loss > 0 && SimUniform() < g_SimConfig.row_loss) {
+            g_SimStats.rows_lost++;
+            continue;
+        }
+
+        BYTE* r = SimPush();
+        if (r)
+            SimRow(r, type, row, pixels);
+    }
+
+    g_SimFrame++;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Transport, same entry points as HidMgr.cpp
+/////////////////////////////////////////////////////////////////////////////
+
+void WriteHIDOutputReport()
+{
+    TRACE_SPAN("WriteHIDOutputReport");
+
+    g_SimStats.commands++;
+    MetricInc(METRIC_REPORTS_WRITTEN);
+
+    BYTE cmd = TxData[1];
+    BYTE type = TxData[3];
+
+    if (cmd == GetCmd) {
+        SimCapture(type);
+    }
+    else {
+        BYTE* r = SimPush();
+        if (r) {
+            r[2] = cmd;
+            r[4] = type;
+        }
+    }
+}
+
+void ReadHIDInputReport()
+{
+    TRACE_SPAN("ReadHIDInputReport");
+
+    if (!g_SimCount) {
+        // Nothing is coming: the real read waits out its timeout and gives up
+        if (SimWait(g_SimConfig.timeout_us)) {
+            Continue_Flag = false;
+            ee_continue = false;
+            return;
+        }
+        g_SimStats.read_timeouts++;
+        MetricInc(METRIC_READ_TIMEOUTS);
+        Continue_Flag = false;
+        return;
+    }
+
+    int jitter = g_SimConfig.jitter_us > 0 ? (int)(SimRand() % (2 * g_SimConfig.jitter_us + 1)) - g_SimConfig.jitter_us : 0;
+    if (SimWait(g_SimConfig.report_latency_us + jitter)) {
+        Continue_Flag = false;			// Report stays queued, as on the device
+        ee_continue = false;
+        return;
+    }
+
+    memcpy(RxData, g_SimQueue[g_SimHead], RxNum + 1);
+    g_SimHead = (g_SimHead + 1) % SIM_QUEUE_REPORTS;
+    g_SimCount--;
+
+    g_SimStats.reports++;
+    MetricInc(METRIC_REPORTS_READ);
+
+    // Same end-of-frame rules as HidMgr.cpp
+
+    BYTE rCmd = RxData[2];
+    BYTE rType = RxData[4];
+
+    if (rCmd != GetCmd)
+        return;
+
+    if (rType == 0x01 || rType == 0x02 || rType == 0x12 || rType == 0x22 || rType == 0x32 || rType == 0x03) {
+        chan_num = (rType & 0xF0) / 16 + 1;
+        Continue_Flag = !(RxData[5] == 0x0b || RxData[5] == 0xf1);
+    }
+    else if (rType == 0x07 || rType == 0x08 || rType == 0x0b) {
+        Continue_Flag = !(RxData[5] == 0x17 || RxData[5] == 0xf1);
+    }
+}
+
+// Everything queued has already "arrived": the simulator queues a command's
+// reports when the command is written
+
+int DrainInputReports()
+{
+    TRACE_SPAN("DrainInputReports");
+
+    int n = g_SimCount;
+    for (int i = 0; i < n; i++)
+        StaleReportNote(g_SimQueue[(g_SimHead + i) % SIM_QUEUE_REPORTS]);
+
+    g_SimHead = (g_SimHead + n) % SIM_QUEUE_REPORTS;
+    g_SimCount = 0;
+
+    StaleReportDrained(n);
+    return n;
+}
+
+bool FindTheHID()
+{
+    g_DeviceDetected = true;
+    MyDeviceDetected = true;
+    return true;
+}
+
+int GetBufferSize()
+{
+    return g_SimCount;
+}
+
+// 1 if reports were delivered since the last call
+
+int check_data_flow()
+{
+    int flowing = g_SimStats.reports != g_SimLastReports;
+    g_SimLastReports = g_SimStats.reports;
+    return flowing;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Control
+/////////////////////////////////////////////////////////////////////////////
+
+void DeviceSimSetConfig(const DeviceSimConfig& cfg)
+{
+    g_SimConfig = cfg;
+    g_SimRand = cfg.seed ? cfg.seed : 1;
+}
+
+DeviceSimConfig DeviceSimGetConfig()
+{
+    return g_SimConfig;
+}
+
+void DeviceSimGetStats(DeviceSimStats* stats)
+{
+    *stats = g_SimStats;
+}
+
+void DeviceSimReset()
+{
+    g_SimHead = 0;
+    g_SimCount = 0;
+    g_SimFrame = 0;
+    g_SimLastReports = 0;
+    memset(&g_SimStats, 0, sizeof(g_SimStats));
+}
@@ -0,0 +1,42 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Emulated ULS24 for benchmarks and tests.
+//
+// DeviceSim.cpp defines the same transport symbols as HidMgr.cpp
+// (WriteHIDOutputReport, ReadHIDInputReport, FindTheHID, TxData, RxData, ...)
+// and is linked in its place, so CInterfaceObject and the C exports run
+// unchanged against it.
+//
+// Commands are answered the way the firmware answers them as seen by
+// ReadHIDInputReport(): a pixel command (GetCmd) is answered with one report
+// per row, row index in byte 5, the last row ending the capture; any other
+// command gets a single report echoing its command and type bytes. Pixel rows
+// carry LowByte/HighByte pairs from byte 6.
+///////////////////////////////////////////////////////////////////////////////
+
+struct DeviceSimConfig {
+    int    report_latency_us;		// Mean delay before each input report is available
+    int    jitter_us;				// Uniform +/- spread around the mean
+    double row_loss;				// Probability that a pixel row report is lost
+    double sensor_timeout;			// Probability that a capture ends in an 0xF1 report
+    int    timeout_us;				// Read wait when no report is coming
+    uint32_t seed;
+};
+
+struct DeviceSimStats {
+    uint64_t commands;
+    uint64_t reports;				// Input reports delivered
+    uint64_t rows_lost;
+    uint64_t sensor_timeouts;
+    uint64_t read_timeouts;			// Reads that found nothing queued
+};
+
+void DeviceSimSetConfig(const DeviceSimConfig& cfg);
+DeviceSimConfig DeviceSimGetConfig();
+void DeviceSimGetStats(DeviceSimStats* stats);
+void DeviceSimReset();					// Drop queued reports and zero the stats
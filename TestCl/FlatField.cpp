@@ -0,0 +1,168 @@
+// Copyright 2023, All rights reserved
+
+#include "FlatField.h"
+#include "DarkCache.h"
+#include "Log.h"
+#include <cstdio>
+#include <cstring>
+
+#define FLAT_MIN_SIGNAL		32		// Average signal above the pedestal needed to build a map
+
+CFlatField::CFlatField()
+    : m_Enabled(true)
+{
+    Clear();
+}
+
+int CFlatField::Slot(int chan, int size)
+{
+    if (chan < 1 || chan > 4 || (size != 12 && size != 24))
+        return -1;
+    return (chan - 1) * 2 + (size == 24 ? 1 : 0);
+}
+
+bool CFlatField::HasMap(int chan, int size) const
+{
+    int slot = Slot(chan, size);
+    return slot >= 0 && m_Frames[slot] != 0;
+}
+
+bool CFlatField::Build(int chan, int size, const int (*mean)[FRAME_MAX_SIZE], int frames)
+{
+    int slot = Slot(chan, size);
+    if (slot < 0)
+        return false;
+
+    int64_t total = 0;
+    for (int r = 0; r < size; r++) {
+        for (int c = 0; c < size; c++)
+            total += mean[r][c] - DARK_PEDESTAL;
+    }
+    int64_t avg = total / (size * size);
+    if (avg < FLAT_MIN_SIGNAL) {
+        LOG_WARN("Flat field: channel %d signal %lld too low to build a map", chan, (long long)avg);
+        return false;
+    }
+
+    for (int r = 0; r < size; r++) {
+        for (int c = 0; c < size; c++) {
+            int s = mean[r][c] - DARK_PEDESTAL;
+            int64_t g = s > 0 ? ((avg << FLAT_Q) + s / 2) / s : FLAT_GAIN_MAX;
+            if (g < FLAT_GAIN_MIN) g = FLAT_GAIN_MIN;
+            if (g > FLAT_GAIN_MAX) g = FLAT_GAIN_MAX;
+            m_Gain[slot][r][c] = (uint16_t)g;
+        }
+    }
+    m_Frames[slot] = (uint32_t)frames;
+
+    LOG_INFO("Flat field built: channel %d, %dx%d, %d frames, mean signal %lld", chan, size, size, frames, (long long)avg);
+    return true;
+}
+
+const uint16_t* CFlatField::Row(int chan, int size, int row) const
+{
+    int slot = Slot(chan, size);
+    if (!m_Enabled || slot < 0 || !m_Frames[slot])
+        return NULL;
+    return m_Gain[slot][row];
+}
+
+void CFlatField::Clear()
+{
+    memset(m_Frames, 0, sizeof(m_Frames));
+    for (int s = 0; s < 4 * 2; s++) {
+        for (int r = 0; r < FRAME_MAX_SIZE; r++) {
+            for (int c = 0; c < FRAME_MAX_SIZE; c++)
+                m_Gain[s][r][c] = FLAT_ONE;
+        }
+    }
+}
+
+int CFlatField::Save(const char* path) const
+{
+    FILE* f = fopen(path, "wb");
+    if (!f) {
+        LOG_WARN("Flat field: cannot write %s", path);
+        return 0;
+    }
+
+    FlatFileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, FLATFILE_MAGIC, sizeof(h.magic));
+    h.version = FLATFILE_VERSION;
+    for (int s = 0; s < 4 * 2; s++) {
+        if (m_Frames[s])
+            h.count++;
+    }
+
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+
+    for (int s = 0; s < 4 * 2 && ok; s++) {
+        if (!m_Frames[s])
+            continue;
+
+        FlatFileMap m;
+        memset(&m, 0, sizeof(m));
+        m.chan = (uint8_t)(s / 2 + 1);
+        m.size = (uint8_t)(s & 1 ? 24 : 12);
+        m.frames = m_Frames[s];
+        ok = fwrite(&m, sizeof(m), 1, f) == 1;
+
+        for (int r = 0; r < m.size && ok; r++)
+            ok = fwrite(m_Gain[s][r], sizeof(uint16_t), m.size, f) == m.size;
+    }
+
+    if (fclose(f) != 0)
+        ok = false;
+    if (!ok)
+        LOG_WARN("Flat field: error writing %s", path);
+    return ok ? 1 : 0;
+}
+
+int CFlatField::Load(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return -1;
+
+    FlatFileHeader h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, FLATFILE_MAGIC, sizeof(h.magic)) != 0 || h.version != FLATFILE_VERSION) {
+        LOG_WARN("Flat field: %s is not a flat file", path);
+        fclose(f);
+        return -1;
+    }
+
+    // Read into a copy so a damaged file leaves the current maps alone
+    CFlatField loaded;
+    int n = 0;
+
+    for (uint32_t k = 0; k < h.count; k++) {
+        FlatFileMap m;
+        if (fread(&m, sizeof(m), 1, f) != 1)
+            break;
+
+        int slot = Slot(m.chan, m.size);
+        if (slot < 0)
+            break;
+
+        bool ok = true;
+        for (int r = 0; r < m.size && ok; r++)
+            ok = fread(loaded.m_Gain[slot][r], sizeof(uint16_t), m.size, f) == m.size;
+        if (!ok)
+            break;
+
+        loaded.m_Frames[slot] = m.frames ? m.frames : 1;
+        n++;
+    }
+    fclose(f);
+
+    if (n != (int)h.count) {
+        LOG_WARN("Flat field: %s is truncated", path);
+        return -1;
+    }
+
+    memcpy(m_Gain, loaded.m_Gain, sizeof(m_Gain));
+    memcpy(m_Frames, loaded.m_Frames, sizeof(m_Frames));
+    LOG_INFO("Flat field: %d maps loaded from %s", n, path);
+    return n;
+}
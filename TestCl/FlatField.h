@@ -0,0 +1,73 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include "FrameMeta.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Flat field correction.
+//
+// The trim models the ADC per column (kb, fpn); the sensitivity of each
+// pixel is not modelled. A gain map per channel and frame size, built from
+// captures of a uniform light source, scales each pixel's signal above the
+// dark pedestal to the frame average:
+//
+//   out = ((in - DARK_PEDESTAL) * gain + FLAT_ROUND) >> FLAT_Q + DARK_PEDESTAL
+//
+// Gains are Q12 (4096 = 1.0), limited to FLAT_GAIN_MIN..FLAT_GAIN_MAX.
+//
+// Flat file layout (little endian), kept beside trim.dat as Trim/flat.dat:
+//
+//   FlatFileHeader
+//   FlatFileMap[count], each followed by size * size uint16_t gains, row major
+///////////////////////////////////////////////////////////////////////////////
+
+#define FLAT_Q				12
+#define FLAT_ONE			(1 << FLAT_Q)
+#define FLAT_ROUND			(1 << (FLAT_Q - 1))
+#define FLAT_GAIN_MIN		(FLAT_ONE / 8)
+#define FLAT_GAIN_MAX		(FLAT_ONE * 8)
+
+#define FLATFILE_MAGIC		"ULSFLT1"
+#define FLATFILE_VERSION	1
+
+struct FlatFileHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t count;					// Maps that follow
+};
+
+struct FlatFileMap {
+    uint8_t  chan;					// 1-4
+    uint8_t  size;					// 12 or 24
+    uint8_t  reserved[2];
+    uint32_t frames;				// Captures averaged to build it
+};
+
+class CFlatField {
+public:
+    CFlatField();
+
+    // 'mean' is the per-pixel average of uniformly lit, dark subtracted
+    // frames, FRAME_MAX_SIZE wide. false if the frame has too little signal.
+    bool Build(int chan, int size, const int (*mean)[FRAME_MAX_SIZE], int frames);
+
+    // Gain row for the capture, NULL if there is no map or correction is off
+    const uint16_t* Row(int chan, int size, int row) const;
+
+    void Clear();
+    int  Save(const char* path) const;		// 1: success; 0: error
+    int  Load(const char* path);			// Maps read, -1 on error
+
+    void SetEnabled(bool enable) { m_Enabled = enable; }
+    bool IsEnabled() const { return m_Enabled; }
+    bool HasMap(int chan, int size) const;
+
+protected:
+    static int Slot(int chan, int size);
+
+    uint16_t m_Gain[4 * 2][FRAME_MAX_SIZE][FRAME_MAX_SIZE];
+    uint32_t m_Frames[4 * 2];				// 0: no map
+    bool m_Enabled;
+};
@@ -0,0 +1,312 @@
+// Copyright 2023, All rights reserved
+
+#include "FrameCodec.h"
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CODEC_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CODEC_NEON
+#endif
+
+/////////////////////////////////////////////////////////////////////////////
+// Bit packing
+/////////////////////////////////////////////////////////////////////////////
+
+static int BitsNeeded(uint32_t v)
+{
+    int bits = 0;
+    while (v) {
+        bits++;
+        v >>= 1;
+    }
+    return bits;
+}
+
+int FramePack(const int32_t* pixels, int count, uint8_t* out)
+{
+    if (count <= 0 || count > FRAME_CODEC_MAX_PIXELS)
+        return 0;
+
+    int32_t lo = pixels[0], hi = pixels[0];
+    for (int i = 1; i < count; i++) {
+        if (pixels[i] < lo) lo = pixels[i];
+        if (pixels[i] > hi) hi = pixels[i];
+    }
+
+    FrameCodecHeader h;
+    h.codec = FRAME_CODEC_PACKED;
+    h.bits = (uint8_t)BitsNeeded((uint32_t)hi - (uint32_t)lo);
+    h.count = (uint16_t)count;
+    h.base = lo;
+    memcpy(out, &h, sizeof(h));
+
+    uint8_t* o = out + sizeof(h);
+    uint64_t acc = 0;
+    int nacc = 0;
+
+    for (int i = 0; i < count; i++) {
+        acc |= (uint64_t)((uint32_t)pixels[i] - (uint32_t)lo) << nacc;
+        nacc += h.bits;
+        while (nacc >= 8) {
+            *o++ = (uint8_t)acc;
+            acc >>= 8;
+            nacc -= 8;
+        }
+    }
+    if (nacc)
+        *o++ = (uint8_t)acc;
+
+    return (int)(o - out);
+}
+
+int FrameUnpack(const uint8_t* in, int len, int32_t* pixels, int max_count)
+{
+    FrameCodecHeader h;
+    if (len < (int)sizeof(h))
+        return 0;
+    memcpy(&h, in, sizeof(h));
+
+    if (h.codec != FRAME_CODEC_PACKED || h.count > max_count || h.bits > 32)
+        return 0;
+
+    const uint8_t* p = in + sizeof(h);
+    int plen = len - (int)sizeof(h);
+    int bits = h.bits;
+
+    if ((int)(((uint64_t)h.count * bits + 7) / 8) > plen)
+        return 0;
+
+    uint64_t mask = bits == 32 ? 0xffffffffull : ((1ull << bits) - 1);
+    int i = 0;
+
+    // Fast path: one unaligned 64 bit load per pixel while 8 bytes remain
+
+    for (; i < h.count; i++) {
+        uint64_t bitpos = (uint64_t)i * bits;
+        uint64_t byte = bitpos >> 3;
+        if (byte + 8 > (uint64_t)plen)
+            break;
+
+        uint64_t w;
+        memcpy(&w, p + byte, 8);
+        pixels[i] = (int32_t)((uint32_t)((w >> (bitpos & 7)) & mask) + (uint32_t)h.base);
+    }
+
+    for (; i < h.count; i++) {
+        uint64_t bitpos = (uint64_t)i * bits;
+        uint64_t w = 0;
+        for (int b = 0; b < 8 && (bitpos >> 3) + b < (uint64_t)plen; b++)
+            w |= (uint64_t)p[(bitpos >> 3) + b] << (8 * b);
+        pixels[i] = (int32_t)((uint32_t)((w >> (bitpos & 7)) & mask) + (uint32_t)h.base);
+    }
+
+    return h.count;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Delta coding
+/////////////////////////////////////////////////////////////////////////////
+
+static inline uint32_t ZigZag(int32_t d)
+{
+    return ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+}
+
+static inline int32_t UnZigZag(uint32_t u)
+{
+    return (int32_t)((u >> 1) ^ (0u - (u & 1)));
+}
+
+// Decodes n varints into raw[], returns bytes consumed or 0 on error or when
+// n exceeds max_count.
+// Runs of 16 single byte varints (the common case, |delta| < 64) are widened
+// with one SIMD load.
+
+static int DecodeVarints(const uint8_t* p, int len, uint32_t* raw, int n, int max_count)
+{
+    if (n > max_count)
+        return 0;
+
+    const uint8_t* start = p;
+    const uint8_t* end = p + len;
+    int i = 0;
+
+    while (i < n) {
+#if defined(CODEC_SSE2)
+        if (n - i >= 16 && end - p >= 16) {
+            __m128i b = _mm_loadu_si128((const __m128i*)p);
+            if (!_mm_movemask_epi8(b)) {
+                __m128i zero = _mm_setzero_si128();
+                __m128i lo = _mm_unpacklo_epi8(b, zero);
+                __m128i hi = _mm_unpackhi_epi8(b, zero);
+                _mm_storeu_si128((__m128i*)(raw + i), _mm_unpacklo_epi16(lo, zero));
+                _mm_storeu_si128((__m128i*)(raw + i + 4), _mm_unpackhi_epi16(lo, zero));
+                _mm_storeu_si128((__m128i*)(raw + i + 8), _mm_unpacklo_epi16(hi, zero));
+                _mm_storeu_si128((__m128i*)(raw + i + 12), _mm_unpackhi_epi16(hi, zero));
+                p += 16;
+                i += 16;
+                continue;
+            }
+        }
+#elif defined(CODEC_NEON)
+        if (n - i >= 16 && end - p >= 16) {
+            uint8x16_t b = vld1q_u8(p);
+            uint8x8_t m = vorr_u8(vget_low_u8(b), vget_high_u8(b));
+            if (!(vget_lane_u64(vreinterpret_u64_u8(m), 0) & 0x8080808080808080ull)) {
+                uint16x8_t lo = vmovl_u8(vget_low_u8(b));
+                uint16x8_t hi = vmovl_u8(vget_high_u8(b));
+                vst1q_u32(raw + i, vmovl_u16(vget_low_u16(lo)));
+                vst1q_u32(raw + i + 4, vmovl_u16(vget_high_u16(lo)));
+                vst1q_u32(raw + i + 8, vmovl_u16(vget_low_u16(hi)));
+                vst1q_u32(raw + i + 12, vmovl_u16(vget_high_u16(hi)));
+                p += 16;
+                i += 16;
+                continue;
+            }
+        }
+#endif
+        uint32_t v = 0;
+        int shift = 0;
+        for (;;) {
+            if (p >= end || shift > 28)
+                return 0;
+            uint8_t c = *p++;
+            v |= (uint32_t)(c & 0x7f) << shift;
+            if (!(c & 0x80))
+                break;
+            shift += 7;
+        }
+        raw[i++] = v;
+    }
+
+    return (int)(p - start);
+}
+
+// out[i] = prev[i] + unzigzag(raw[i]), wrapping like the SIMD adds
+
+static void ApplyDeltas(const int32_t* prev, const uint32_t* raw, int32_t* out, int n)
+{
+    int i = 0;
+
+#if defined(CODEC_SSE2)
+    __m128i one = _mm_set1_epi32(1);
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+        __m128i u = _mm_loadu_si128((const __m128i*)(raw + i));
+        __m128i d = _mm_xor_si128(_mm_srli_epi32(u, 1), _mm_sub_epi32(zero, _mm_and_si128(u, one)));
+        __m128i p = _mm_loadu_si128((const __m128i*)(prev + i));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_add_epi32(p, d));
+    }
+#elif defined(CODEC_NEON)
+    uint32x4_t one = vdupq_n_u32(1);
+    for (; i + 4 <= n; i += 4) {
+        uint32x4_t u = vld1q_u32(raw + i);
+        int32x4_t sign = vnegq_s32(vreinterpretq_s32_u32(vandq_u32(u, one)));
+        int32x4_t d = veorq_s32(vreinterpretq_s32_u32(vshrq_n_u32(u, 1)), sign);
+        vst1q_s32(out + i, vaddq_s32(vld1q_s32(prev + i), d));
+    }
+#endif
+
+    for (; i < n; i++)
+        out[i] = (int32_t)((uint32_t)prev[i] + (uint32_t)UnZigZag(raw[i]));
+}
+
+CFrameCodec::CFrameCodec()
+{
+    Reset();
+}
+
+void CFrameCodec::Reset()
+{
+    memset(m_PrevCount, 0, sizeof(m_PrevCount));
+    memset(m_SinceKey, 0, sizeof(m_SinceKey));
+}
+
+int CFrameCodec::SinceKey(int chan) const
+{
+    if (chan < 0 || chan >= FRAME_CODEC_CHANNELS)
+        return 0;
+    return m_SinceKey[chan];
+}
+
+int CFrameCodec::Encode(int chan, const int32_t* pixels, int count, bool delta, uint8_t* out)
+{
+    if (chan < 0 || chan >= FRAME_CODEC_CHANNELS || count <= 0 || count > FRAME_CODEC_MAX_PIXELS)
+        return 0;
+
+    int32_t* prev = m_Prev[chan];
+
+    if (!delta || m_PrevCount[chan] != count || m_SinceKey[chan] + 1 >= FRAME_CODEC_KEY_INTERVAL) {
+        int n = FramePack(pixels, count, out);
+        memcpy(prev, pixels, count * sizeof(int32_t));
+        m_PrevCount[chan] = count;
+        m_SinceKey[chan] = 0;
+        return n;
+    }
+
+    FrameCodecHeader h;
+    h.codec = FRAME_CODEC_DELTA;
+    h.bits = 0;
+    h.count = (uint16_t)count;
+    h.base = 0;
+    memcpy(out, &h, sizeof(h));
+
+    uint8_t* o = out + sizeof(h);
+    for (int i = 0; i < count; i++) {
+        uint32_t z = ZigZag((int32_t)((uint32_t)pixels[i] - (uint32_t)prev[i]));
+        while (z >= 0x80) {
+            *o++ = (uint8_t)(z | 0x80);
+            z >>= 7;
+        }
+        *o++ = (uint8_t)z;
+        prev[i] = pixels[i];
+    }
+
+    m_SinceKey[chan]++;
+
+    return (int)(o - out);
+}
+
+int CFrameCodec::Decode(int chan, const uint8_t* in, int len, int32_t* pixels, int max_pixels)
+{
+    FrameCodecHeader h;
+    if (chan < 0 || chan >= FRAME_CODEC_CHANNELS || len < (int)sizeof(h))
+        return 0;
+    memcpy(&h, in, sizeof(h));
+
+    if (max_pixels > FRAME_CODEC_MAX_PIXELS)
+        max_pixels = FRAME_CODEC_MAX_PIXELS;
+
+    int32_t* prev = m_Prev[chan];
+    int n;
+
+    if (h.codec == FRAME_CODEC_PACKED) {
+        n = FrameUnpack(in, len, pixels, max_pixels);
+        if (!n)
+            return 0;
+        m_SinceKey[chan] = 0;
+    }
+    else if (h.codec == FRAME_CODEC_DELTA) {
+        n = h.count;
+        if (n != m_PrevCount[chan])		// Missed the key frame
+            return 0;
+
+        uint32_t raw[FRAME_CODEC_MAX_PIXELS];
+        if (!DecodeVarints(in + sizeof(h), len - (int)sizeof(h), raw, n, max_pixels))
+            return 0;
+
+        ApplyDeltas(prev, raw, pixels, n);
+        m_SinceKey[chan]++;
+    }
+    else {
+        return 0;
+    }
+
+    memcpy(prev, pixels, n * sizeof(int32_t));
+    m_PrevCount[chan] = n;
+
+    return n;
+}
@@ -0,0 +1,66 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Compact frame encoding for archives and streaming.
+//
+// Every encoded frame starts with a FrameCodecHeader followed by:
+//
+//   FRAME_CODEC_PACKED	(value - base) packed LSB first at 'bits' bits per pixel.
+//						Corrected ULS24 pixels need 12-13 bits instead of 32.
+//   FRAME_CODEC_DELTA	zig-zag LEB128 varint of (value - previous value) per pixel,
+//						against the previous frame of the same channel. Frames of a
+//						kinetic run barely change, so most deltas fit in one byte.
+//
+// Delta frames need the decoder to have seen the previous frame of the same
+// channel. The encoder emits a packed key frame for the first frame of a
+// channel, when the frame size changes, and every FRAME_CODEC_KEY_INTERVAL
+// frames so a reader never has far to go back.
+///////////////////////////////////////////////////////////////////////////////
+
+#define FRAME_CODEC_PACKED			1
+#define FRAME_CODEC_DELTA			2
+
+#define FRAME_CODEC_MAX_PIXELS		(24 * 24)
+#define FRAME_CODEC_CHANNELS		5			// Indexed by channel number 1-4, 0 unused
+#define FRAME_CODEC_KEY_INTERVAL	64
+
+struct FrameCodecHeader {
+    uint8_t  codec;					// FRAME_CODEC_*
+    uint8_t  bits;					// Packed: bits per pixel
+    uint16_t count;					// Number of pixels
+    int32_t  base;					// Packed: value subtracted from every pixel
+};
+
+// Worst case: every delta needs a 5 byte varint
+#define FRAME_CODEC_MAX_BYTES		(sizeof(FrameCodecHeader) + FRAME_CODEC_MAX_PIXELS * 5)
+
+// Intra frame only, no state. Return bytes written / pixels decoded, 0 on error.
+int FramePack(const int32_t* pixels, int count, uint8_t* out);
+int FrameUnpack(const uint8_t* in, int len, int32_t* pixels, int max_count);
+
+// Holds the previous frame of each channel. Use one instance per direction
+// (one to encode, one to decode) and per stream.
+
+class CFrameCodec {
+public:
+    CFrameCodec();
+
+    void Reset();
+
+    // delta: allow delta frames; false always emits packed frames
+    int Encode(int chan, const int32_t* pixels, int count, bool delta, uint8_t* out);
+    // max_pixels: room at 'pixels'; larger frames are rejected, not truncated
+    int Decode(int chan, const uint8_t* in, int len, int32_t* pixels, int max_pixels);
+
+    // Frames encoded since the last key frame of 'chan', 0 right after a key frame
+    int SinceKey(int chan) const;
+
+protected:
+    int32_t m_Prev[FRAME_CODEC_CHANNELS][FRAME_CODEC_MAX_PIXELS];
+    int m_PrevCount[FRAME_CODEC_CHANNELS];
+    int m_SinceKey[FRAME_CODEC_CHANNELS];
+};
@@ -0,0 +1,76 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+
+// Frame level flags, OR'ed together in FrameMeta::flags
+#define FRAME_FLAG_OVERFLOW			0x01	// At least one pixel flagged as overflow by ADCCorrection (flag 1-4)
+#define FRAME_FLAG_UNDERFLOW		0x02	// At least one pixel flagged as underflow by ADCCorrection (flag 5-8)
+#define FRAME_FLAG_INCOMPLETE		0x04	// Not every row of the frame was received
+#define FRAME_FLAG_SENSOR_TIMEOUT	0x08	// Device returned error code 0xF1
+#define FRAME_FLAG_DARK				0x10	// Dark reference capture, LEDs off
+#define FRAME_FLAG_DARK_SUBTRACTED	0x20	// A cached dark frame was subtracted
+#define FRAME_FLAG_FLAT_FIELDED		0x40	// The channel's flat field gain map was applied
+#define FRAME_FLAG_DEFECTS_FIXED	0x80	// Defective pixels were replaced from their neighbours
+
+// Per-pixel flag values as produced by ADCCorrection / ADCCorrectioni
+#define PIXEL_FLAG_IS_OVERFLOW(f)	((f) >= 1 && (f) <= 4)
+#define PIXEL_FLAG_IS_UNDERFLOW(f)	((f) >= 5 && (f) <= 8)
+
+// Everything needed to interpret one captured frame, filled in by CInterfaceObject
+// when a capture completes. Kept as plain data so it can be handed to C callers.
+struct FrameMeta {
+    uint32_t seq;				// Capture sequence number, increments per completed capture
+    uint8_t  chan;				// Sensor channel 1-4
+    uint8_t  gain_mode;			// 0: high gain; 1: low gain
+    uint8_t  frame_size;		// 12 or 24
+    uint8_t  flags;				// FRAME_FLAG_*
+    float    int_time;			// Integration time in ms
+    float    temperature;		// Sensor temperature in degrees C the frame was compensated for, NAN if unknown
+    uint64_t timestamp_us;		// Wall clock time the last row arrived, microseconds since epoch
+};
+
+#define FRAME_MAX_SIZE	24
+#define WELL_MAX		64
+
+// One well of a frame, integrated by CWellMap as the rows arrive
+struct WellResult {
+    int32_t  sum;				// Weighted sum of the well's pixel values
+    float    mean;				// sum / total weight
+    uint16_t saturated;			// Pixels flagged as overflow
+    uint16_t pixels;			// Pixels in the well
+};
+
+// Pixel statistics of a frame, accumulated by FrameStatsRow() as the rows
+// arrive. Rows that never arrived count as zeros, as they read in pixels[].
+struct FrameStats {
+    int32_t  min;
+    int32_t  max;
+    int64_t  sum;
+    uint64_t sum_sq;			// Sum of squared pixel values
+    uint16_t nonzero;			// Pixels other than 0
+    uint16_t saturated;			// Pixels flagged as overflow
+    uint16_t underflow;			// Pixels flagged as underflow
+    uint16_t empty_rows;		// Rows with no pixel other than 0
+    uint32_t empty_row_mask;	// Bit per empty row
+    int32_t  row_sum[FRAME_MAX_SIZE];
+};
+
+// One frame with its per-pixel correction flags and description, the unit
+// the frame pool hands out. Rows are FRAME_MAX_SIZE wide whatever the frame size.
+struct FrameBuffer {
+    FrameMeta meta;
+    int      pixels[FRAME_MAX_SIZE][FRAME_MAX_SIZE];
+    uint8_t  flags[FRAME_MAX_SIZE][FRAME_MAX_SIZE];
+    FrameStats stats;
+    int      num_wells;			// Entries of wells[] in use
+    WellResult wells[WELL_MAX];
+};
+
+inline uint64_t FrameTimestampNow()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,55 @@
+// Copyright 2023, All rights reserved
+
+#include "FrameSnapshot.h"
+#include <cstring>
+#include <thread>
+
+CFrameSnapshot::CFrameSnapshot()
+    : m_Seq(0)
+{
+    for (size_t i = 0; i < WORDS; i++)
+        m_Words[i].store(0, std::memory_order_relaxed);
+}
+
+void CFrameSnapshot::Publish(const FrameBuffer& frame)
+{
+    uint64_t w[WORDS];
+    w[WORDS - 1] = 0;
+    memcpy(w, &frame, sizeof(FrameBuffer));
+
+    uint32_t seq = m_Seq.load(std::memory_order_relaxed);
+    m_Seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);	// Odd sequence before any word
+
+    for (size_t i = 0; i < WORDS; i++)
+        m_Words[i].store(w[i], std::memory_order_relaxed);
+
+    m_Seq.store(seq + 2, std::memory_order_release);
+}
+
+bool CFrameSnapshot::Read(FrameBuffer* out) const
+{
+    uint64_t w[WORDS];
+
+    for (int spins = 0; ; spins++) {
+        uint32_t s1 = m_Seq.load(std::memory_order_acquire);
+        if (!s1)
+            return false;
+
+        if (!(s1 & 1)) {
+            for (size_t i = 0; i < WORDS; i++)
+                w[i] = m_Words[i].load(std::memory_order_relaxed);
+
+            std::atomic_thread_fence(std::memory_order_acquire);	// Words before the second look
+            if (m_Seq.load(std::memory_order_relaxed) == s1)
+                break;
+        }
+
+        // Publishing takes a few microseconds; let the writer run if we keep colliding
+        if (spins >= 16)
+            std::this_thread::yield();
+    }
+
+    memcpy(out, w, sizeof(FrameBuffer));
+    return true;
+}
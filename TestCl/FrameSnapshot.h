@@ -0,0 +1,36 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include "FrameMeta.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Latest complete frame, published by the capture thread and readable from
+// any thread.
+//
+// A sequence lock: Publish() makes the sequence odd, stores the frame and
+// makes it even again; Read() copies the frame and retries if the sequence
+// was odd or moved while it copied. The writer never waits for readers and
+// readers take no lock, so a slow consumer cannot hold up acquisition and
+// never sees a frame that mixes two exposures.
+//
+// The frame is stored as relaxed atomic words so the racing copy is well
+// defined; on the targets we build for these are plain loads and stores.
+///////////////////////////////////////////////////////////////////////////////
+
+class CFrameSnapshot {
+public:
+    CFrameSnapshot();
+
+    void Publish(const FrameBuffer& frame);		// Capture thread only
+    bool Read(FrameBuffer* out) const;			// false until the first Publish()
+    uint32_t Published() const { return m_Seq.load(std::memory_order_acquire) / 2; }
+
+protected:
+    static const size_t WORDS = (sizeof(FrameBuffer) + 7) / 8;
+
+    std::atomic<uint32_t> m_Seq;
+    std::atomic<uint64_t> m_Words[WORDS];
+};
@@ -0,0 +1,185 @@
+// Copyright 2023, All rights reserved
+
+#include "FrameStats.h"
+#include <climits>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define STATS_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define STATS_NEON
+#endif
+
+static inline int BitCount(uint32_t v)
+{
+    int n = 0;
+    for (; v; v &= v - 1)
+        n++;
+    return n;
+}
+
+void FrameStatsBegin(FrameStats* st)
+{
+    memset(st, 0, sizeof(*st));
+    st->min = INT32_MAX;
+    st->max = INT32_MIN;
+}
+
+// Overflow flags are 1-4, underflow 5-8: (f - 1) and (f - 5) as unsigned bytes <= 3
+
+static void CountFlags(const uint8_t* flags, int n, int* saturated, int* underflow)
+{
+    int sat = 0, under = 0;
+    int i = 0;
+
+#if defined(STATS_SSE2)
+    __m128i one = _mm_set1_epi8(1);
+    __m128i five = _mm_set1_epi8(5);
+    __m128i three = _mm_set1_epi8(3);
+    for (; i + 8 <= n; i += 8) {
+        __m128i f = _mm_loadl_epi64((const __m128i*)(flags + i));
+        __m128i o = _mm_sub_epi8(f, one);
+        __m128i u = _mm_sub_epi8(f, five);
+        sat += BitCount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(o, three), o)) & 0xff);
+        under += BitCount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(u, three), u)) & 0xff);
+    }
+#elif defined(STATS_NEON)
+    uint8x8_t one = vdup_n_u8(1);
+    uint8x8_t five = vdup_n_u8(5);
+    uint8x8_t three = vdup_n_u8(3);
+    for (; i + 8 <= n; i += 8) {
+        uint8x8_t f = vld1_u8(flags + i);
+        uint8x8_t o = vshr_n_u8(vcle_u8(vsub_u8(f, one), three), 7);
+        uint8x8_t u = vshr_n_u8(vcle_u8(vsub_u8(f, five), three), 7);
+        sat += (int)vget_lane_u64(vpaddl_u32(vpaddl_u16(vpaddl_u8(o))), 0);
+        under += (int)vget_lane_u64(vpaddl_u32(vpaddl_u16(vpaddl_u8(u))), 0);
+    }
+#endif
+    for (; i < n; i++) {
+        if (PIXEL_FLAG_IS_OVERFLOW(flags[i])) sat++;
+        else if (PIXEL_FLAG_IS_UNDERFLOW(flags[i])) under++;
+    }
+
+    *saturated = sat;
+    *underflow = under;
+}
+
+void FrameStatsRow(FrameStats* st, int row, const int32_t* pixels, const uint8_t* flags, int n)
+{
+    int32_t lo, hi, sum;
+    uint64_t sq;
+    int nonzero;
+    int i = 0;
+
+#if defined(STATS_SSE2)
+    __m128i vlo = _mm_loadu_si128((const __m128i*)pixels);
+    __m128i vhi = vlo;
+    __m128i vsum = _mm_setzero_si128();
+    __m128i vsq = _mm_setzero_si128();
+    __m128i zero = _mm_setzero_si128();
+    nonzero = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(pixels + i));
+
+        // SSE2 has no 32 bit min/max: select through a compare mask
+        __m128i lt = _mm_cmplt_epi32(v, vlo);
+        vlo = _mm_or_si128(_mm_and_si128(lt, v), _mm_andnot_si128(lt, vlo));
+        __m128i gt = _mm_cmpgt_epi32(v, vhi);
+        vhi = _mm_or_si128(_mm_and_si128(gt, v), _mm_andnot_si128(gt, vhi));
+
+        vsum = _mm_add_epi32(vsum, v);
+        nonzero += 4 - BitCount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero))));
+
+        // |v| squared in 64 bit lanes, even and odd pixels separately
+        __m128i s = _mm_srai_epi32(v, 31);
+        __m128i a = _mm_sub_epi32(_mm_xor_si128(v, s), s);
+        vsq = _mm_add_epi64(vsq, _mm_mul_epu32(a, a));
+        a = _mm_srli_epi64(a, 32);
+        vsq = _mm_add_epi64(vsq, _mm_mul_epu32(a, a));
+    }
+
+    int32_t l[4], h[4], s4[4];
+    uint64_t q[2];
+    _mm_storeu_si128((__m128i*)l, vlo);
+    _mm_storeu_si128((__m128i*)h, vhi);
+    _mm_storeu_si128((__m128i*)s4, vsum);
+    _mm_storeu_si128((__m128i*)q, vsq);
+    lo = l[0]; hi = h[0];
+    for (int k = 1; k < 4; k++) {
+        if (l[k] < lo) lo = l[k];
+        if (h[k] > hi) hi = h[k];
+    }
+    sum = s4[0] + s4[1] + s4[2] + s4[3];
+    sq = q[0] + q[1];
+#elif defined(STATS_NEON)
+    int32x4_t vlo = vld1q_s32(pixels);
+    int32x4_t vhi = vlo;
+    int32x4_t vsum = vdupq_n_s32(0);
+    int64x2_t vsq = vdupq_n_s64(0);
+    uint32x4_t vnz = vdupq_n_u32(0);
+
+    for (; i + 4 <= n; i += 4) {
+        int32x4_t v = vld1q_s32(pixels + i);
+        vlo = vminq_s32(vlo, v);
+        vhi = vmaxq_s32(vhi, v);
+        vsum = vaddq_s32(vsum, v);
+        vnz = vsubq_u32(vnz, vtstq_s32(v, v));		// All ones per non-zero lane
+        vsq = vmlal_s32(vsq, vget_low_s32(v), vget_low_s32(v));
+        vsq = vmlal_s32(vsq, vget_high_s32(v), vget_high_s32(v));
+    }
+
+    int32x2_t l2 = vpmin_s32(vget_low_s32(vlo), vget_high_s32(vlo));
+    int32x2_t h2 = vpmax_s32(vget_low_s32(vhi), vget_high_s32(vhi));
+    lo = vget_lane_s32(vpmin_s32(l2, l2), 0);
+    hi = vget_lane_s32(vpmax_s32(h2, h2), 0);
+    int32x2_t s2 = vadd_s32(vget_low_s32(vsum), vget_high_s32(vsum));
+    sum = vget_lane_s32(s2, 0) + vget_lane_s32(s2, 1);
+    sq = (uint64_t)(vgetq_lane_s64(vsq, 0) + vgetq_lane_s64(vsq, 1));
+    uint32x2_t n2 = vadd_u32(vget_low_u32(vnz), vget_high_u32(vnz));
+    nonzero = (int)(vget_lane_u32(n2, 0) + vget_lane_u32(n2, 1));
+#else
+    lo = hi = pixels[0];
+    sum = 0;
+    sq = 0;
+    nonzero = 0;
+#endif
+    for (; i < n; i++) {
+        int32_t v = pixels[i];
+        if (v < lo) lo = v;
+        if (v > hi) hi = v;
+        sum += v;
+        sq += (uint64_t)((int64_t)v * v);
+        if (v) nonzero++;
+    }
+
+    int sat, under;
+    CountFlags(flags, n, &sat, &under);
+
+    if (lo < st->min) st->min = lo;
+    if (hi > st->max) st->max = hi;
+    st->sum += sum;
+    st->sum_sq += sq;
+    st->nonzero += (uint16_t)nonzero;
+    st->saturated += (uint16_t)sat;
+    st->underflow += (uint16_t)under;
+    st->row_sum[row] = sum;
+    if (!nonzero)
+        st->empty_row_mask |= 1u << row;
+}
+
+void FrameStatsEnd(FrameStats* st, int size, uint32_t row_mask)
+{
+    uint32_t all = (1u << size) - 1;
+    uint32_t missing = ~row_mask & all;
+
+    if (missing || !row_mask) {
+        if (st->min > 0 || !row_mask) st->min = 0;
+        if (st->max < 0 || !row_mask) st->max = 0;
+    }
+
+    st->empty_row_mask = (st->empty_row_mask & row_mask) | missing;
+    st->empty_rows = (uint16_t)BitCount(st->empty_row_mask);
+}
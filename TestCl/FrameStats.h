@@ -0,0 +1,21 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include "FrameMeta.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Frame statistics.
+//
+// Accumulated one row at a time, right after the row is corrected and while
+// it is still in cache, so the minimum, maximum, sums and flag counts of a
+// frame are known when its last row arrives. Rows are processed four pixels
+// at a time with SSE2 or NEON where available; row widths are multiples of 4.
+///////////////////////////////////////////////////////////////////////////////
+
+void FrameStatsBegin(FrameStats* st);
+void FrameStatsRow(FrameStats* st, int row, const int32_t* pixels, const uint8_t* flags, int n);
+
+// Rows not in row_mask were never received and count as zeros
+void FrameStatsEnd(FrameStats* st, int size, uint32_t row_mask);
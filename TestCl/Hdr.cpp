@@ -0,0 +1,226 @@
+// Copyright 2023, All rights reserved
+
+#include "Hdr.h"
+#include "DarkCache.h"
+#include "Log.h"
+#include <algorithm>
+#include <cstring>
+
+#define HDR_MAX_SAMPLES		256			// Older samples are halved in weight past this, so the ratio can follow drift
+#define HDR_MAX_SCALE		(1 << 24)
+
+CHdrMerge::CHdrMerge()
+    : m_Slot(0), m_Size(12), m_HighFirst(true), m_TimeRatio(1), m_Ready(false), m_KneeStep(0)
+{
+    DefaultParams(&m_Params);
+    memset(m_Out, 0, sizeof(m_Out));
+    memset(m_OutFlags, 0, sizeof(m_OutFlags));
+    memset(&m_Stats, 0, sizeof(m_Stats));
+    ClearCalibration(0);
+}
+
+void CHdrMerge::DefaultParams(HdrParams* p)
+{
+    p->knee_lo = 3000;
+    p->knee_hi = 3800;				// Still clear of the 12 bit ceiling
+}
+
+int CHdrMerge::Slot(int chan, int size)
+{
+    if (chan < 1 || chan > 4)
+        return -1;
+    return (chan - 1) * 2 + (size == 24 ? 1 : 0);
+}
+
+void CHdrMerge::ClearCalibration(int chan)
+{
+    for (int s = 0; s < 8; s++) {
+        if (chan && s / 2 != chan - 1)
+            continue;
+        memset(m_SumHL[s], 0, sizeof(m_SumHL[s]));
+        memset(m_SumLL[s], 0, sizeof(m_SumLL[s]));
+        memset(m_Samples[s], 0, sizeof(m_Samples[s]));
+        memset(m_Ratio[s], 0, sizeof(m_Ratio[s]));
+        m_Median[s] = 0;
+    }
+}
+
+bool CHdrMerge::Begin(int chan, int size, const int (*pixels)[FRAME_MAX_SIZE], const uint8_t (*flags)[FRAME_MAX_SIZE],
+    int gain, float int_time, float second_time)
+{
+    m_Slot = Slot(chan, size);
+    m_Size = size;
+    m_HighFirst = gain == 0;
+    m_TimeRatio = m_HighFirst ? int_time / second_time : second_time / int_time;
+
+    memcpy(m_First, pixels, sizeof(m_First));
+    memcpy(m_FirstFlags, flags, sizeof(m_FirstFlags));
+    memset(m_Out, 0, sizeof(m_Out));
+    memset(m_OutFlags, 0, sizeof(m_OutFlags));
+
+    int span = m_Params.knee_hi - m_Params.knee_lo;
+    m_KneeStep = span > 0 ? (1 << 16) / span : 0;
+
+    m_Ready = m_Slot >= 0 && PrepareScale();
+    return m_Ready;
+}
+
+// Pair scale per pixel: its ratio at equal time, times the time ratio
+
+bool CHdrMerge::PrepareScale()
+{
+    int median = m_Median[m_Slot];
+    if (!median)
+        return false;
+
+    for (int r = 0; r < m_Size; r++) {
+        for (int c = 0; c < m_Size; c++) {
+            int ratio = m_Ratio[m_Slot][r][c] ? m_Ratio[m_Slot][r][c] : median;
+            float scale = ratio * m_TimeRatio + 0.5f;
+            m_Scale[r][c] = scale > HDR_MAX_SCALE ? HDR_MAX_SCALE : (int32_t)scale;
+        }
+    }
+    return true;
+}
+
+void CHdrMerge::MergeRow(int row, const int* pixels, const uint8_t* flags)
+{
+    if (!m_Ready || row < 0 || row >= m_Size)
+        return;
+
+    const int* high = m_HighFirst ? m_First[row] : pixels;
+    const int* low = m_HighFirst ? pixels : m_First[row];
+    const uint8_t* hf = m_HighFirst ? m_FirstFlags[row] : flags;
+    const uint8_t* lf = m_HighFirst ? flags : m_FirstFlags[row];
+    const int32_t* scale = m_Scale[row];
+    int* out = m_Out[row];
+    uint8_t* of = m_OutFlags[row];
+
+    const int knee_lo = m_Params.knee_lo, knee_hi = m_Params.knee_hi;
+
+    for (int c = 0; c < m_Size; c++) {
+        int h = high[c] - DARK_PEDESTAL;
+        int l = (int)(((int64_t)(low[c] - DARK_PEDESTAL) * scale[c] + HDR_ONE / 2) >> HDR_Q);
+        int v;
+
+        if (PIXEL_FLAG_IS_OVERFLOW(hf[c]) || high[c] >= knee_hi) {
+            v = l;
+            of[c] = lf[c];
+        }
+        else if (high[c] < knee_lo) {
+            v = h;
+            of[c] = hf[c];
+        }
+        else {
+            int w = ((high[c] - knee_lo) * m_KneeStep) >> (16 - HDR_Q);		// Weight of low gain, Q8
+            v = (int)(((int64_t)h * (HDR_ONE - w) + (int64_t)l * w + HDR_ONE / 2) >> HDR_Q);
+            of[c] = hf[c];
+        }
+
+        v += DARK_PEDESTAL;
+        out[c] = v < 0 ? 0 : v;
+    }
+}
+
+bool CHdrMerge::End(const int (*pixels)[FRAME_MAX_SIZE], const uint8_t (*flags)[FRAME_MAX_SIZE])
+{
+    if (m_Slot < 0)
+        return false;
+
+    const int (*high)[FRAME_MAX_SIZE] = m_HighFirst ? m_First : pixels;
+    const int (*low)[FRAME_MAX_SIZE] = m_HighFirst ? pixels : m_First;
+    const uint8_t (*hf)[FRAME_MAX_SIZE] = m_HighFirst ? m_FirstFlags : flags;
+    const uint8_t (*lf)[FRAME_MAX_SIZE] = m_HighFirst ? flags : m_FirstFlags;
+
+    Calibrate(high, hf, low, lf);
+
+    if (!m_Ready) {
+        m_Ready = PrepareScale();
+        if (!m_Ready) {
+            LOG_WARN("HDR: no pixels to calibrate the gain ratio from");
+            return false;
+        }
+        for (int r = 0; r < m_Size; r++)
+            MergeRow(r, pixels[r], flags[r]);
+    }
+
+    m_Stats.pairs++;
+    m_Stats.from_low = 0;
+    m_Stats.saturated = 0;
+    for (int r = 0; r < m_Size; r++) {
+        for (int c = 0; c < m_Size; c++) {
+            if (PIXEL_FLAG_IS_OVERFLOW(hf[r][c]) || high[r][c] >= m_Params.knee_hi) {
+                m_Stats.from_low++;
+                if (PIXEL_FLAG_IS_OVERFLOW(lf[r][c]))
+                    m_Stats.saturated++;
+            }
+        }
+    }
+    return true;
+}
+
+void CHdrMerge::Calibrate(const int (*high)[FRAME_MAX_SIZE], const uint8_t (*high_flags)[FRAME_MAX_SIZE],
+    const int (*low)[FRAME_MAX_SIZE], const uint8_t (*low_flags)[FRAME_MAX_SIZE])
+{
+    int s = m_Slot;
+    uint16_t estimate[FRAME_MAX_SIZE * FRAME_MAX_SIZE];
+    int n = 0, own = 0;
+
+    for (int r = 0; r < m_Size; r++) {
+        for (int c = 0; c < m_Size; c++) {
+            int h = high[r][c] - DARK_PEDESTAL;
+            int l = low[r][c] - DARK_PEDESTAL;
+
+            if (!high_flags[r][c] && !low_flags[r][c] && high[r][c] < m_Params.knee_lo
+                && h >= HDR_MIN_SIGNAL && l >= HDR_MIN_LOW) {
+                if (m_Samples[s][r][c] >= HDR_MAX_SAMPLES) {
+                    m_SumHL[s][r][c] *= 0.5;
+                    m_SumLL[s][r][c] *= 0.5;
+                    m_Samples[s][r][c] /= 2;
+                }
+                m_SumHL[s][r][c] += h / m_TimeRatio * l;
+                m_SumLL[s][r][c] += (double)l * l;
+                m_Samples[s][r][c]++;
+            }
+
+            if (!m_Samples[s][r][c])
+                continue;
+
+            double ratio = m_SumHL[s][r][c] / m_SumLL[s][r][c];
+            ratio = std::min(std::max(ratio, 1.0), (double)HDR_MAX_RATIO);
+            uint16_t q = (uint16_t)(ratio * HDR_ONE + 0.5);
+
+            estimate[n++] = q;
+            if (m_Samples[s][r][c] >= HDR_MIN_SAMPLES) {
+                m_Ratio[s][r][c] = q;
+                own++;
+            }
+        }
+    }
+
+    if (n) {
+        std::nth_element(estimate, estimate + n / 2, estimate + n);
+        m_Median[s] = estimate[n / 2];
+    }
+    m_Stats.calibrated = own;
+}
+
+int CHdrMerge::Ratios(int chan, int size, float* ratio) const
+{
+    int s = Slot(chan, size);
+    if (s < 0)
+        return 0;
+
+    int own = 0;
+    for (int r = 0; r < size; r++) {
+        for (int c = 0; c < size; c++) {
+            int q = m_Ratio[s][r][c];
+            if (q)
+                own++;
+            else
+                q = m_Median[s];
+            ratio[r * size + c] = (float)q / HDR_ONE;
+        }
+    }
+    return own;
+}
@@ -0,0 +1,107 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include "FrameMeta.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// High dynamic range merge.
+//
+// A pair of frames of one channel, one in high gain and one in low gain,
+// merged into a frame in high gain counts that goes past the 12 bit range.
+// Below knee_lo the high gain pixel is used as is; above knee_hi, or when it
+// is flagged as overflow, the low gain pixel scaled by the gain ratio takes
+// its place; in between the two are blended linearly. Everything is in fixed
+// point, with the ratio in Q8.
+//
+// The ratio is calibrated per pixel from every pair, by least squares over
+// the pixels where neither frame is flagged and the high gain signal is
+// below knee_lo. Signals are normalised to the same integration time, so the
+// two gains may run at different times. Pixels with fewer than
+// HDR_MIN_SAMPLES samples use the median ratio of the others.
+//
+// The second frame is merged row by row as it arrives (MergeRow()), so the
+// merged frame is ready when its last row is in.
+///////////////////////////////////////////////////////////////////////////////
+
+#define HDR_Q				8
+#define HDR_ONE				(1 << HDR_Q)
+#define HDR_MAX_RATIO		64			// Largest believable high/low gain ratio
+#define HDR_MIN_SIGNAL		64			// High gain counts above the pedestal for a calibration sample
+#define HDR_MIN_LOW			8			// ... and low gain counts
+#define HDR_MIN_SAMPLES		4			// Before a pixel's own ratio replaces the median
+
+struct HdrParams {
+    int knee_lo;					// High gain counts where blending starts
+    int knee_hi;					// ... and where only the low gain frame is used
+};
+
+struct HdrStats {
+    uint32_t pairs;					// Pairs merged
+    uint32_t from_low;				// Pixels of the last merge taken only from low gain
+    uint32_t saturated;				// ... flagged as overflow in both frames
+    uint32_t calibrated;			// Pixels of the last channel with their own ratio
+};
+
+class CHdrMerge {
+public:
+    CHdrMerge();
+
+    static void DefaultParams(HdrParams* p);
+    void SetParams(const HdrParams& p) { m_Params = p; }
+    const HdrParams& Params() const { return m_Params; }
+
+    // First frame of a pair, in 'gain' at 'int_time'; the second is captured
+    // at the other gain at 'second_time'. false: the ratio is not known yet,
+    // MergeRow() does nothing and End() merges the whole frame.
+    bool Begin(int chan, int size, const int (*pixels)[FRAME_MAX_SIZE], const uint8_t (*flags)[FRAME_MAX_SIZE],
+        int gain, float int_time, float second_time);
+
+    // A row of the second frame, corrected
+    void MergeRow(int row, const int* pixels, const uint8_t* flags);
+
+    // The complete second frame: calibrates with the pair, merging again if
+    // Begin() had no ratio. false: no ratio even after calibrating.
+    bool End(const int (*pixels)[FRAME_MAX_SIZE], const uint8_t (*flags)[FRAME_MAX_SIZE]);
+
+    const int (*Merged() const)[FRAME_MAX_SIZE] { return m_Out; }
+    const uint8_t (*MergedFlags() const)[FRAME_MAX_SIZE] { return m_OutFlags; }
+
+    // Ratio of each pixel, row major size x size: its own, else the median,
+    // 0 before any calibration. Returns the number of pixels with their own.
+    int Ratios(int chan, int size, float* ratio) const;
+    void ClearCalibration(int chan);			// chan 0: every channel
+
+    const HdrStats& Stats() const { return m_Stats; }
+
+protected:
+    static int Slot(int chan, int size);
+    void Calibrate(const int (*high)[FRAME_MAX_SIZE], const uint8_t (*high_flags)[FRAME_MAX_SIZE],
+        const int (*low)[FRAME_MAX_SIZE], const uint8_t (*low_flags)[FRAME_MAX_SIZE]);
+    bool PrepareScale();
+
+    HdrParams m_Params;
+    int m_Slot;
+    int m_Size;
+    bool m_HighFirst;
+    float m_TimeRatio;				// High gain time over low gain time
+    bool m_Ready;					// m_Scale is valid for the pair
+
+    int m_First[FRAME_MAX_SIZE][FRAME_MAX_SIZE];
+    uint8_t m_FirstFlags[FRAME_MAX_SIZE][FRAME_MAX_SIZE];
+    int32_t m_Scale[FRAME_MAX_SIZE][FRAME_MAX_SIZE];	// Q8, low gain to high gain counts for the pair
+    int32_t m_KneeStep;				// Q16 reciprocal of knee_hi - knee_lo
+
+    int m_Out[FRAME_MAX_SIZE][FRAME_MAX_SIZE];
+    uint8_t m_OutFlags[FRAME_MAX_SIZE][FRAME_MAX_SIZE];
+
+    // Per channel and frame size: least squares sums at equal integration time
+    double m_SumHL[8][FRAME_MAX_SIZE][FRAME_MAX_SIZE];
+    double m_SumLL[8][FRAME_MAX_SIZE][FRAME_MAX_SIZE];
+    uint16_t m_Samples[8][FRAME_MAX_SIZE][FRAME_MAX_SIZE];
+    uint16_t m_Ratio[8][FRAME_MAX_SIZE][FRAME_MAX_SIZE];	// Q8, 0: none
+    uint16_t m_Median[8];
+
+    HdrStats m_Stats;
+};
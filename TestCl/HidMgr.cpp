@@ -4,6 +4,10 @@
 #include <string>
 #include "HidMgr.h"
 #include "TrimReader.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Cancel.h"
+#include "InputDrain.h"
 
 //Application global variables 
 
@@ -625,6 +629,7 @@ void ReadAndWriteToDevice()
 
 void ReadHIDInputReport()
 {
+	TRACE_SPAN("ReadHIDInputReport");
 
 	// Retrieve an Input report from the device.
 
@@ -654,15 +659,18 @@ void ReadHIDInputReport()
 
 	//	DisplayLastError("ReadFile: ") ;
 
-	//////////////////	 /*API call:WaitForSingleObject
+	//////////////////	 /*API call:WaitForMultipleObjects
 		'Used with overlapped ReadFile.
-		'Returns when ReadFile has received the requested amount of data or on timeout.
+		'Returns when ReadFile has received the requested amount of data, when the
+		'capture is cancelled (second handle) or on timeout.
 		'Requires an event object created with CreateEvent
 		'and a timeout value in milliseconds.
 		*/
 
-	Result = WaitForSingleObject
-	(hEventObject,
+	HANDLE WaitHandles[2] = { hEventObject, (HANDLE)CancelWaitHandle() };
+
+	Result = WaitForMultipleObjects
+	(2, WaitHandles, FALSE,
 		264000);	// timer out timer for USB packet, must be longer than longest int time -Zhimin Ding
 
 	long k;
@@ -673,6 +681,8 @@ void ReadHIDInputReport()
 	{
 	case WAIT_OBJECT_0:
 	{
+		MetricInc(METRIC_REPORTS_READ);
+
 		//
 		for (k = 0; k < HIDREPORTNUM - 1; k++)
 			RxData[k] = InputReport[k + 1];	//
@@ -724,6 +734,17 @@ void ReadHIDInputReport()
 		}
 		break;
 	}
+	case WAIT_OBJECT_0 + 1:
+	{
+		// Cancelled: abandon the read and wait for it to wind up so the overlapped
+		// structure and InputReport are free again. The device stays open.
+
+		CancelIo(ReadHandle);
+		GetOverlappedResult(ReadHandle, &HIDOverlapped, &NumberOfBytesRead, TRUE);
+		Continue_Flag = false;
+		ee_continue = false;
+		break;
+	}
 	case WAIT_TIMEOUT:
 	{
 		//		SetDlgItemText(IDC_STATICOpenComm, "ReadFile timeout");
@@ -735,6 +756,7 @@ void ReadHIDInputReport()
 				*/
 
 		Result = CancelIo(ReadHandle);
+		MetricInc(METRIC_READ_TIMEOUTS);
 
 		//A timeout may mean that the device has been removed. 
 		//Close the device handles and set MyDeviceDetected = False 
@@ -770,6 +792,63 @@ void ReadHIDInputReport()
 
 }
 
+// Reads whatever the HID driver has buffered, stopping at the first read
+// that would have to wait
+
+int DrainInputReports()
+{
+	TRACE_SPAN("DrainInputReports");
+
+	int n = 0;
+
+	if (ReadHandle == INVALID_HANDLE_VALUE || !ReadHandle)
+		return 0;
+
+	while (n < HIDBUFSIZE * 4)
+	{
+		BOOL got;
+
+		InputReport[0] = 0;
+		ResetEvent(hEventObject);
+
+		got = ReadFile
+		(ReadHandle,
+			InputReport,
+			Capabilities.InputReportByteLength,
+			&NumberOfBytesRead,
+			(LPOVERLAPPED)&HIDOverlapped
+		);
+
+		if (!got && GetLastError() == ERROR_IO_PENDING)
+		{
+			if (WaitForSingleObject(hEventObject, 0) != WAIT_OBJECT_0)
+			{
+				// Queue empty: abandon the read. It may have completed in
+				// between, in which case the report is stale too.
+				CancelIo(ReadHandle);
+				got = GetOverlappedResult(ReadHandle, &HIDOverlapped, &NumberOfBytesRead, TRUE);
+				if (got)
+				{
+					StaleReportNote((BYTE*)InputReport + 1);
+					n++;
+				}
+				break;
+			}
+			got = GetOverlappedResult(ReadHandle, &HIDOverlapped, &NumberOfBytesRead, FALSE);
+		}
+
+		if (!got)
+			break;
+
+		StaleReportNote((BYTE*)InputReport + 1);		// Skip the report number, as RxData does
+		n++;
+	}
+
+	ResetEvent(hEventObject);
+	StaleReportDrained(n);
+	return n;
+}
+
 void RegisterForDeviceNotifications()
 {
 
@@ -790,6 +869,7 @@ void RegisterForDeviceNotifications()
 
 void WriteHIDOutputReport()
 {
+	TRACE_SPAN("WriteHIDOutputReport");
 	//Send a report to the device.
 
 	DWORD	BytesWritten = 0;
@@ -838,5 +918,7 @@ void WriteHIDOutputReport()
 		//			SetDlgItemText(IDC_STATICOpenComm,"Can't write to device");
 		MyDeviceDetected = FALSE;
 	}
+	else
+		MetricInc(METRIC_REPORTS_WRITTEN);
 
 }}
\ No newline at end of file
@@ -51,6 +51,7 @@ bool FindTheHID();
 void CloseHandles();
 void DisplayInputReport();
 void DisplayReceivedData(char ReceivedByte);
+int DrainInputReports();		// Discard queued input reports without waiting, see InputDrain.h
 void GetDeviceCapabilities();
 void PrepareForOverlappedTransfer();
 void ReadAndWriteToDevice();
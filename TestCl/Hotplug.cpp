@@ -0,0 +1,177 @@
+// Copyright 2023, All rights reserved
+
+#include "Hotplug.h"
+#include "RtSched.h"
+#include "Log.h"
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#ifdef __linux__
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <linux/netlink.h>
+#endif
+
+bool HotplugParse(const char* msg, int len, uint16_t vid, uint16_t pid, HotplugEvent* ev)
+{
+    const char* action = NULL;
+    const char* subsystem = NULL;
+    const char* hid_id = NULL;
+    const char* uniq = NULL;
+
+    // First string is the "action@devpath" header, then KEY=VALUE pairs
+    int i = (int)strnlen(msg, len) + 1;
+    while (i < len) {
+        const char* kv = msg + i;
+        int n = (int)strnlen(kv, len - i);
+
+        if (!strncmp(kv, "ACTION=", 7)) action = kv + 7;
+        else if (!strncmp(kv, "SUBSYSTEM=", 10)) subsystem = kv + 10;
+        else if (!strncmp(kv, "HID_ID=", 7)) hid_id = kv + 7;
+        else if (!strncmp(kv, "HID_UNIQ=", 9)) uniq = kv + 9;
+
+        i += n + 1;
+    }
+
+    if (!action || !subsystem || !hid_id || strcmp(subsystem, "hid"))
+        return false;
+
+    bool add = !strcmp(action, "add");
+    if (!add && strcmp(action, "remove"))
+        return false;
+
+    // HID_ID=bus:vendor:product, hex
+    unsigned int bus, v, p;
+    if (sscanf(hid_id, "%x:%x:%x", &bus, &v, &p) != 3 || v != vid || p != pid)
+        return false;
+
+    ev->arrived = add;
+    ev->serial[0] = 0;
+    if (uniq) {
+        strncpy(ev->serial, uniq, HOTPLUG_SERIAL_LEN - 1);
+        ev->serial[HOTPLUG_SERIAL_LEN - 1] = 0;
+    }
+    return true;
+}
+
+#ifdef __linux__
+
+static std::mutex g_HotplugLock;
+static std::thread g_HotplugThread;
+static int g_HotplugSock = -1;
+static int g_HotplugStopFd = -1;
+
+static void HotplugThread(uint16_t vid, uint16_t pid, HotplugCallback cb, void* ctx)
+{
+    CRtWorkerThread worker;
+    char buf[8192];
+
+    for (;;) {
+        struct pollfd p[2];
+        p[0].fd = g_HotplugSock;
+        p[0].events = POLLIN;
+        p[1].fd = g_HotplugStopFd;
+        p[1].events = POLLIN;
+
+        if (poll(p, 2, -1) < 0)
+            continue;
+        if (p[1].revents & POLLIN)
+            break;
+        if (!(p[0].revents & POLLIN))
+            continue;
+
+        int n = (int)recv(g_HotplugSock, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+        if (n <= 0)
+            continue;
+        buf[n] = 0;
+
+        HotplugEvent ev;
+        if (HotplugParse(buf, n, vid, pid, &ev)) {
+            LOG_INFO("Hotplug: device %s, serial '%s'", ev.arrived ? "arrived" : "removed", ev.serial);
+            cb(ev, ctx);
+        }
+    }
+}
+
+int HotplugStart(uint16_t vid, uint16_t pid, HotplugCallback cb, void* ctx)
+{
+    std::lock_guard<std::mutex> lock(g_HotplugLock);
+
+    if (g_HotplugThread.joinable())
+        return 1;
+
+    g_HotplugSock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (g_HotplugSock < 0) {
+        LOG_WARN("Hotplug: cannot open uevent socket");
+        return 0;
+    }
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;					// Kernel uevents
+    if (bind(g_HotplugSock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        LOG_WARN("Hotplug: cannot bind uevent socket");
+        close(g_HotplugSock);
+        g_HotplugSock = -1;
+        return 0;
+    }
+
+    g_HotplugStopFd = eventfd(0, EFD_CLOEXEC);
+    g_HotplugThread = std::thread(HotplugThread, vid, pid, cb, ctx);
+    return 1;
+}
+
+void HotplugStop()
+{
+    std::lock_guard<std::mutex> lock(g_HotplugLock);
+
+    if (!g_HotplugThread.joinable())
+        return;
+
+    uint64_t one = 1;
+    if (write(g_HotplugStopFd, &one, sizeof(one)) < 0) {
+        // The thread also stops when the socket closes below
+    }
+    g_HotplugThread.join();
+
+    close(g_HotplugSock);
+    close(g_HotplugStopFd);
+    g_HotplugSock = -1;
+    g_HotplugStopFd = -1;
+}
+
+bool HotplugRunning()
+{
+    std::lock_guard<std::mutex> lock(g_HotplugLock);
+    return g_HotplugThread.joinable();
+}
+
+// A joinable std::thread must not be destroyed, stop the monitor on unload
+static struct CHotplugExitStop {
+    ~CHotplugExitStop()
+    {
+        HotplugStop();
+    }
+} g_HotplugExitStop;
+
+#else
+
+int HotplugStart(uint16_t, uint16_t, HotplugCallback, void*)
+{
+    return 0;
+}
+
+void HotplugStop()
+{
+}
+
+bool HotplugRunning()
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,35 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Device arrival / removal monitor.
+//
+// On Linux a background thread listens to kernel uevents on a netlink socket
+// (no libudev needed) and reports "hid" subsystem add / remove events whose
+// HID_ID matches the vendor and product asked for. The HID_UNIQ field gives
+// the device serial, so a caller can tell its own device from others.
+//
+// Windows: not implemented, HotplugStart() returns 0 (device notifications
+// need a window handle, see RegisterForDeviceNotifications in HidMgr.cpp).
+///////////////////////////////////////////////////////////////////////////////
+
+#define HOTPLUG_SERIAL_LEN	64
+
+struct HotplugEvent {
+    bool arrived;					// false: removed
+    char serial[HOTPLUG_SERIAL_LEN];	// Empty if the device has none
+};
+
+// Called on the monitor thread
+typedef void (*HotplugCallback)(const HotplugEvent& ev, void* ctx);
+
+int  HotplugStart(uint16_t vid, uint16_t pid, HotplugCallback cb, void* ctx);	// 1: success; 0: error or not supported
+void HotplugStop();
+bool HotplugRunning();
+
+// Parses one uevent message ("action@devpath\0KEY=VALUE\0..."). Returns true
+// and fills 'ev' if it is an add / remove of a matching HID device.
+bool HotplugParse(const char* msg, int len, uint16_t vid, uint16_t pid, HotplugEvent* ev);
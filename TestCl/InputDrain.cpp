@@ -0,0 +1,50 @@
+// Copyright 2023, All rights reserved
+
+#include "InputDrain.h"
+#include "HidMgr.h"
+#include "Log.h"
+#include "Metrics.h"
+#include <atomic>
+
+static std::atomic<uint32_t> g_StaleDrains(0);
+static std::atomic<uint32_t> g_StaleReports(0);
+static std::atomic<uint32_t> g_StaleRows(0);
+static std::atomic<uint32_t> g_StaleResponses(0);
+static std::atomic<uint32_t> g_StaleLast(0);		// cmd << 8 | type
+
+void StaleReportNote(const uint8_t* rx)
+{
+    uint8_t cmd = rx[2];
+    uint8_t type = rx[4];
+
+    g_StaleReports.fetch_add(1, std::memory_order_relaxed);
+    if (cmd == GetCmd)
+        g_StaleRows.fetch_add(1, std::memory_order_relaxed);
+    else
+        g_StaleResponses.fetch_add(1, std::memory_order_relaxed);
+    g_StaleLast.store((uint32_t)cmd << 8 | type, std::memory_order_relaxed);
+
+    MetricInc(METRIC_STALE_REPORTS);
+    LOG_DEBUG("Stale report: cmd 0x%02x, type 0x%02x, row 0x%02x", cmd, type, rx[5]);
+}
+
+void StaleReportDrained(int count)
+{
+    if (count <= 0)
+        return;
+
+    g_StaleDrains.fetch_add(1, std::memory_order_relaxed);
+    LOG_INFO("Discarded %d stale input reports", count);
+}
+
+void StaleReportGetStats(StaleReportStats* out)
+{
+    uint32_t last = g_StaleLast.load(std::memory_order_relaxed);
+
+    out->drains = g_StaleDrains.load(std::memory_order_relaxed);
+    out->reports = g_StaleReports.load(std::memory_order_relaxed);
+    out->rows = g_StaleRows.load(std::memory_order_relaxed);
+    out->responses = g_StaleResponses.load(std::memory_order_relaxed);
+    out->last_cmd = (uint8_t)(last >> 8);
+    out->last_type = (uint8_t)last;
+}
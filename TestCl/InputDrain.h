@@ -0,0 +1,33 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Stale input reports.
+//
+// Rows left over from a cancelled or timed out capture, or a response nobody
+// read, sit in the HID input queue and would be taken for the answer to the
+// next command. Every transport implements DrainInputReports() (HidMgr.h),
+// which discards what is queued without waiting; CInterfaceObject runs it
+// before each command. The transports pass each discarded report, in RxData
+// layout, to StaleReportNote() so it is counted by command and type.
+//
+// HidMgr.cpp (Windows) and DeviceSim implement it. The Linux hidapi transport
+// is not part of this tree; it must implement it too, reading its handle
+// with hid_read_timeout(..., 0) until nothing is left.
+///////////////////////////////////////////////////////////////////////////////
+
+struct StaleReportStats {
+    uint32_t drains;				// Drains that found something
+    uint32_t reports;				// Reports discarded
+    uint32_t rows;					// ... of which pixel rows (GetCmd)
+    uint32_t responses;				// ... of which other command responses
+    uint8_t last_cmd;				// Command and type bytes of the last one
+    uint8_t last_type;
+};
+
+void StaleReportNote(const uint8_t* rx);
+void StaleReportDrained(int count);		// After a drain that discarded 'count' reports
+void StaleReportGetStats(StaleReportStats* out);
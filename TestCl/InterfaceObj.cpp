@@ -3,6 +3,22 @@
 
 #include "InterfaceObj.h"
 #include "HidMgr.h"
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <string>
+#ifndef _WIN32
+#include <unistd.h>
+#include <limits.h>
+#include <thread>
+#include <chrono>
+#endif
+#include "Log.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "RtSched.h"
+#include "AllocCheck.h"
+#include "Cancel.h"
 
 extern BYTE TxData[TxNum];		// the buffer of sent data to HID
 extern BYTE RxData[RxNum];		// the buffer of received data from HID
@@ -17,17 +33,75 @@ int frame_size = 0;				// 0: 12x12 frame; 1: 24x24 frame
 extern BOOL Continue_Flag;
 extern BOOL ee_continue;
 
+#ifdef _WIN32
 TCHAR g_CurrentDirectory[MAX_PATH];
+#else
+char g_CurrentDirectory[PATH_MAX];
+
+static void Sleep(int ms)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+#endif
 
 CInterfaceObject::CInterfaceObject()
 {
 	cur_chan = 1;
+
+	m_FrameSeq = 0;
+	m_CaptureSize = 0;
+	m_RowMask = 0;
+	m_FrameFlags = 0;
+	m_Assembly = NULL;
+	m_DarkActive = false;
+	m_DarkCapturing = false;
+	m_ActiveFlat = NULL;
+	m_FlatCapturing = false;
+	m_ActiveDefects = NULL;
+	m_DefectSurveying = false;
+	m_FrameGain = 0;
+	m_FrameIntTime = 1;
+	m_HdrMerging = false;
+	m_FrameTemp = NAN;
+	m_TempOffset = 0;
+
+	for (int i = 0; i < 4; i++) {
+		m_SensorConfig[i].gain = 1;
+		m_SensorConfig[i].int_time = 1;
+		m_SensorConfig[i].txbin = 0x8;
+	}
+	m_LEDConfig[0] = 1;
+	m_LEDConfig[1] = m_LEDConfig[2] = m_LEDConfig[3] = m_LEDConfig[4] = 0;
+
+	memset(frame_data, 0, sizeof(frame_data));
+	memset(flag_data, 0, sizeof(flag_data));
+	memset(&frame_meta, 0, sizeof(frame_meta));
+	memset(&frame_stats, 0, sizeof(frame_stats));
+
+	// Candidates for locking, see RtSchedConfigure()
+	RtSchedRegisterBuffer(this, sizeof(*this));
+	RtSchedRegisterBuffer(TxData, sizeof(TxData));
+	RtSchedRegisterBuffer(RxData, sizeof(RxData));
+}
+
+CInterfaceObject::~CInterfaceObject()
+{
+	RtSchedUnregisterBuffer(this);
+	RtSchedUnregisterBuffer(TxData);
+	RtSchedUnregisterBuffer(RxData);
 }
 
+#ifdef _WIN32
 CString CInterfaceObject::GetChipName()
 {
 	return m_TrimReader.Node[0].name;
 }
+#else
+const char* CInterfaceObject::GetChipName()
+{
+	return m_TrimReader.Node[0].name.c_str();
+}
+#endif
 
 /////////////////////////////////////////////////////////////////////////////
 // Below are interfaces to set ULS24 internal parameters - called trim data. 
@@ -80,18 +154,14 @@ void CInterfaceObject::SetV15(BYTE v15)
 {
 	m_TrimReader.SetV15(v15);
 
-	WriteHIDOutputReport();		// 
-	memset(TxData, 0, sizeof(TxData));
-	ReadHIDInputReport();
+	Transact();
 }
 
 void CInterfaceObject::SetV20(BYTE v20)
 {
 	m_TrimReader.SetV20(v20);
 
-	WriteHIDOutputReport();		// 
-	memset(TxData, 0, sizeof(TxData));
-	ReadHIDInputReport();
+	Transact();
 }
 
 
@@ -99,11 +169,10 @@ void CInterfaceObject::SetGainMode(int gain)
 {
 	m_TrimReader.SetGainMode(gain);
 
-	WriteHIDOutputReport();		// 
-	memset(TxData, 0, sizeof(TxData));
-	ReadHIDInputReport();
+	Transact();
 
 	gain_mode = gain;
+	m_SensorConfig[cur_chan - 1].gain = gain;
 
 	// When gain mode change, V20 needs to change also
 	if (!gain) SetV20(m_TrimReader.Node[cur_chan - 1].auto_v20[1]); // auto_v20_hg);
@@ -114,27 +183,23 @@ void  CInterfaceObject::SetRangeTrim(BYTE range)
 {
 	m_TrimReader.SetRangeTrim(range);
 
-	WriteHIDOutputReport();		// 
-	memset(TxData, 0, sizeof(TxData));
-	ReadHIDInputReport();
+	Transact();
 }
 
 void  CInterfaceObject::SetRampgen(BYTE rampgen)
 {
 	m_TrimReader.SetRampgen(rampgen);
 
-	WriteHIDOutputReport();		// 
-	memset(TxData, 0, sizeof(TxData));
-	ReadHIDInputReport();
+	Transact();
 }
 
 void  CInterfaceObject::SetTXbin(BYTE txbin)
 {
 	m_TrimReader.SetTXbin(txbin);
 
-	WriteHIDOutputReport();		// 
-	memset(TxData, 0, sizeof(TxData));
-	ReadHIDInputReport();
+	Transact();
+
+	m_SensorConfig[cur_chan - 1].txbin = txbin;
 }
 
 ///////////////////////////////////////////////////////
@@ -145,28 +210,57 @@ void  CInterfaceObject::SetIntTime(float it)
 {
 	m_TrimReader.SetIntTime(it);
 
-	WriteHIDOutputReport();		// 
-	memset(TxData, 0, sizeof(TxData));
-	ReadHIDInputReport();
+	Transact();
 
 	int_time = it;
+	m_SensorConfig[cur_chan - 1].int_time = it;
 }
 
 void  CInterfaceObject::SelSensor(BYTE chan)
 {
 	m_TrimReader.SelSensor(chan);
 
-	WriteHIDOutputReport();		// 
-	memset(TxData, 0, sizeof(TxData));
-	ReadHIDInputReport();
+	Transact();
 
 	cur_chan = (int)chan;
 }
 
+// For probes that must not block in the transport's read: the caller waits
+// for the answer itself
+
+void CInterfaceObject::SendSelSensor()
+{
+	DrainInputReports();
+	m_TrimReader.SelSensor((BYTE)cur_chan);
+	WriteHIDOutputReport();
+	memset(TxData, 0, sizeof(TxData));
+}
+
 void  CInterfaceObject::SetLEDConfig(BOOL IndvEn, BOOL Chan1, BOOL Chan2, BOOL Chan3, BOOL Chan4)
 {
 	m_TrimReader.SetLEDConfig(IndvEn, Chan1, Chan2, Chan3, Chan4);
 
+	Transact();
+
+	m_LEDConfig[0] = IndvEn;
+	m_LEDConfig[1] = Chan1;
+	m_LEDConfig[2] = Chan2;
+	m_LEDConfig[3] = Chan3;
+	m_LEDConfig[4] = Chan4;
+}
+
+// Send the command prepared in TxData and read back its response
+
+void CInterfaceObject::Transact()
+{
+	TRACE_SPAN("Command", TxData[3]);
+	CMetricTimer t(METRIC_HIST_COMMAND_US);
+
+	// Cancellation is cleared only where an API call starts: a setter run inside
+	// a cancelled operation returns without waiting for its response, which
+	// the drain before the next command discards
+	DrainInputReports();
+
 	WriteHIDOutputReport();		// 
 	memset(TxData, 0, sizeof(TxData));
 	ReadHIDInputReport();
@@ -174,18 +268,206 @@ void  CInterfaceObject::SetLEDConfig(BOOL IndvEn, BOOL Chan1, BOOL Chan2, BOOL C
 
 void CInterfaceObject::ProcessRowData()
 {
-	frame_size = m_TrimReader.ProcessRowData(frame_data, gain_mode);
+	{
+		TRACE_SPAN("ProcessRowData", RxData[5]);
+		CMetricTimer t(METRIC_HIST_CORRECTION_NS, true);
+		frame_size = m_TrimReader.ProcessRowData(m_Assembly ? m_Assembly->pixels : frame_data, m_Assembly ? m_FrameGain : gain_mode);
+	}
+
+	if (!m_CaptureSize || RxData[2] != GetCmd)
+		return;
+
+	if (RxData[5] == 0xf1) {					// Sensor communication time out
+		m_FrameFlags |= FRAME_FLAG_SENSOR_TIMEOUT;
+		MetricInc(METRIC_SENSOR_TIMEOUTS);
+		return;
+	}
+
+	int row = RxData[5];
+	if (row >= m_CaptureSize)
+		return;
+
+	bool repeat = (m_RowMask & (1u << row)) != 0;	// Already counted in the statistics and wells
+	m_RowMask |= 1u << row;
+
+	CorrectRow(row);
+
+	// Keep the per-pixel correction flags alongside the pixel values
+	memcpy(m_Assembly->flags[row], m_TrimReader.pixel_flag, m_CaptureSize);
+
+	if (!repeat) {
+		FrameStatsRow(&m_Assembly->stats, row, m_Assembly->pixels[row], m_Assembly->flags[row], m_CaptureSize);
+		m_WellMap.AccumulateRow(row, m_Assembly->pixels[row], m_Assembly->flags[row]);
+	}
+
+	if (m_HdrMerging)
+		m_Hdr.MergeRow(row, m_Assembly->pixels[row], m_Assembly->flags[row]);
+}
+
+void CInterfaceObject::BeginFrame(int size, BYTE chan)
+{
+	m_CaptureSize = size;
+	m_RowMask = 0;
+	m_FrameFlags = 0;
+	m_FrameStart = std::chrono::steady_clock::now();
+
+	// Rows that never arrive read as 0 rather than as the previous frame's
+	m_Assembly = m_FramePool.IsOpen() ? (FrameBuffer*)m_FramePool.Acquire() : NULL;
+	if (!m_Assembly) {
+		if (m_FramePool.IsOpen())
+			MetricInc(METRIC_FRAME_POOL_EXHAUSTED);
+		m_Assembly = &m_SpareFrame;
+	}
+	memset(m_Assembly->pixels, 0, sizeof(m_Assembly->pixels));
+	memset(m_Assembly->flags, 0, sizeof(m_Assembly->flags));
+
+	// The captured sensor's own settings: the globals follow the selected one
+	m_FrameGain = chan >= 1 && chan <= 4 ? m_SensorConfig[chan - 1].gain : gain_mode;
+	m_FrameIntTime = chan >= 1 && chan <= 4 ? m_SensorConfig[chan - 1].int_time : int_time;
+
+	// Resolved once per frame, applied row by row in CorrectRow()
+	double dark_temp = NAN;
+	m_DarkActive = !m_DarkCapturing && !m_DefectSurveying && m_DarkCache.Lookup(chan, m_FrameGain, size, m_FrameIntTime, m_ActiveDark, &dark_temp);
+	m_ActiveFlat = m_FlatCapturing || m_DefectSurveying ? NULL : m_FlatField.Row(chan, size, 0);
+	m_ActiveDefects = m_DefectSurveying ? NULL : m_DefectMap.Rows(chan, size);
+
+	// Dark frames keep the raw level, the drift is fitted from them
+	m_FrameTemp = m_TempComp.Temperature(chan);
+	m_TempOffset = m_DarkCapturing || m_DefectSurveying ? 0 : m_TempComp.Offset(chan, m_FrameGain, m_FrameTemp, m_DarkActive, dark_temp);
+
+	FrameStatsBegin(&m_Assembly->stats);
+	m_WellMap.BeginFrame(size);
+}
+
+// Corrections that ADCCorrection does not make, applied to each row as it
+// arrives while it is still in cache
+
+void CInterfaceObject::CorrectRow(int row)
+{
+	static const int no_dark[FRAME_MAX_SIZE] = { 0 };
+	static const uint16_t no_flat[FRAME_MAX_SIZE] = {
+		FLAT_ONE, FLAT_ONE, FLAT_ONE, FLAT_ONE, FLAT_ONE, FLAT_ONE, FLAT_ONE, FLAT_ONE,
+		FLAT_ONE, FLAT_ONE, FLAT_ONE, FLAT_ONE, FLAT_ONE, FLAT_ONE, FLAT_ONE, FLAT_ONE,
+		FLAT_ONE, FLAT_ONE, FLAT_ONE, FLAT_ONE, FLAT_ONE, FLAT_ONE, FLAT_ONE, FLAT_ONE };
+
+	int* p = m_Assembly->pixels[row];
+
+	if (m_DarkActive || m_ActiveFlat || m_TempOffset) {
+		// One pass: dark and temperature drift, then gain on the signal above the pedestal
+		const int* d = m_DarkActive ? m_ActiveDark[row] : no_dark;
+		const uint16_t* g = m_ActiveFlat ? m_ActiveFlat + row * FRAME_MAX_SIZE : no_flat;
+		int pedestal = (m_DarkActive ? DARK_PEDESTAL : 0) - m_TempOffset;
+
+		for (int i = 0; i < m_CaptureSize; i++) {
+			int v = p[i] - d[i] + pedestal - DARK_PEDESTAL;
+			v = ((v * g[i] + FLAT_ROUND) >> FLAT_Q) + DARK_PEDESTAL;
+			p[i] = v < 0 ? 0 : v;
+		}
+	}
+
+	// Defective pixels last, from corrected neighbours
+	if (m_ActiveDefects && m_ActiveDefects[row].count)
+		CDefectMap::Apply(m_ActiveDefects[row], p);
+}
+
+void CInterfaceObject::EndFrame(BYTE chan)
+{
+	MetricRecord(METRIC_HIST_FRAME_US, (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - m_FrameStart).count());
+	MetricInc(METRIC_FRAMES);
+
+	if (m_RowMask != (1u << m_CaptureSize) - 1) {
+		int rows = 0;
+		for (uint32_t m = m_RowMask; m; m &= m - 1)
+			rows++;
+
+		m_FrameFlags |= FRAME_FLAG_INCOMPLETE;
+		MetricInc(METRIC_FRAMES_INCOMPLETE);
+		MetricInc(METRIC_ROWS_DROPPED, m_CaptureSize - rows);
+	}
+
+	FrameStatsEnd(&m_Assembly->stats, m_CaptureSize, m_RowMask);
+	if (m_Assembly->stats.saturated) m_FrameFlags |= FRAME_FLAG_OVERFLOW;
+	if (m_Assembly->stats.underflow) m_FrameFlags |= FRAME_FLAG_UNDERFLOW;
+
+	FrameMeta& meta = m_Assembly->meta;
+	meta.seq = ++m_FrameSeq;
+	meta.chan = chan;
+	meta.gain_mode = (uint8_t)m_FrameGain;
+	meta.frame_size = (uint8_t)m_CaptureSize;
+	if (m_DarkActive) m_FrameFlags |= FRAME_FLAG_DARK_SUBTRACTED;
+	if (m_DarkCapturing) m_FrameFlags |= FRAME_FLAG_DARK;
+	if (m_ActiveFlat) m_FrameFlags |= FRAME_FLAG_FLAT_FIELDED;
+	if (m_ActiveDefects) m_FrameFlags |= FRAME_FLAG_DEFECTS_FIXED;
+	meta.flags = m_FrameFlags;
+	meta.int_time = m_FrameIntTime;
+	meta.temperature = (float)m_FrameTemp;
+	meta.timestamp_us = FrameTimestampNow();
+
+	m_Assembly->num_wells = m_WellMap.EndFrame(m_Assembly->wells);
+
+	m_CaptureSize = 0;
+
+	if (m_Recorder.IsOpen())
+		m_Recorder.Append(meta, &m_Assembly->pixels[0][0], FRAME_MAX_SIZE);
+
+	m_Latest.Publish(*m_Assembly);
+
+	// The public arrays only ever hold complete frames. Other threads must
+	// read through ReadLatestFrame(), these are rewritten on every capture.
+	memcpy(frame_data, m_Assembly->pixels, sizeof(frame_data));
+	memcpy(flag_data, m_Assembly->flags, sizeof(flag_data));
+	frame_meta = meta;
+	frame_stats = m_Assembly->stats;
+
+	if (m_Assembly != &m_SpareFrame)
+		m_FramePool.Release(m_Assembly);
+	m_Assembly = NULL;
+}
+
+// Cancelled capture: the partial frame is dropped, the published frame and
+// the public arrays keep the last complete one
+
+void CInterfaceObject::AbortFrame()
+{
+	m_CaptureSize = 0;
+
+	if (m_Assembly != &m_SpareFrame)
+		m_FramePool.Release(m_Assembly);
+	m_Assembly = NULL;
+}
+
+int CInterfaceObject::OpenPools(int frames)
+{
+	if (m_Assembly || m_FramePool.InUse())
+		return 0;
+
+	return m_FramePool.Open(sizeof(FrameBuffer), frames);
+}
+
+void CInterfaceObject::OpenFramePool()
+{
+	// A size set by pool_configure() is kept across resets
+	if (!m_FramePool.IsOpen())
+		OpenPools(FRAME_POOL_DEFAULT);
 }
 
 int  CInterfaceObject::CaptureFrame12(BYTE chan)
 {
-	// Issue capture command
+	TRACE_SPAN("CaptureFrame12", chan);
+	CRtCaptureScope rt;
+	CAllocFrameCheck alloc;
 
+	// Issue capture command, with nothing left in the input queue that could
+	// pass for one of its rows
+
+	DrainInputReports();
 	m_TrimReader.Capture12(chan);
 	WriteHIDOutputReport();		// 
 	memset(TxData, 0, sizeof(TxData));
 
 	// Read and process result
+	BeginFrame(12, chan);
 	Continue_Flag = true;
 
 	while (Continue_Flag) {		// Process data row by row
@@ -195,6 +477,13 @@ int  CInterfaceObject::CaptureFrame12(BYTE chan)
 		memset(RxData, 0, sizeof(RxData));
 	}
 
+	if (CancelPending()) {
+		AbortFrame();
+		return 1;
+	}
+
+	EndFrame(chan);
+
 	// Application developer can add code here to further process 
 	// the data, that is save in "adc_result[24][24]
 
@@ -203,12 +492,18 @@ int  CInterfaceObject::CaptureFrame12(BYTE chan)
 
 int  CInterfaceObject::CaptureFrame24()
 {
-	// Issue capture command
+	TRACE_SPAN("CaptureFrame24", cur_chan);
+	CRtCaptureScope rt;
+	CAllocFrameCheck alloc;
+
+	// Issue capture command, on an empty input queue
+	DrainInputReports();
 	m_TrimReader.Capture24();
 	WriteHIDOutputReport();		// 
 	memset(TxData, 0, sizeof(TxData));
 
 	// Read and process result
+	BeginFrame(24, (BYTE)cur_chan);
 	Continue_Flag = true;
 
 	while (Continue_Flag) {		// Process data row by row
@@ -218,6 +513,13 @@ int  CInterfaceObject::CaptureFrame24()
 		memset(RxData, 0, sizeof(RxData));
 	}
 
+	if (CancelPending()) {
+		AbortFrame();
+		return 1;
+	}
+
+	EndFrame((BYTE)cur_chan);
+
 	// Application developer can add code here to further process 
 	// the data, that is save in "adc_result[24][24]
 
@@ -226,6 +528,13 @@ int  CInterfaceObject::CaptureFrame24()
 
 int  CInterfaceObject::LoadTrimFile()
 {
+#ifndef _WIN32
+	if (!getcwd(g_CurrentDirectory, sizeof(g_CurrentDirectory)))
+		return 0;
+
+	std::string path = std::string(g_CurrentDirectory) + "/Trim/trim.dat";
+	int e = m_TrimReader.Load((TCHAR*)path.c_str());
+#else
 	GetCurrentDirectory(MAX_PATH, g_CurrentDirectory);
 
 	CString path;
@@ -235,17 +544,24 @@ int  CInterfaceObject::LoadTrimFile()
 	LPTSTR lpszData = path.GetBuffer(path.GetLength());
 	int e = m_TrimReader.Load((TCHAR*)lpszData);
 	path.ReleaseBuffer(0);
+#endif
 
 	if (e) {
 		m_TrimReader.Parse();
+		m_DarkCache.Invalidate();
+		LoadFlatField(NULL);				// Flat maps live beside the trim, if there are any
+		LoadExposureCache(NULL);
 	}
 
 	return e;
 }
 
-void CInterfaceObject::ReadTrimData()	// From flash
+bool CInterfaceObject::ReadTrimData()	// From flash
 {
+	TRACE_SPAN("ReadTrimData");
+	CRtCaptureScope rt;
 
+	DrainInputReports();
 	m_TrimReader.EEPROMRead();
 
 	WriteHIDOutputReport();		// 
@@ -257,9 +573,512 @@ void CInterfaceObject::ReadTrimData()	// From flash
 		memset(RxData, 0, sizeof(RxData));
 	}
 
+	// A partly read EEPROM image is not a trim; keep the one loaded
+	if (CancelPending()) {
+		LOG_WARN("Trim read cancelled, previous trim kept");
+		return false;
+	}
+
 	m_TrimReader.ReadTrimData();
+	m_DarkCache.Invalidate();
+	m_WellMap.BuildFromFormat(m_TrimReader.num_wells, m_TrimReader.well_format);
 
 	ResetTrim();
+	return true;
+}
+
+// A device that was unplugged comes back with power on defaults. Read its trim
+// again (which also resets every sensor), then put back what the application
+// had set, so a run continues with the same settings.
+
+void CInterfaceObject::RestoreDeviceState()
+{
+	TRACE_SPAN("RestoreDeviceState");
+
+	SensorConfig config[4];
+	BOOL led[5];
+	int chan = cur_chan;
+
+	memcpy(config, m_SensorConfig, sizeof(config));
+	memcpy(led, m_LEDConfig, sizeof(led));
+
+	if (!ReadTrimData())
+		return;
+
+	for (int i = 0; i < 4; i++) {
+		SelSensor((BYTE)(i + 1));
+		SetGainMode(config[i].gain);
+		SetTXbin(config[i].txbin);
+		SetIntTime(config[i].int_time);
+	}
+
+	SetLEDConfig(led[0], led[1], led[2], led[3], led[4]);
+	SelSensor((BYTE)chan);
+}
+
+// The device was reset but not replaced (USB recovery): the trim read from it
+// is still right, so only its registers and the application's settings are
+// sent again, without the EEPROM read and the LED settle delay of ResetTrim().
+
+void CInterfaceObject::ReplaySensorConfig()
+{
+	TRACE_SPAN("ReplaySensorConfig");
+
+	SensorConfig config[4];
+	BOOL led[5];
+	int chan = cur_chan;
+
+	memcpy(config, m_SensorConfig, sizeof(config));
+	memcpy(led, m_LEDConfig, sizeof(led));
+
+	for (int i = 0; i < 4; i++) {
+		SelSensor((BYTE)(i + 1));
+		SetRampgen((BYTE)m_TrimReader.Node[i].rampgen);
+		SetRangeTrim(0x0f);
+		SetV15(m_TrimReader.Node[i].auto_v15);
+		SetGainMode(config[i].gain);		// Also sets V20 for the gain
+		SetTXbin(config[i].txbin);
+		SetIntTime(config[i].int_time);
+	}
+
+	SetLEDConfig(led[0], led[1], led[2], led[3], led[4]);
+	SelSensor((BYTE)chan);
+}
+
+// One capture for the averaging loops. 0: complete frame in frame_data;
+// 1: cancelled; 2: incomplete frame
+
+int CInterfaceObject::CaptureOne(BYTE chan, int size)
+{
+	int r;
+	if (size == 24) {
+		if (cur_chan != chan)
+			SelSensor(chan);
+		r = CaptureFrame24();
+	}
+	else {
+		r = CaptureFrame12(chan);
+	}
+
+	if (r)
+		return 1;
+	if (frame_meta.flags & (FRAME_FLAG_INCOMPLETE | FRAME_FLAG_SENSOR_TIMEOUT))
+		return 2;
+	return 0;
+}
+
+// Captures 'frames' frames and averages the complete ones into m_AverageFrame,
+// also adding them to 'stats' if given. 0: success; 1: cancelled; 2: no complete frame
+
+int CInterfaceObject::CaptureAverage(BYTE chan, int size, int frames, CPixelStats* stats)
+{
+	int prev_chan = cur_chan;
+	int result = 0, n = 0;
+
+	memset(m_AverageFrame, 0, sizeof(m_AverageFrame));
+
+	for (int k = 0; k < frames; k++) {
+		if (CancelPending()) {
+			result = 1;
+			break;
+		}
+
+		int r = CaptureOne(chan, size);
+		if (r == 1) {
+			result = 1;
+			break;
+		}
+		if (r)
+			continue;
+
+		for (int i = 0; i < size; i++) {
+			for (int j = 0; j < size; j++)
+				m_AverageFrame[i][j] += frame_data[i][j];
+		}
+		if (stats)
+			stats->Add(frame_data, size);
+		n++;
+	}
+
+	if (cur_chan != prev_chan)
+		SelSensor((BYTE)prev_chan);
+
+	if (result)
+		return result;
+	if (!n)
+		return 2;
+
+	for (int i = 0; i < size; i++) {
+		for (int j = 0; j < size; j++)
+			m_AverageFrame[i][j] = (m_AverageFrame[i][j] + n / 2) / n;
+	}
+	return 0;
+}
+
+int CInterfaceObject::CaptureStack(BYTE chan, int size, int frames, float clip_sigma, float* mean, float* noise)
+{
+	TRACE_SPAN("CaptureStack", chan);
+
+	int prev_chan = cur_chan;
+	int result = 0;
+
+	m_Stacker.Begin(size, clip_sigma);
+
+	for (int k = 0; k < frames; k++) {
+		if (CancelPending()) {
+			result = 1;
+			break;
+		}
+
+		int r = CaptureOne(chan, size);
+		if (r == 1) {
+			result = 1;
+			break;
+		}
+		if (!r)
+			m_Stacker.Add(frame_data);
+	}
+
+	if (cur_chan != prev_chan)
+		SelSensor((BYTE)prev_chan);
+
+	if (result)
+		return result;
+	return m_Stacker.Finish(mean, noise) ? 0 : 2;
+}
+
+int CInterfaceObject::CaptureDark(BYTE chan, int size, int frames)
+{
+	TRACE_SPAN("CaptureDark", chan);
+
+	BOOL led[5];
+	memcpy(led, m_LEDConfig, sizeof(led));
+
+	SetLEDConfig(1, 0, 0, 0, 0);			// Individual mode, every LED off
+	m_DarkCapturing = true;
+
+	int result = CaptureAverage(chan, size, frames);
+
+	m_DarkCapturing = false;
+	SetLEDConfig(led[0], led[1], led[2], led[3], led[4]);
+
+	if (!result) {
+		m_DarkCache.Store(chan, frame_meta.gain_mode, size, frame_meta.int_time, m_AverageFrame);
+
+		int64_t sum = 0;
+		for (int i = 0; i < size; i++) {
+			for (int j = 0; j < size; j++)
+				sum += m_AverageFrame[i][j];
+		}
+		m_TempComp.AddDarkSample(chan, frame_meta.gain_mode, frame_meta.int_time, frame_meta.temperature, (double)sum / (size * size));
+	}
+	return result;
+}
+
+int CInterfaceObject::CaptureFlat(BYTE chan, int size, int frames)
+{
+	TRACE_SPAN("CaptureFlat", chan);
+
+	m_FlatCapturing = true;
+	int result = CaptureAverage(chan, size, frames);
+	m_FlatCapturing = false;
+
+	if (!result && !m_FlatField.Build(chan, size, m_AverageFrame, frames))
+		result = 2;
+	return result;
+}
+
+// 'path' if given, otherwise 'name' in the Trim directory beside trim.dat
+
+static std::string TrimDirPath(const char* path, const std::string& name)
+{
+	if (path && *path)
+		return path;
+
+#ifndef _WIN32
+	if (!getcwd(g_CurrentDirectory, sizeof(g_CurrentDirectory)))
+		return "Trim/" + name;
+	return std::string(g_CurrentDirectory) + "/Trim/" + name;
+#else
+	GetCurrentDirectory(MAX_PATH, g_CurrentDirectory);
+	CStringA dir(g_CurrentDirectory);
+	return std::string(dir.GetString()) + "\\Trim\\" + name;
+#endif
+}
+
+// Defect maps belong to one device: Trim/defects_<serial>.dat
+
+static std::string DefectFileName(const char* serial)
+{
+	std::string name = "defects";
+	if (serial && *serial) {
+		name += '_';
+		for (const char* c = serial; *c; c++)
+			name += isalnum((unsigned char)*c) ? *c : '_';
+	}
+	return name + ".dat";
+}
+
+int CInterfaceObject::SaveFlatField(const char* path)
+{
+	return m_FlatField.Save(TrimDirPath(path, "flat.dat").c_str());
+}
+
+int CInterfaceObject::LoadFlatField(const char* path)
+{
+	return m_FlatField.Load(TrimDirPath(path, "flat.dat").c_str());
+}
+
+// Dark frames with the LEDs off, then frames with the LEDs as set for a run,
+// all without dark, flat or defect correction
+
+int CInterfaceObject::SurveyDefects(BYTE chan, int size, int frames)
+{
+	TRACE_SPAN("SurveyDefects", chan);
+
+	CPixelStats dark, lit;
+	BOOL led[5];
+
+	dark.Reset();
+	lit.Reset();
+	memcpy(led, m_LEDConfig, sizeof(led));
+	m_DefectSurveying = true;
+
+	SetLEDConfig(1, 0, 0, 0, 0);			// Individual mode, every LED off
+	m_DarkCapturing = true;
+	int result = CaptureAverage(chan, size, frames, &dark);
+	m_DarkCapturing = false;
+	SetLEDConfig(led[0], led[1], led[2], led[3], led[4]);
+
+	if (!result)
+		result = CaptureAverage(chan, size, frames, &lit);
+
+	m_DefectSurveying = false;
+
+	if (!result && m_DefectMap.Build(chan, size, dark, lit) < 0)
+		result = 2;
+	return result;
+}
+
+// Captures at the predicted integration time until the percentile is on
+// target. The time chosen is left set on the sensor and cached for the next run.
+// 0: converged; 1: cancelled; 2: not converged in params.max_captures
+
+int CInterfaceObject::AutoExpose(BYTE chan, int size, const AeParams& params, AeResult* out)
+{
+	TRACE_SPAN("AutoExpose", chan);
+
+	if (chan < 1 || chan > 4)
+		return 2;
+
+	int prev_chan = cur_chan;
+	int gain = m_SensorConfig[chan - 1].gain;
+	float t = m_AutoExposure.Start(chan, gain, m_SensorConfig[chan - 1].int_time, params);
+	int result = 2;
+
+	memset(out, 0, sizeof(*out));
+
+	for (int k = 0; k < params.max_captures; k++) {
+		if (CancelPending()) {
+			result = 1;
+			break;
+		}
+
+		if (cur_chan != chan)
+			SelSensor(chan);
+		if (m_SensorConfig[chan - 1].int_time != t)
+			SetIntTime(t);
+
+		int r = CaptureOne(chan, size);
+		out->captures++;
+		if (r == 1) {
+			result = 1;
+			break;
+		}
+		if (r)
+			continue;
+
+		bool converged;
+		float next = m_AutoExposure.Update(frame_data, size, frame_stats, t, &converged);
+		out->value = m_AutoExposure.LastValue();
+		if (converged) {
+			result = 0;
+			break;
+		}
+		t = next;
+	}
+
+	if (result != 1) {
+		// Not converged: the last prediction is still the best guess
+		if (cur_chan != chan)
+			SelSensor(chan);
+		if (m_SensorConfig[chan - 1].int_time != t)
+			SetIntTime(t);
+		m_AutoExposure.Store(chan, gain, t);
+		out->converged = result == 0;
+	}
+	out->int_time = t;
+
+	if (cur_chan != prev_chan)
+		SelSensor((BYTE)prev_chan);
+
+	LOG_INFO("Auto exposure: channel %d, %.2f ms after %d captures, percentile %d%s",
+		chan, t, out->captures, out->value, out->converged ? "" : " (not converged)");
+	return result;
+}
+
+// The pair starts at whatever gain the channel is at and leaves it at the
+// other, so back to back pairs switch gain once each rather than twice. Each
+// gain runs at the integration time auto exposure cached for it, if any. The
+// second frame is merged row by row as it arrives.
+
+int CInterfaceObject::CaptureHdr(BYTE chan, int size, int* merged)
+{
+	TRACE_SPAN("CaptureHdr", chan);
+
+	if (chan < 1 || chan > 4)
+		return 2;
+
+	int prev_chan = cur_chan;
+	if (cur_chan != chan)
+		SelSensor(chan);
+
+	SensorConfig& config = m_SensorConfig[chan - 1];
+	int first = config.gain ? GAIN_LOW : GAIN_HIGH;
+	int second = first == GAIN_HIGH ? GAIN_LOW : GAIN_HIGH;
+	float t_first = config.int_time;
+	float t_second = m_AutoExposure.Cached(chan, second);
+	if (t_second <= 0)
+		t_second = t_first;
+
+	int result = CaptureOne(chan, size);
+	if (!result) {
+		m_Hdr.Begin(chan, size, frame_data, flag_data, first, t_first, t_second);
+
+		SetGainMode(second);
+		if (config.int_time != t_second)
+			SetIntTime(t_second);
+
+		if (CancelPending()) {
+			result = 1;
+		}
+		else {
+			m_HdrMerging = true;
+			result = CaptureOne(chan, size);
+			m_HdrMerging = false;
+		}
+
+		if (!result && !m_Hdr.End(frame_data, flag_data))
+			result = 2;
+	}
+
+	if (cur_chan != prev_chan)
+		SelSensor((BYTE)prev_chan);
+
+	if (result)
+		return result;
+
+	const int (*out)[FRAME_MAX_SIZE] = m_Hdr.Merged();
+	for (int r = 0; r < size; r++)
+		memcpy(merged + r * size, out[r], size * sizeof(int));
+	return 0;
+}
+
+// After a frame of 'chan' in frame_data. A gain change brings the integration
+// time auto exposure cached for the new gain, if any. Returns true if the
+// channel went to low gain because the frame saturated, so it is worth
+// capturing again.
+
+bool CInterfaceObject::UpdateAutoGain(BYTE chan)
+{
+	if (!m_AutoGain.IsEnabled(chan))
+		return false;
+
+	int gain = frame_meta.gain_mode;
+	int next = m_AutoGain.Update(chan, gain, frame_stats);
+	if (next == gain)
+		return false;
+
+	int prev_chan = cur_chan;
+	if (cur_chan != chan)
+		SelSensor(chan);
+
+	SetGainMode(next);
+	float t = m_AutoExposure.Cached(chan, next);
+	if (t > 0)
+		SetIntTime(t);
+
+	if (cur_chan != prev_chan)
+		SelSensor((BYTE)prev_chan);
+
+	return next == GAIN_LOW;
+}
+
+void CInterfaceObject::SetTemperature(int chan, double celsius)
+{
+	m_TempComp.SetTemperature(chan, celsius);
+
+	for (int i = 1; i <= 4; i++) {
+		if (chan == 0 || chan == i)
+			m_DarkCache.NotifyTemperature(i, celsius);
+	}
+}
+
+double CInterfaceObject::SetJunctionReading(int chan, double junction)
+{
+	double result = NAN;
+
+	for (int i = 0; i < 4; i++) {
+		if (chan && chan != i + 1)
+			continue;
+		double celsius = CTempComp::JunctionToCelsius(m_TrimReader.Node[i].tempcal, junction);
+		SetTemperature(i + 1, celsius);
+		if (std::isnan(result))
+			result = celsius;
+	}
+	return result;
+}
+
+int CInterfaceObject::SaveExposureCache(const char* path)
+{
+	return m_AutoExposure.Save(TrimDirPath(path, "exposure.dat").c_str());
+}
+
+int CInterfaceObject::LoadExposureCache(const char* path)
+{
+	return m_AutoExposure.Load(TrimDirPath(path, "exposure.dat").c_str());
+}
+
+int CInterfaceObject::SaveDefectMap(const char* serial)
+{
+	return m_DefectMap.Save(TrimDirPath(NULL, DefectFileName(serial)).c_str());
+}
+
+int CInterfaceObject::LoadDefectMap(const char* serial)
+{
+	return m_DefectMap.Load(TrimDirPath(NULL, DefectFileName(serial)).c_str());
+}
+
+int CInterfaceObject::SetWellMask(int size, const int* mask, const int* weights)
+{
+	if (m_CaptureSize)
+		return -1;
+
+	if (mask)
+		return m_WellMap.SetMask(size, mask, weights);
+
+	m_WellMap.ClearMask();
+	return m_WellMap.BuildFromFormat(m_TrimReader.num_wells, m_TrimReader.well_format);
+}
+
+int CInterfaceObject::StartRecording(const char* path, const char* serial, int codec)
+{
+	return m_Recorder.Open(path, serial, m_TrimReader, codec);
+}
+
+int CInterfaceObject::StopRecording()
+{
+	return m_Recorder.Close();
 }
 
 int CInterfaceObject::IsDeviceDetected()
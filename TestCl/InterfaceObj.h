@@ -15,23 +15,99 @@ typedef char TCHAR;
 #endif
 
 #include "TrimReader.h"
+#include "FrameMeta.h"
+#include "RunRecorder.h"
+#include "BufferPool.h"
+#include "FrameSnapshot.h"
+#include "DarkCache.h"
+#include "FlatField.h"
+#include "WellMap.h"
+#include "FrameStats.h"
+#include "DefectMap.h"
+#include "Stacker.h"
+#include "AutoExposure.h"
+#include "AutoGain.h"
+#include "Hdr.h"
+#include "TempComp.h"
+#include <chrono>
 
 #define MAX_IMAGE_SIZE 24
+#define FRAME_POOL_DEFAULT 1		// Frame buffers allocated at reset(): one frame is assembled at a time
 
 class CInterfaceObject {
 
 protected:
 
 	CTrimReader m_TrimReader;
+	CRunRecorder m_Recorder;
+
+	CBufferPool m_FramePool;		// FrameBuffer blocks
+	FrameBuffer* m_Assembly;		// Frame being captured, NULL between captures
+	FrameBuffer m_SpareFrame;		// Used if the pool is not open or ever empty
+	CFrameSnapshot m_Latest;		// Last complete frame, for readers on other threads
+
+	CDarkCache m_DarkCache;
+	int m_ActiveDark[FRAME_MAX_SIZE][FRAME_MAX_SIZE];	// Dark frame for the capture in progress
+	bool m_DarkActive;				// m_ActiveDark applies to the capture in progress
+	bool m_DarkCapturing;			// Capturing dark frames: no dark subtraction
+
+	CFlatField m_FlatField;
+	const uint16_t* m_ActiveFlat;	// Gain map for the capture in progress, NULL if none
+	bool m_FlatCapturing;			// Capturing flat frames: no flat correction
+
+	CDefectMap m_DefectMap;
+	const CDefectMap::Row* m_ActiveDefects;	// Replacements for the capture in progress, NULL if none
+	bool m_DefectSurveying;			// Surveying: no dark, flat or defect correction
+
+	CTempComp m_TempComp;
+	double m_FrameTemp;				// Temperature of the channel being captured, NAN if unknown
+	int m_TempOffset;				// Dark drift subtracted from the capture in progress
+
+	int m_AverageFrame[FRAME_MAX_SIZE][FRAME_MAX_SIZE];	// CaptureAverage() result
+	CFrameStacker m_Stacker;
+	CAutoExposure m_AutoExposure;
+	CAutoGain m_AutoGain;
+	CHdrMerge m_Hdr;
+	bool m_HdrMerging;				// Capturing the second frame of an HDR pair
+
+	CWellMap m_WellMap;
+
+	uint32_t m_FrameSeq;
+	int m_CaptureSize;				// 12 or 24 while a capture is in progress, 0 otherwise
+	uint32_t m_RowMask;				// Rows received so far in the current capture
+	BYTE m_FrameFlags;
+	int m_FrameGain;				// Settings of the sensor being captured
+	float m_FrameIntTime;
+	std::chrono::steady_clock::time_point m_FrameStart;
+
+	// Last settings sent to each sensor, replayed by RestoreDeviceState()
+	struct SensorConfig {
+		int gain;
+		float int_time;
+		BYTE txbin;
+	};
+	SensorConfig m_SensorConfig[4];
+	BOOL m_LEDConfig[5];			// SetLEDConfig() arguments
+
+	void Transact();
+	void BeginFrame(int size, BYTE chan);
+	void CorrectRow(int row);
+	int CaptureAverage(BYTE chan, int size, int frames, CPixelStats* stats = NULL);
+	void EndFrame(BYTE chan);
+	void AbortFrame();
 
 public:
 
 	int frame_data[MAX_IMAGE_SIZE][MAX_IMAGE_SIZE];				// Captured image frame data
+	BYTE flag_data[MAX_IMAGE_SIZE][MAX_IMAGE_SIZE];				// ADCCorrection flag of each pixel in frame_data
+	FrameMeta frame_meta;										// Describes the frame in frame_data
+	FrameStats frame_stats;										// Statistics of the frame in frame_data
 	int cur_chan;
 
 public:
 
 	CInterfaceObject();
+	~CInterfaceObject();
 
 	///////////////////////////////////////////////////////
 	//  Callable functions for application developers
@@ -41,6 +117,7 @@ public:
 	void SetTXbin(BYTE txbin);			// Tx Binning pattern: 0x0 to 0xf
 	void SetIntTime(float);				// Integration time in ms: 1 to 66000
 	void SelSensor(BYTE);
+	void SendSelSensor();				// Re-select the current sensor without waiting for the answer
 
 	//	BYTE GetGainMode(int);
 	//	BYTE GetTXbin();
@@ -58,8 +135,9 @@ public:
 	//	BYTE GetRangeTrim();
 	//	BYTE GetRampgen();
 
-	int CaptureFrame12(/*int (*frame_data)[IMAGE_SIZE]*/BYTE chan);				// Capture a 12X12 image, 0: success; 1: error detected
-	int CaptureFrame24(/*int (*frame_data)[IMAGE_SIZE]*/);				// Capture a 24X24 image, 0: success; 1: error detected
+	int CaptureFrame12(/*int (*frame_data)[IMAGE_SIZE]*/BYTE chan);				// Capture a 12X12 image, 0: success; 1: error detected or cancelled
+	int CaptureFrame24(/*int (*frame_data)[IMAGE_SIZE]*/);				// Capture a 24X24 image, 0: success; 1: error detected or cancelled
+	int CaptureOne(BYTE chan, int size);	// 0: complete frame; 1: error detected or cancelled; 2: rows missing or sensor timed out
 
 	//	void DrawImage(int (*frame_data)[IMAGE_SIZE], int contrast);	// Display image in GUI, contrast range 1-10
 
@@ -68,7 +146,80 @@ public:
 	void ResetTrim();
 
 
-	void ReadTrimData();	// From flash
+	bool ReadTrimData();	// From flash. false: cancelled, the previous trim is kept
+	void ReplaySensorConfig();	// Trim registers and settings again, from the trim already read
+	void RestoreDeviceState();	// After a reconnect: trim from flash, then the last sensor and LED settings
+
+	int StartRecording(const char* path, const char* serial, int codec);	// Append every completed frame to a run file. 1: success; 0: error
+	int StopRecording();	// 1: success; 0: a write failed, the run file is incomplete
+	const CRunRecorder& GetRecorder() const { return m_Recorder; }
+
+	int OpenPools(int frames);			// Resize the frame pool, only between captures (under the device lock). 1: success; 0: error
+	void OpenFramePool();				// At reset: FRAME_POOL_DEFAULT blocks, unless already sized
+	const CBufferPool& GetFramePool() const { return m_FramePool; }
+
+	bool ReadLatestFrame(FrameBuffer* out) const { return m_Latest.Read(out); }	// Consistent copy from any thread; false before the first frame
+
+	// Averages 'frames' captures with the LEDs off into the dark cache entry for
+	// the channel's current gain and integration time. 0: success; 1: cancelled; 2: no complete frame
+	int CaptureDark(BYTE chan, int size, int frames);
+	CDarkCache& GetDarkCache() { return m_DarkCache; }
+
+	// Builds the channel's gain map from 'frames' captures of a uniform light
+	// source. 0: success; 1: cancelled; 2: no complete frame or too little light
+	int CaptureFlat(BYTE chan, int size, int frames);
+	int SaveFlatField(const char* path);	// NULL: Trim/flat.dat beside trim.dat. 1: success; 0: error
+	int LoadFlatField(const char* path);	// Maps read, -1 on error
+	CFlatField& GetFlatField() { return m_FlatField; }
+
+	// Surveys 'frames' dark and 'frames' illuminated captures and rebuilds the
+	// channel's defective pixel map from them. 0: success; 1: cancelled;
+	// 2: no complete frame or the survey was unusable
+	int SurveyDefects(BYTE chan, int size, int frames);
+	int SaveDefectMap(const char* serial);	// Trim/defects_<serial>.dat. 1: success; 0: error
+	int LoadDefectMap(const char* serial);	// Maps read, -1 on error
+	CDefectMap& GetDefectMap() { return m_DefectMap; }
+
+	// Stacks 'frames' captures of the channel, sigma clipping each pixel's
+	// values if clip_sigma > 0, into a mean frame and a per-pixel noise
+	// (standard deviation of one frame), size x size, either may be NULL.
+	// 0: success; 1: cancelled; 2: no complete frame
+	int CaptureStack(BYTE chan, int size, int frames, float clip_sigma, float* mean, float* noise);
+	const StackStats& GetStackStats() const { return m_Stacker.Stats(); }
+
+	// Finds the integration time that puts a percentile of the channel's frame
+	// on target, sets it and caches it per channel and gain.
+	// 0: converged; 1: cancelled; 2: not converged, best guess set
+	int AutoExpose(BYTE chan, int size, const AeParams& params, AeResult* out);
+	int SaveExposureCache(const char* path);	// NULL: Trim/exposure.dat. 1: success; 0: error
+	int LoadExposureCache(const char* path);	// Entries read, -1 on error
+	CAutoExposure& GetAutoExposure() { return m_AutoExposure; }
+
+	// Auto gain policy, applied by UpdateAutoGain() after a capture of a channel
+	// it is enabled for. true: went to low gain on a saturated frame
+	bool UpdateAutoGain(BYTE chan);
+	CAutoGain& GetAutoGain() { return m_AutoGain; }
+
+	// A high gain and a low gain frame of the channel back to back, merged into
+	// size x size pixels in high gain counts beyond the 12 bit range. The
+	// channel starts at its current gain and is left at the other one.
+	// 0: success; 1: cancelled; 2: incomplete frame or no gain ratio yet
+	int CaptureHdr(BYTE chan, int size, int* merged);
+	CHdrMerge& GetHdr() { return m_Hdr; }
+
+	// Temperature of a channel (0: every channel) for its frames from now on,
+	// NAN if unknown. Stale dark frames are dropped.
+	void SetTemperature(int chan, double celsius);
+	// The same from a junction reading, through each channel's tempcal. Returns
+	// the temperature of 'chan', or of channel 1 for 0.
+	double SetJunctionReading(int chan, double junction);
+	CTempComp& GetTempComp() { return m_TempComp; }
+
+	// Wells integrated on every frame. The EEPROM layout (num_wells, well_format)
+	// is used unless a mask is set; a NULL mask goes back to it. Returns the
+	// number of wells, -1 if the mask is invalid. Only between captures.
+	int SetWellMask(int size, const int* mask, const int* weights);
+	int GetWellCount(int size) const { return m_WellMap.Wells(size); }
 
 	int IsDeviceDetected();				// 0: Device not detected; 1: device detected. 
 #ifdef _WIN32
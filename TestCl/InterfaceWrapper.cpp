@@ -2,10 +2,25 @@
 
 #include "InterfaceObj.h"
 #include "HidMgr.h"
+#include "RunRecorder.h"
+#include "FrameCodec.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "RtSched.h"
+#include "AllocCheck.h"
+#include "Cancel.h"
+#include "Hotplug.h"
+#include "UsbRecovery.h"
+#include "InputDrain.h"
+#include <cmath>
 #include <cstdio>
+#include <cstring>
 #include <vector>
 #include <thread>
 #include <chrono>
+#include <mutex>
+#include <atomic>
 #include <hidapi/hidapi.h>
 
 // Platform-specific export macros
@@ -34,264 +49,285 @@ extern int GetBufferSize();
 extern int check_data_flow();
 extern bool FindTheHID();
 extern bool Continue_Flag;
+extern BOOL g_DeviceDetected;
 
 extern CInterfaceObject theInterfaceObject;
 extern uint8_t RxData[RxNum];
 
-// C++ linkage function - KEEP THIS OUTSIDE extern "C" block
-int reset_usb_endpoints() {
+// --- Hotplug ---
+//
+// Everything that talks to the device holds g_DeviceLock, so a reconnect
+// never swaps the handle under a command. A removal does not take the lock:
+// it marks the device lost and cancels, which makes a capture blocked on the
+// dead handle give up at once and release it.
+
+static std::mutex g_DeviceLock;
+static std::atomic<bool> g_DeviceLost(false);
+static char g_DeviceSerial[HOTPLUG_SERIAL_LEN];		// Device we reconnect to; empty: any
+static std::atomic<int> g_HotplugRemovals(0);
+static std::atomic<int> g_HotplugArrivals(0);
+static std::atomic<int> g_LastReconnectMs(-1);
+
+#define RECONNECT_TIMEOUT_MS	2000	// hidraw node appears shortly after the hid uevent
+#define RECONNECT_POLL_MS		10
+
+static void ReadDeviceSerial(char* serial, int len)
+{
+    serial[0] = 0;
+    if (!DeviceHandle)
+        return;
+    wchar_t wserial[HOTPLUG_SERIAL_LEN] = { 0 };
+    if (hid_get_serial_number_string(DeviceHandle, wserial, HOTPLUG_SERIAL_LEN) == 0) {
+        int i;
+        for (i = 0; i < len - 1 && wserial[i]; i++)
+            serial[i] = (char)wserial[i];
+        serial[i] = 0;
+    }
+}
+
+static void OnDeviceRemoved()
+{
+    g_HotplugRemovals++;
+    MetricInc(METRIC_DEVICE_REMOVALS);
+
+    g_DeviceLost.store(true, std::memory_order_release);
+    g_DeviceDetected = FALSE;
+    CancelSignal();
+    Continue_Flag = false;
+}
+
+static void OnDeviceArrived()
+{
+    g_HotplugArrivals++;
+    if (!g_DeviceLost.load(std::memory_order_acquire))
+        return;
+
+    TRACE_SPAN("Reconnect");
+    auto start = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(g_DeviceLock);
+
     if (DeviceHandle) {
-#ifdef _WIN32
-        // Windows implementation with enhanced diagnostics
-        printf("\n====== USB ENDPOINT RESET PROCEDURE STARTING (WINDOWS) ======\n");
-        auto start_time = std::chrono::high_resolution_clock::now();
-        
-        struct hid_device_info* devs = hid_enumerate(VENDOR_ID, PRODUCT_ID);
-        if (devs) {
-            printf("Current device path: %s\n", devs->path);
-            printf("  VID/PID: %04X:%04X\n", devs->vendor_id, devs->product_id);
-            printf("  Manufacturer: %ls\n", devs->manufacturer_string ? devs->manufacturer_string : L"(unknown)");
-            printf("  Product: %ls\n", devs->product_string ? devs->product_string : L"(unknown)");
-            printf("  Serial: %ls\n", devs->serial_number ? devs->serial_number : L"(unknown)");
-            printf("  Interface: %d\n", devs->interface_number);
-            
-            hid_free_enumeration(devs);
-        } else {
-            printf("WARNING: Could not enumerate devices - %ls\n", hid_error(NULL));
-        }
-        
-        // On Windows, try to send a reset command first
-        printf("\nSTEP 1: Sending device-specific reset command...\n");
-        unsigned char reset_data[HIDREPORTNUM] = { 0 };
-        reset_data[0] = 0;  // Report ID
-        reset_data[1] = 0xaa;  // Preamble
-        reset_data[2] = 0x01;  // Command type
-        reset_data[3] = 0x10;  // Reset command
-        
-        int res = hid_write(DeviceHandle, reset_data, sizeof(reset_data));
-        if (res >= 0) {
-            printf("  Reset command sent successfully (%d bytes)\n", res);
-            printf("  Waiting 100ms for device to process reset...\n");
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        } else {
-            printf("  Failed to send reset command: %ls\n", hid_error(DeviceHandle));
-        }
-        
-        printf("\nSTEP 2: Closing and reopening device with HIDAPI...\n");
-        printf("  Closing HID device...\n");
         hid_close(DeviceHandle);
         DeviceHandle = nullptr;
-        printf("  Waiting 200ms for device resources to be released...\n");
-        std::this_thread::sleep_for(std::chrono::milliseconds(200));
-        printf("  Reopening HID device...\n");
-        DeviceHandle = hid_open(VENDOR_ID, PRODUCT_ID, nullptr);
-        if (DeviceHandle) {
-            printf("  Successfully reopened HIDAPI device\n");
-            if (hid_set_nonblocking(DeviceHandle, 1) == 0) {
-                printf("  Set non-blocking mode successfully\n");
-            } else {
-                printf("  Failed to set non-blocking mode: %ls\n", hid_error(DeviceHandle));
-            }
-            auto end_time = std::chrono::high_resolution_clock::now();
-            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
-            printf("\n====== USB ENDPOINT RESET COMPLETED SUCCESSFULLY ======\n");
-            printf("Total reset time: %lld ms\n", duration.count());
-            return 1;  // Success
-        } else {
-            printf("  Failed to reopen HIDAPI device on Windows: %ls\n", hid_error(NULL));
-            printf("  Waiting 500ms before retrying...\n");
-            std::this_thread::sleep_for(std::chrono::milliseconds(500));
-            printf("  Retrying device open...\n");
-            DeviceHandle = hid_open(VENDOR_ID, PRODUCT_ID, nullptr);
-            if (DeviceHandle) {
-                printf("  Successfully reopened HIDAPI device on second attempt\n");
-                if (hid_set_nonblocking(DeviceHandle, 1) == 0) {
-                    printf("  Set non-blocking mode successfully\n");
-                } else {
-                    printf("  Failed to set non-blocking mode: %ls\n", hid_error(DeviceHandle));
-                }
-                auto end_time = std::chrono::high_resolution_clock::now();
-                auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
-                printf("\n====== USB ENDPOINT RESET COMPLETED SUCCESSFULLY (SECOND ATTEMPT) ======\n");
-                printf("Total reset time: %lld ms\n", duration.count());
-                return 1;  // Success
-            } else {
-                auto end_time = std::chrono::high_resolution_clock::now();
-                auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
-                printf("\n====== USB ENDPOINT RESET FAILED ======\n");
-                printf("Total time spent attempting reset: %lld ms\n", duration.count());
-                printf("Error: %ls\n", hid_error(NULL));
-            }
-        }
-#else // Linux and others
-        printf("\n====== USB ENDPOINT RESET PROCEDURE STARTING (LINUX) ======\n");
-        auto start_time = std::chrono::high_resolution_clock::now();
-
-        struct hid_device_info* devs = hid_enumerate(VENDOR_ID, PRODUCT_ID);
-        if (devs) {
-            printf("Current device path: %s\n", devs->path);
-            printf("  VID/PID: %04X:%04X\n", devs->vendor_id, devs->product_id);
-            printf("  Manufacturer: %ls\n", devs->manufacturer_string ? devs->manufacturer_string : L"(unknown)");
-            printf("  Product: %ls\n", devs->product_string ? devs->product_string : L"(unknown)");
-            printf("  Serial: %ls\n", devs->serial_number ? devs->serial_number : L"(unknown)");
-            printf("  Interface: %d\n", devs->interface_number);
-            hid_free_enumeration(devs);
-        } else {
-            printf("WARNING: Could not enumerate devices - %ls\n", hid_error(NULL));
-        }
+    }
 
-        printf("\nSTEP 1: Sending device-specific reset command...\n");
-        unsigned char reset_data[HIDREPORTNUM] = { 0 };
-        reset_data[0] = 0;  // Report ID
-        reset_data[1] = 0xaa;  // Preamble
-        reset_data[2] = 0x01;  // Command type
-        reset_data[3] = 0x10;  // Reset command
-
-        int res = hid_write(DeviceHandle, reset_data, sizeof(reset_data));
-        if (res >= 0) {
-            printf("  Reset command sent successfully (%d bytes)\n", res);
-            printf("  Waiting 100ms for device to process reset...\n");
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            unsigned char response[HIDREPORTNUM] = { 0 };
-            res = hid_read_timeout(DeviceHandle, response, sizeof(response), 100);
-            if (res > 0) {
-                printf("  Received response after reset command (%d bytes):\n  ", res);
-                for (int i = 0; i < std::min(res, 16); i++) {
-                    printf("%02X ", response[i]);
-                }
-                printf("%s\n", res > 16 ? "..." : "");
-            } else {
-                printf("  No response received after reset command\n");
-            }
-        } else {
-            printf("  Failed to send reset command: %ls\n", hid_error(DeviceHandle));
-        }
+    wchar_t wserial[HOTPLUG_SERIAL_LEN] = { 0 };
+    for (int i = 0; i < HOTPLUG_SERIAL_LEN - 1 && g_DeviceSerial[i]; i++)
+        wserial[i] = (wchar_t)(unsigned char)g_DeviceSerial[i];
 
-        printf("\nSTEP 2: Closing and reopening device with HIDAPI...\n");
-        printf("  Closing HID device...\n");
-        hid_close(DeviceHandle);
-        DeviceHandle = nullptr;
-        printf("  Waiting 100ms for USB reset to complete...\n");
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        printf("  Reopening HID device...\n");
-        DeviceHandle = hid_open(VENDOR_ID, PRODUCT_ID, nullptr);
-        if (DeviceHandle) {
-            printf("  Successfully reopened HIDAPI device\n");
-            if (hid_set_nonblocking(DeviceHandle, 1) == 0) {
-                printf("  Set non-blocking mode successfully\n");
-            } else {
-                printf("  Failed to set non-blocking mode: %ls\n", hid_error(DeviceHandle));
-            }
-            auto end_time = std::chrono::high_resolution_clock::now();
-            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
-            printf("\n====== USB ENDPOINT RESET COMPLETED SUCCESSFULLY ======\n");
-            printf("Total reset time: %lld ms\n", duration.count());
-            return 1;  // Success
-        } else {
-            printf("  Failed to reopen HIDAPI device: %ls\n", hid_error(NULL));
-            printf("  Waiting 500ms before retrying...\n");
-            std::this_thread::sleep_for(std::chrono::milliseconds(500));
-            printf("  Retrying device open...\n");
-            DeviceHandle = hid_open(VENDOR_ID, PRODUCT_ID, nullptr);
-            if (DeviceHandle) {
-                printf("  Successfully reopened HIDAPI device on second attempt\n");
-                if (hid_set_nonblocking(DeviceHandle, 1) == 0) {
-                    printf("  Set non-blocking mode successfully\n");
-                } else {
-                    printf("  Failed to set non-blocking mode: %ls\n", hid_error(DeviceHandle));
-                }
-                auto end_time = std::chrono::high_resolution_clock::now();
-                auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
-                printf("\n====== USB ENDPOINT RESET COMPLETED SUCCESSFULLY (SECOND ATTEMPT) ======\n");
-                printf("Total reset time: %lld ms\n", duration.count());
-                return 1;  // Success
-            } else {
-                auto end_time = std::chrono::high_resolution_clock::now();
-                auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
-                printf("\n====== USB ENDPOINT RESET FAILED ======\n");
-                printf("Total time spent attempting reset: %lld ms\n", duration.count());
-            }
-        }
-#endif
-    } else {
-        printf("Cannot reset USB endpoints: No active device handle\n");
+    for (int waited = 0; waited < RECONNECT_TIMEOUT_MS; waited += RECONNECT_POLL_MS) {
+        DeviceHandle = hid_open(VENDOR_ID, PRODUCT_ID, g_DeviceSerial[0] ? wserial : nullptr);
+        if (DeviceHandle)
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(RECONNECT_POLL_MS));
     }
-    
-    return 0;  // Not implemented or failed
+    if (!DeviceHandle) {
+        LOG_WARN("Hotplug: device '%s' arrived but could not be opened", g_DeviceSerial);
+        return;
+    }
+    if (hid_set_nonblocking(DeviceHandle, 1) != 0)
+        LOG_WARN("Hotplug: failed to set non-blocking mode: %ls", hid_error(DeviceHandle));
+
+    g_DeviceDetected = TRUE;
+    g_DeviceLost.store(false, std::memory_order_release);
+    CancelClear();
+
+    theInterfaceObject.RestoreDeviceState();
+
+    std::chrono::steady_clock::duration d = std::chrono::steady_clock::now() - start;
+    int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    MetricRecord(METRIC_HIST_RECONNECT_US, (uint64_t)us);
+    MetricInc(METRIC_DEVICE_RECONNECTS);
+    g_LastReconnectMs = (int)(us / 1000);
+    LOG_INFO("Hotplug: device '%s' reconnected and restored in %d ms", g_DeviceSerial, (int)(us / 1000));
+}
+
+static void OnHotplug(const HotplugEvent& ev, void*)
+{
+    // Another unit on the same bus is none of our business
+    if (g_DeviceSerial[0] && ev.serial[0] && strcmp(ev.serial, g_DeviceSerial))
+        return;
+
+    if (ev.arrived)
+        OnDeviceArrived();
+    else
+        OnDeviceRemoved();
+}
+
+// --- USB recovery ---
+
+// Re-selecting the current sensor changes nothing and, like every setter, is
+// answered by the device. The answer is awaited for USB_PROBE_BUDGET_MS at
+// most, not through the transport's read; hidapi strips the report number,
+// so it is in RxData layout.
+static bool ProbeDevice(void*)
+{
+    unsigned char response[HIDREPORTNUM] = { 0 };
+    theInterfaceObject.SendSelSensor();
+    int n = UsbReadResponse(response, sizeof(response), USB_PROBE_BUDGET_MS);
+    return n > 2 && response[2] != 0 && response[2] != GetCmd;
+}
+
+static void RestoreAfterReset(void*)
+{
+    theInterfaceObject.ReplaySensorConfig();
+}
+
+// C++ linkage function - KEEP THIS OUTSIDE extern "C" block
+// 1: device answering again; 0: failed or cancelled
+int reset_usb_endpoints() {
+    TRACE_SPAN("reset_usb_endpoints");
+    MetricInc(METRIC_USB_RESETS);
+
+    if (!g_DeviceSerial[0])
+        ReadDeviceSerial(g_DeviceSerial, HOTPLUG_SERIAL_LEN);
+
+    // Anything past a drain leaves the device with power on settings; the
+    // trim already read still applies, only the registers need setting again
+    int stage = UsbRecover(VENDOR_ID, PRODUCT_ID, g_DeviceSerial, ProbeDevice, RestoreAfterReset, NULL);
+    return stage < 0 ? 0 : 1;
+}
+
+// Start of an export that sends setters: a cancel aimed at an earlier call no
+// longer applies. Captures clear it themselves once they know the device is there.
+static void BeginSetterCall()
+{
+    if (!g_DeviceLost.load(std::memory_order_acquire))
+        CancelClear();
 }
 
 // Create C-linkage wrapper functions for our C++ functions
 extern "C" {
     EXPORT void selchan(int chan) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        BeginSetterCall();
         theInterfaceObject.SelSensor((BYTE)chan);
     }
 
-    EXPORT void get(int chan) {
+    // 0: frame captured; 1: cancelled by cancel_capture(); 2: no complete
+    // frame after every attempt (the last one is kept, flagged
+    // FRAME_FLAG_INCOMPLETE or FRAME_FLAG_SENSOR_TIMEOUT); 3: device unplugged
+    EXPORT int get(int chan) {
+        TRACE_SPAN("get", chan);
         const int MAX_ATTEMPTS = 5;
-        bool success = false;
-        printf("Starting capture with up to %d attempts\n", MAX_ATTEMPTS);
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        if (g_DeviceLost.load(std::memory_order_acquire))
+            return 3;
+        CancelClear();
+        LOG_INFO("Starting capture with up to %d attempts", MAX_ATTEMPTS);
         for (int attempts = 0; attempts < MAX_ATTEMPTS; attempts++) {
-            printf("Attempt %d of %d\n", attempts + 1, MAX_ATTEMPTS);
-            int result = theInterfaceObject.CaptureFrame12((BYTE)chan);
-            if (result == 0) {
-                printf("Capture successful on attempt %d\n", attempts + 1);
-                success = true;
-                break;
+            LOG_DEBUG("Attempt %d of %d", attempts + 1, MAX_ATTEMPTS);
+            if (attempts > 0)
+                MetricInc(METRIC_CAPTURE_RETRIES);
+            int result = theInterfaceObject.CaptureOne((BYTE)chan, 12);
+            if (result == 0 && !CancelPending() && theInterfaceObject.UpdateAutoGain((BYTE)chan)) {
+                LOG_INFO("Channel %d saturated, capturing again in low gain", chan);
+                theInterfaceObject.GetAutoGain().CountRecapture();
+                result = theInterfaceObject.CaptureOne((BYTE)chan, 12);
             }
-            int nonZeroCount = 0;
-            int zeroRowCount = 0;
-            for (int i = 0; i < 12; i++) {
-                int rowNonZero = 0;
-                for (int j = 0; j < 12; j++) {
-                    if (theInterfaceObject.frame_data[i][j] != 0) {
-                        nonZeroCount++;
-                        rowNonZero++;
-                    }
-                }
-                if (rowNonZero == 0) {
-                    zeroRowCount++;
-                    printf("Warning: Row %d is completely empty\n", i);
-                }
+            if (result != 0 && CancelPending()) {
+                LOG_INFO("Capture cancelled");
+                return g_DeviceLost.load(std::memory_order_acquire) ? 3 : 1;
             }
-            printf("Frame has %d non-zero values out of 144 (%d%% filled)\n", nonZeroCount, (nonZeroCount * 100) / 144);
-            printf("Frame has %d completely empty rows\n", zeroRowCount);
-            if (nonZeroCount > 100) {
-                printf("Frame has sufficient data, proceeding\n");
-                success = true;
-                break;
+            if (result == 0) {
+                LOG_INFO("Capture successful on attempt %d", attempts + 1);
+                return 0;
             }
+            const FrameStats& st = theInterfaceObject.frame_stats;	// Counted as the rows arrived
+            for (uint32_t m = st.empty_row_mask; m; m &= m - 1) {
+                int i = 0;
+                while (!(m & (1u << i)))
+                    i++;
+                LOG_WARN("Warning: Row %d is completely empty", i);
+            }
+            LOG_DEBUG("Frame has %d non-zero values out of 144 (%d%% filled)", st.nonzero, (st.nonzero * 100) / 144);
+            LOG_DEBUG("Frame has %d completely empty rows", st.empty_rows);
             int delay_ms = 50 * (attempts + 1);
-            printf("Waiting %d ms before retry...\n", delay_ms);
-            std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+            LOG_DEBUG("Waiting %d ms before retry...", delay_ms);
+            {
+                TRACE_SPAN("RetrySleep", delay_ms);
+                if (CancelSleep(delay_ms)) {
+                    LOG_INFO("Capture cancelled");
+                    return g_DeviceLost.load(std::memory_order_acquire) ? 3 : 1;
+                }
+            }
             if (attempts > 0) {
-                printf("Resetting USB endpoints\n");
+                LOG_INFO("Resetting USB endpoints");
                 reset_usb_endpoints();
             }
         }
-        if (!success) {
-            printf("WARNING: Failed to capture a complete frame after %d attempts\n", MAX_ATTEMPTS);
-            printf("Proceeding with partial data - some rows may be missing or interpolated\n");
-        }
+        LOG_WARN("WARNING: Failed to capture a complete frame after %d attempts", MAX_ATTEMPTS);
+        return 2;
     }
 
+    // Safe to call from any thread while captures run: reads the last
+    // complete frame, never one being assembled
     EXPORT void get_frame12(int* outbuf) {
+        FrameBuffer f;
+        if (!theInterfaceObject.ReadLatestFrame(&f)) {
+            memset(outbuf, 0, 12 * 12 * sizeof(int));
+            return;
+        }
         for (int i = 0; i < 12; ++i) {
             for (int j = 0; j < 12; ++j) {
-                outbuf[i * 12 + j] = theInterfaceObject.frame_data[i][j];
+                outbuf[i * 12 + j] = f.pixels[i][j];
+            }
+        }
+    }
+
+    // Last complete frame with its metadata. outbuf: room for 24 x 24 values,
+    // filled frame_size x frame_size row major; meta may be NULL.
+    // Returns the frame size, 0 if nothing has been captured yet
+    EXPORT int get_latest_frame(int* outbuf, FrameMeta* meta) {
+        FrameBuffer f;
+        if (!theInterfaceObject.ReadLatestFrame(&f))
+            return 0;
+        int n = f.meta.frame_size;
+        for (int i = 0; i < n; ++i) {
+            for (int j = 0; j < n; ++j) {
+                outbuf[i * n + j] = f.pixels[i][j];
             }
         }
+        if (meta)
+            *meta = f.meta;
+        return n;
+    }
+
+    // Statistics of the latest frame, counted while it was assembled.
+    // Returns the frame size, 0 before the first frame.
+    EXPORT int get_latest_stats(FrameStats* out, FrameMeta* meta) {
+        FrameBuffer f;
+        if (!theInterfaceObject.ReadLatestFrame(&f))
+            return 0;
+        *out = f.stats;
+        if (meta)
+            *meta = f.meta;
+        return f.meta.frame_size;
     }
 
     EXPORT void setinttime(float itime) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        BeginSetterCall();
         theInterfaceObject.SetIntTime(itime);
     }
 
     EXPORT void setgain(int gain) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        BeginSetterCall();
         theInterfaceObject.SetGainMode(gain);
     }
 
     EXPORT void reset() {
-        FindTheHID();
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        BeginSetterCall();
+        if (!FindTheHID())
+            return;
+
+        theInterfaceObject.OpenFramePool();
+
+        // The defect map saved for this unit, if it has one
+        ReadDeviceSerial(g_DeviceSerial, HOTPLUG_SERIAL_LEN);
+        theInterfaceObject.LoadDefectMap(g_DeviceSerial);
     }
 
     EXPORT int get_buffer_capacity() {
@@ -306,6 +342,30 @@ extern "C" {
         return check_data_flow();
     }
 
+    // Discards queued input reports now. Every command already does this
+    // first; returns the number discarded
+    EXPORT int drain_input() {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        return DrainInputReports();
+    }
+
+    // drains that found something, reports discarded, of which pixel rows,
+    // of which other responses, command and type bytes of the last one
+    EXPORT int stale_report_stats(int* stats, int length) {
+        StaleReportStats st;
+        StaleReportGetStats(&st);
+        if (length >= 6) {
+            stats[0] = (int)st.drains;
+            stats[1] = (int)st.reports;
+            stats[2] = (int)st.rows;
+            stats[3] = (int)st.responses;
+            stats[4] = st.last_cmd;
+            stats[5] = st.last_type;
+            return 6;
+        }
+        return 0;
+    }
+
     EXPORT int get_buffer_stats(int* stats, int length) {
         if (length >= 3) {
             stats[0] = CIRCULAR_BUFFER_SIZE;
@@ -316,17 +376,681 @@ extern "C" {
         return 0;
     }
 
+    // Wakes a capture blocked in a device read or a retry sleep on another
+    // thread; get() then returns 1
     EXPORT void cancel_capture() {
+        CancelSignal();
+        Continue_Flag = false;
+    }
+
+    // --- Dark frames ---
+
+    // Averages 'frames' size x size captures of 'chan' with the LEDs off and
+    // caches them for the current gain and integration time; later captures
+    // at that setting, or between two cached ones, have them subtracted.
+    // 0: success; 1: cancelled; 2: no complete frame; 3: device unplugged
+    EXPORT int dark_capture(int chan, int size, int frames) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        if (g_DeviceLost.load(std::memory_order_acquire))
+            return 3;
+        CancelClear();
+        return theInterfaceObject.CaptureDark((BYTE)chan, size == 24 ? 24 : 12, frames > 0 ? frames : 1);
+    }
+
+    EXPORT void dark_enable(int enable) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        theInterfaceObject.GetDarkCache().SetEnabled(enable != 0);
+    }
+
+    EXPORT void dark_invalidate() {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        theInterfaceObject.GetDarkCache().Invalidate();
+    }
+
+    // entries, hits, interpolated, misses, invalidations
+    EXPORT int dark_stats(int* stats, int length) {
+        DarkCacheStats st;
+        {
+            std::lock_guard<std::mutex> lock(g_DeviceLock);
+            theInterfaceObject.GetDarkCache().GetStats(&st);
+        }
+        if (length >= 5) {
+            stats[0] = (int)st.entries;
+            stats[1] = (int)st.hits;
+            stats[2] = (int)st.interpolated;
+            stats[3] = (int)st.misses;
+            stats[4] = (int)st.invalidations;
+            return 5;
+        }
+        return 0;
+    }
+
+    // --- Flat field ---
+
+    // Builds the gain map of 'chan' from 'frames' size x size captures of a
+    // uniform light source; later captures of that channel and size are
+    // corrected with it. 0: success; 1: cancelled; 2: no complete frame or
+    // too little light; 3: device unplugged
+    EXPORT int flat_capture(int chan, int size, int frames) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        if (g_DeviceLost.load(std::memory_order_acquire))
+            return 3;
+        CancelClear();
+        return theInterfaceObject.CaptureFlat((BYTE)chan, size == 24 ? 24 : 12, frames > 0 ? frames : 1);
+    }
+
+    EXPORT void flat_enable(int enable) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        theInterfaceObject.GetFlatField().SetEnabled(enable != 0);
+    }
+
+    EXPORT void flat_clear() {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        theInterfaceObject.GetFlatField().Clear();
+    }
+
+    // path NULL or "": Trim/flat.dat, which is loaded with the trim file
+    EXPORT int flat_save(const char* path) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        return theInterfaceObject.SaveFlatField(path);
+    }
+
+    // Returns the number of maps read, -1 on error
+    EXPORT int flat_load(const char* path) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        return theInterfaceObject.LoadFlatField(path);
+    }
+
+    // --- Defective pixels ---
+
+    // Surveys 'frames' dark captures (LEDs off) and 'frames' captures with the
+    // LEDs as set, then rebuilds the defect map of 'chan'. Later captures have
+    // its defective pixels replaced from their neighbours. 0: success;
+    // 1: cancelled; 2: no complete frame or unusable survey; 3: device unplugged
+    EXPORT int defect_survey(int chan, int size, int frames) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        if (g_DeviceLost.load(std::memory_order_acquire))
+            return 3;
+        CancelClear();
+        return theInterfaceObject.SurveyDefects((BYTE)chan, size == 24 ? 24 : 12, frames > 0 ? frames : 16);
+    }
+
+    EXPORT void defect_enable(int enable) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        theInterfaceObject.GetDefectMap().SetEnabled(enable != 0);
+    }
+
+    EXPORT void defect_clear() {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        theInterfaceObject.GetDefectMap().Clear();
+    }
+
+    EXPORT int defect_count(int chan, int size) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        return theInterfaceObject.GetDefectMap().Count(chan, size == 24 ? 24 : 12);
+    }
+
+    // DEFECT_* flags of every pixel, row major; returns the number of pixels
+    EXPORT int defect_get_map(int chan, int size, unsigned char* out) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        size = size == 24 ? 24 : 12;
+        for (int r = 0; r < size; r++) {
+            for (int c = 0; c < size; c++)
+                out[r * size + c] = theInterfaceObject.GetDefectMap().Flags(chan, size, r, c);
+        }
+        return size * size;
+    }
+
+    // Trim/defects_<serial>.dat for the open device, loaded again by reset()
+    EXPORT int defect_save() {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        if (!g_DeviceSerial[0])
+            ReadDeviceSerial(g_DeviceSerial, HOTPLUG_SERIAL_LEN);
+        return theInterfaceObject.SaveDefectMap(g_DeviceSerial);
+    }
+
+    // Returns the number of maps read, -1 on error
+    EXPORT int defect_load() {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        if (!g_DeviceSerial[0])
+            ReadDeviceSerial(g_DeviceSerial, HOTPLUG_SERIAL_LEN);
+        return theInterfaceObject.LoadDefectMap(g_DeviceSerial);
+    }
+
+    // --- Stacking ---
+
+    // Captures 'frames' frames of 'chan' and stacks them in the library.
+    // clip_sigma > 0 drops per-pixel outliers beyond that many sigmas. mean and
+    // noise (standard deviation of one frame) receive size x size floats,
+    // either may be NULL. 0: success; 1: cancelled; 2: no complete frame;
+    // 3: device unplugged
+    EXPORT int stack_capture(int chan, int size, int frames, float clip_sigma, float* mean, float* noise) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        if (g_DeviceLost.load(std::memory_order_acquire))
+            return 3;
+        CancelClear();
+        return theInterfaceObject.CaptureStack((BYTE)chan, size == 24 ? 24 : 12, frames > 0 ? frames : 1, clip_sigma, mean, noise);
+    }
+
+    // frames, rejected values, pixels clipped, of the last stack
+    EXPORT int stack_stats(int* stats, int length) {
+        StackStats st;
+        {
+            std::lock_guard<std::mutex> lock(g_DeviceLock);
+            st = theInterfaceObject.GetStackStats();
+        }
+        if (length >= 3) {
+            stats[0] = (int)st.frames;
+            stats[1] = (int)st.rejected;
+            stats[2] = (int)st.clipped_pixels;
+            return 3;
+        }
+        return 0;
+    }
+
+    // --- HDR ---
+
+    // A high gain and a low gain frame of 'chan' back to back, merged into
+    // size x size ints in high gain counts that can exceed 4095. The gain ratio
+    // is calibrated from every pair, so the very first pair needs pixels that
+    // neither gain saturates. The channel is left at the gain it did not start
+    // at. 0: success; 1: cancelled; 2: incomplete frame or no gain ratio yet;
+    // 3: device unplugged
+    EXPORT int hdr_capture(int chan, int size, int* merged) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        if (g_DeviceLost.load(std::memory_order_acquire))
+            return 3;
+        CancelClear();
+        return theInterfaceObject.CaptureHdr((BYTE)chan, size == 24 ? 24 : 12, merged);
+    }
+
+    // High gain counts where blending to low gain starts and ends, 0 or less
+    // keeps the current value
+    EXPORT void hdr_config(int knee_lo, int knee_hi) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        HdrParams p = theInterfaceObject.GetHdr().Params();
+        if (knee_lo > 0) p.knee_lo = knee_lo;
+        if (knee_hi > 0) p.knee_hi = knee_hi;
+        theInterfaceObject.GetHdr().SetParams(p);
+    }
+
+    // High/low gain ratio of every pixel, size x size floats. Returns the
+    // number of pixels calibrated individually, the others read the median
+    EXPORT int hdr_get_ratios(int chan, int size, float* ratio) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        return theInterfaceObject.GetHdr().Ratios(chan, size == 24 ? 24 : 12, ratio);
+    }
+
+    // chan 0: every channel
+    EXPORT void hdr_clear_calibration(int chan) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        theInterfaceObject.GetHdr().ClearCalibration(chan);
+    }
+
+    // pairs, pixels from low gain, pixels saturated in both, pixels calibrated
+    EXPORT int hdr_stats(int* stats, int length) {
+        HdrStats st;
+        {
+            std::lock_guard<std::mutex> lock(g_DeviceLock);
+            st = theInterfaceObject.GetHdr().Stats();
+        }
+        if (length >= 4) {
+            stats[0] = (int)st.pairs;
+            stats[1] = (int)st.from_low;
+            stats[2] = (int)st.saturated;
+            stats[3] = (int)st.calibrated;
+            return 4;
+        }
+        return 0;
+    }
+
+    // --- Temperature ---
+
+    // Temperature in degrees C of 'chan' (0: every channel), used for its
+    // frames from now on and recorded in FrameMeta::temperature. NAN: unknown
+    EXPORT void temp_set(int chan, float celsius) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        theInterfaceObject.SetTemperature(chan, celsius);
+    }
+
+    // The same from the sensor's junction temperature reading, converted with
+    // the channel's tempcal coefficients. *celsius receives the result (channel
+    // 1 for chan 0) if not NULL. Returns 0 for a bad channel
+    EXPORT int temp_set_junction(int chan, float junction, float* celsius) {
+        if (chan < 0 || chan > 4)
+            return 0;
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        double t = theInterfaceObject.SetJunctionReading(chan, junction);
+        if (celsius)
+            *celsius = (float)t;
+        return 1;
+    }
+
+    // 1 and *celsius if the channel's temperature is known, 0 otherwise
+    EXPORT int temp_get(int chan, float* celsius) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        double t = theInterfaceObject.GetTempComp().Temperature(chan);
+        if (std::isnan(t))
+            return 0;
+        *celsius = (float)t;
+        return 1;
+    }
+
+    EXPORT void temp_enable(int enable) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        theInterfaceObject.GetTempComp().SetEnabled(enable != 0);
+    }
+
+    // Dark level drift of a channel and gain in counts per degree C, referred
+    // to 'ref' degrees, replacing any fitted from dark frames
+    EXPORT void temp_set_drift(int chan, int gain, float rate, float ref) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        theInterfaceObject.GetTempComp().SetDrift(chan, gain, rate, ref);
+    }
+
+    // 1 and the drift if the channel has one for the gain, 0 otherwise
+    EXPORT int temp_get_drift(int chan, int gain, float* rate, float* ref) {
+        double r, t;
+        {
+            std::lock_guard<std::mutex> lock(g_DeviceLock);
+            if (!theInterfaceObject.GetTempComp().Drift(chan, gain, &r, &t))
+                return 0;
+        }
+        *rate = (float)r;
+        *ref = (float)t;
+        return 1;
+    }
+
+    // chan 0: every channel
+    EXPORT void temp_clear_drift(int chan) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        theInterfaceObject.GetTempComp().ClearDrift(chan);
+    }
+
+    // --- Auto exposure ---
+
+    // Sets the integration time of 'chan' so the 'percentile' of its frame
+    // reads 'target' +- 'tolerance' counts, in at most 'max_captures'
+    // captures. 0 or less for any of them takes the default (95th percentile,
+    // 3000 +- 300, 4 captures). The time chosen is written to *int_time and
+    // cached for the channel's current gain. 0: converged; 1: cancelled;
+    // 2: not converged, best guess set; 3: device unplugged
+    EXPORT int ae_run(int chan, int size, float percentile, int target, int tolerance, int max_captures, float* int_time) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        if (g_DeviceLost.load(std::memory_order_acquire))
+            return 3;
+        CancelClear();
+
+        AeParams params;
+        CAutoExposure::DefaultParams(&params);
+        if (percentile > 0 && percentile <= 100) params.percentile = percentile;
+        if (target > 0) params.target = target;
+        if (tolerance > 0) params.tolerance = tolerance;
+        if (max_captures > 0) params.max_captures = max_captures;
+
+        AeResult res;
+        int result = theInterfaceObject.AutoExpose((BYTE)chan, size == 24 ? 24 : 12, params, &res);
+        if (int_time)
+            *int_time = res.int_time;
+        return result;
+    }
+
+    // Cached integration time of a channel and gain, 0 if none
+    EXPORT float ae_cached(int chan, int gain) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        return theInterfaceObject.GetAutoExposure().Cached(chan, gain);
+    }
+
+    EXPORT void ae_clear() {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        theInterfaceObject.GetAutoExposure().ClearCache();
+    }
+
+    // path NULL or "": Trim/exposure.dat, which is loaded with the trim file
+    EXPORT int ae_save(const char* path) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        return theInterfaceObject.SaveExposureCache(path);
+    }
+
+    // Returns the number of entries read, -1 on error
+    EXPORT int ae_load(const char* path) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        return theInterfaceObject.LoadExposureCache(path);
+    }
+
+    // --- Auto gain ---
+
+    // With auto gain on, get() captures the channel in high gain and moves it
+    // to low gain when a frame has more than 'sat_pixels' overflow pixels,
+    // capturing that frame again; it goes back after 'hold_frames' low gain
+    // frames with a maximum below 'down_level'. FrameMeta::gain_mode tells
+    // which gain each frame used. chan 0: every channel.
+    EXPORT void autogain_enable(int chan, int enable) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        theInterfaceObject.GetAutoGain().SetEnabled(chan, enable != 0);
+    }
+
+    // Negative values keep the current setting
+    EXPORT void autogain_config(int sat_pixels, int down_level, int hold_frames) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        AutoGainParams p = theInterfaceObject.GetAutoGain().Params();
+        if (sat_pixels >= 0) p.sat_pixels = sat_pixels;
+        if (down_level >= 0) p.down_level = down_level;
+        if (hold_frames >= 0) p.hold_frames = hold_frames;
+        theInterfaceObject.GetAutoGain().SetParams(p);
+    }
+
+    // to low gain, to high gain, recaptures
+    EXPORT int autogain_stats(int* stats, int length) {
+        AutoGainStats st;
+        {
+            std::lock_guard<std::mutex> lock(g_DeviceLock);
+            st = theInterfaceObject.GetAutoGain().Stats();
+        }
+        if (length >= 3) {
+            stats[0] = (int)st.to_low;
+            stats[1] = (int)st.to_high;
+            stats[2] = (int)st.recaptures;
+            return 3;
+        }
+        return 0;
+    }
+
+    // --- Wells ---
+
+    // mask: size x size well numbers (1..64, 0 for none), weights: Q8 per
+    // pixel or NULL for 1.0. A NULL mask goes back to the EEPROM layout.
+    // Returns the number of wells, -1 if the mask is invalid.
+    EXPORT int well_set_mask(int size, const int* mask, const int* weights) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        return theInterfaceObject.SetWellMask(size == 24 ? 24 : 12, mask, weights);
+    }
+
+    EXPORT int well_count(int size) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        return theInterfaceObject.GetWellCount(size == 24 ? 24 : 12);
+    }
+
+    // Per-well results of the latest frame, without copying its pixels.
+    // Returns the number of wells written to 'out', 0 before the first frame.
+    EXPORT int get_latest_wells(WellResult* out, int max_wells, FrameMeta* meta) {
+        FrameBuffer f;
+        if (!theInterfaceObject.ReadLatestFrame(&f))
+            return 0;
+        int n = f.num_wells < max_wells ? f.num_wells : max_wells;
+        memcpy(out, f.wells, n * sizeof(WellResult));
+        if (meta)
+            *meta = f.meta;
+        return n;
+    }
+
+    // --- Hotplug ---
+
+    // Watches for the open device being unplugged and plugged back in. On
+    // removal captures fail at once (get() returns 3); when the same serial
+    // comes back it is reopened, its trim reloaded and the last gain,
+    // integration time, binning and LED settings replayed.
+    // 1: monitoring; 0: not supported or error
+    EXPORT int hotplug_start() {
+        {
+            std::lock_guard<std::mutex> lock(g_DeviceLock);
+            ReadDeviceSerial(g_DeviceSerial, HOTPLUG_SERIAL_LEN);
+        }
+        return HotplugStart(VENDOR_ID, PRODUCT_ID, OnHotplug, NULL);
+    }
+
+    EXPORT void hotplug_stop() {
+        HotplugStop();
+    }
+
+    // removals, arrivals, reconnects, last reconnect ms (-1: none), device lost
+    EXPORT int hotplug_stats(int* stats, int length) {
+        if (length >= 5) {
+            stats[0] = g_HotplugRemovals;
+            stats[1] = g_HotplugArrivals;
+            stats[2] = (int)g_MetricCounter[METRIC_DEVICE_RECONNECTS].load(std::memory_order_relaxed);
+            stats[3] = g_LastReconnectMs;
+            stats[4] = g_DeviceLost.load(std::memory_order_acquire) ? 1 : 0;
+            return 5;
+        }
+        return 0;
+    }
+
+    // --- USB recovery ---
+
+    // runs, failures, stage that brought the last run back (-1: failed),
+    // last run total us, last run us per stage (4), runs resolved per stage (4)
+    EXPORT int usb_recovery_stats(int* stats, int length) {
+        UsbRecoveryStats st;
+        UsbRecoveryGetStats(&st);
+        if (length >= 4 + 2 * USB_STAGE_COUNT) {
+            stats[0] = (int)st.runs;
+            stats[1] = (int)st.failures;
+            stats[2] = st.last_stage;
+            stats[3] = (int)st.last_total_us;
+            for (int i = 0; i < USB_STAGE_COUNT; i++) {
+                stats[4 + i] = (int)st.last_stage_us[i];
+                stats[4 + USB_STAGE_COUNT + i] = (int)st.resolved[i];
+            }
+            return 4 + 2 * USB_STAGE_COUNT;
+        }
+        return 0;
+    }
+
+    // --- Run recording ---
+
+    // codec: 0 raw, 1 bit packed, 2 delta against the previous frame of the channel
+    // Under the device lock: EndFrame() appends to the recorder on the
+    // capture thread, and Close() frees the ring it appends into
+    EXPORT int rec_start(const char* path, int codec) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        char serial[32] = { 0 };
         if (DeviceHandle) {
-            Continue_Flag = false;
+            wchar_t wserial[32] = { 0 };
+            if (hid_get_serial_number_string(DeviceHandle, wserial, 32) == 0) {
+                for (int i = 0; i < 31 && wserial[i]; i++)
+                    serial[i] = (char)wserial[i];
+            }
+        }
+        return theInterfaceObject.StartRecording(path, serial, codec);
+    }
+
+    // 1: success; 0: a write failed (see rec_stats), the run file is incomplete
+    EXPORT int rec_stop() {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        return theInterfaceObject.StopRecording();
+    }
+
+    // stats: frames written, dropped, queued, short writes
+    EXPORT int rec_stats(int* stats, int length) {
+        const CRunRecorder& rec = theInterfaceObject.GetRecorder();
+        if (length >= 3) {
+            stats[0] = (int)rec.FramesWritten();
+            stats[1] = (int)rec.FramesDropped();
+            stats[2] = (int)rec.FramesQueued();
+            if (length < 4)
+                return 3;
+            stats[3] = (int)rec.ShortWrites();
+            return 4;
+        }
+        return 0;
+    }
+
+    EXPORT void* runfile_open(const char* path) {
+        CRunFileReader* reader = new CRunFileReader();
+        if (!reader->Open(path)) {
+            delete reader;
+            return nullptr;
+        }
+        return reader;
+    }
+
+    EXPORT int runfile_frame_count(void* handle) {
+        return handle ? (int)((CRunFileReader*)handle)->FrameCount() : 0;
+    }
+
+    // Copies frame k (frame_size x frame_size ints) into outbuf, returns frame_size or 0
+    EXPORT int runfile_read_frame(void* handle, int k, int* outbuf, FrameMeta* meta) {
+        if (!handle || k < 0)
+            return 0;
+        return ((CRunFileReader*)handle)->ReadFrame((uint32_t)k, outbuf, meta);
+    }
+
+    EXPORT void runfile_close(void* handle) {
+        delete (CRunFileReader*)handle;
+    }
+
+    // --- Frame codec for streaming: one encoder state on the sending side, one decoder on the receiving side ---
+
+    // Callers may encode on one thread and decode on another; both states share one lock
+    static std::mutex g_StreamCodecLock;
+    static CFrameCodec g_StreamEncoder;
+    static CFrameCodec g_StreamDecoder;
+
+    EXPORT int frame_encode(int chan, const int* pixels, int count, int delta, unsigned char* out, int outlen) {
+        if (outlen < (int)FRAME_CODEC_MAX_BYTES)
+            return 0;
+        std::lock_guard<std::mutex> lock(g_StreamCodecLock);
+        return g_StreamEncoder.Encode(chan, pixels, count, delta != 0, out);
+    }
+
+    // max_pixels: size of 'pixels' in ints
+    EXPORT int frame_decode(int chan, const unsigned char* in, int len, int* pixels, int max_pixels) {
+        std::lock_guard<std::mutex> lock(g_StreamCodecLock);
+        return g_StreamDecoder.Decode(chan, in, len, pixels, max_pixels);
+    }
+
+    EXPORT int frame_codec_max_bytes() {
+        return (int)FRAME_CODEC_MAX_BYTES;
+    }
+
+    EXPORT void frame_codec_reset() {
+        std::lock_guard<std::mutex> lock(g_StreamCodecLock);
+        g_StreamEncoder.Reset();
+        g_StreamDecoder.Reset();
+    }
+
+    // --- Metrics ---
+
+    // Fills a MetricsSnapshot (see Metrics.h), size: bytes available at 'out'
+    EXPORT int get_metrics(MetricsSnapshot* out, int size) {
+        if (!out || size < (int)sizeof(MetricsSnapshot))
+            return 0;
+        MetricSet(METRIC_RING_USED, GetBufferSize());
+        MetricSet(METRIC_RING_CAPACITY, CIRCULAR_BUFFER_SIZE);
+        MetricSet(METRIC_RECORDER_QUEUED, theInterfaceObject.GetRecorder().FramesQueued());
+        MetricsGet(out);
+        return 1;
+    }
+
+    EXPORT void metrics_reset() {
+        MetricsReset();
+    }
+
+    // Rewrites a Prometheus text file at 'path' every period_ms
+    EXPORT int metrics_export_start(const char* path, int period_ms) {
+        return MetricsExportStart(path, period_ms);
+    }
+
+    EXPORT void metrics_export_stop() {
+        MetricsExportStop();
+    }
+
+    // --- Tracing ---
+
+    EXPORT void trace_enable(int enable) {
+        TraceEnable(enable != 0);
+    }
+
+    EXPORT void trace_clear() {
+        TraceClear();
+    }
+
+    // Chrome trace JSON, open in chrome://tracing or ui.perfetto.dev
+    EXPORT int trace_dump(const char* path) {
+        return TraceDump(path);
+    }
+
+    // Logging: level 0 off, 1 error, 2 warn, 3 info (default), 4 debug
+
+    EXPORT void log_set_level(int level) {
+        LogSetLevel(level);
+    }
+
+    EXPORT int log_get_level() {
+        return LogGetLevel();
+    }
+
+    EXPORT void log_flush() {
+        LogFlush();
+    }
+
+    EXPORT int log_dropped() {
+        return (int)LogDropped();
+    }
+
+    // --- Buffer pools ---
+
+    // Number of frame buffers to keep. Waits for a capture in progress, since
+    // the pool must not be reopened while a frame is assembled in it.
+    // 1: success; 0: error
+    EXPORT int pool_configure(int frames) {
+        std::lock_guard<std::mutex> lock(g_DeviceLock);
+        return theInterfaceObject.OpenPools(frames);
+    }
+
+    // capacity, in use, high water, times exhausted, steady state frames that
+    // allocated (-1 unless built with ULS_ALLOC_CHECK)
+    EXPORT int pool_stats(int* stats, int length) {
+        BufferPoolStats st;
+        theInterfaceObject.GetFramePool().GetStats(&st);
+        if (length >= 5) {
+            stats[0] = st.capacity;
+            stats[1] = st.in_use;
+            stats[2] = st.high_water;
+            stats[3] = (int)st.exhausted;
+            stats[4] = AllocCheckBuilt() ? (int)g_MetricCounter[METRIC_FRAME_ALLOCS].load(std::memory_order_relaxed) : -1;
+            return 5;
         }
+        return 0;
     }
 
+    // --- Real-time scheduling ---
+
+    // fifo_priority 1-99 runs captures under SCHED_FIFO, 0 leaves the policy alone;
+    // io_cpu / worker_cpu -1 leaves that side unpinned.
+    // Returns the policy a trial capture got: 0 normal, 1 FIFO
+    EXPORT int rt_configure(int fifo_priority, int io_cpu, int worker_cpu, int lock_buffers) {
+        RtSchedConfig cfg;
+        cfg.fifo_priority = fifo_priority;
+        cfg.io_cpu = io_cpu;
+        cfg.worker_cpu = worker_cpu;
+        cfg.lock_buffers = lock_buffers;
+        return RtSchedConfigure(cfg);
+    }
+
+    // policy, priority, cpu, error, pinned workers, locked KiB
+    EXPORT int rt_status(int* stats, int length) {
+        RtSchedStatus st;
+        RtSchedGetStatus(&st);
+        if (length >= 6) {
+            stats[0] = st.policy;
+            stats[1] = st.priority;
+            stats[2] = st.cpu;
+            stats[3] = st.error;
+            stats[4] = st.workers;
+            stats[5] = (int)(st.locked_bytes / 1024);
+            return 6;
+        }
+        return 0;
+    }
+
+    // Kept for existing scripts: FIFO captures and locked library buffers,
+    // no longer mlockall() and a nice value for the whole process
     EXPORT void optimize_for_pi() {
-#ifdef __linux__
-        mlockall(MCL_CURRENT | MCL_FUTURE);
-        setpriority(PRIO_PROCESS, 0, -20);
-        printf("Applied Raspberry Pi optimizations\n");
-#endif
+        RtSchedConfig cfg = RtSchedGetConfig();
+        cfg.fifo_priority = 50;
+        cfg.lock_buffers = 1;
+        RtSchedConfigure(cfg);
     }
 }
\ No newline at end of file
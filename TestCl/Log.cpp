@@ -0,0 +1,302 @@
+// Copyright 2023, All rights reserved
+
+#include "Log.h"
+#include "RtSched.h"
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+std::atomic<int> g_LogLevel(LOG_LEVEL_INFO);
+
+static LogRecord g_LogRing[LOG_RING_SLOTS];
+static std::atomic<uint32_t> g_LogEnqueuePos(0);
+static uint32_t g_LogDequeuePos = 0;				// Guarded by g_LogFlushLock
+static std::atomic<uint32_t> g_LogDropped(0);
+
+static std::once_flag g_LogStartOnce;
+static std::mutex g_LogFlushLock;
+static uint64_t g_LogStartNs = 0;
+static std::atomic<bool> g_LogStarted(false);
+
+static std::thread g_LogFlusher;
+static std::mutex g_LogFlusherLock;
+static std::condition_variable g_LogFlusherWake;
+static bool g_LogFlusherStop = false;
+
+static uint64_t LogNowNs()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void LogFlusherThread();
+
+static void LogStart()
+{
+    for (uint32_t i = 0; i < LOG_RING_SLOTS; i++)
+        g_LogRing[i].seq.store(i, std::memory_order_relaxed);
+
+    g_LogStartNs = LogNowNs();
+    RtSchedRegisterBuffer(g_LogRing, sizeof(g_LogRing));
+
+    g_LogFlusher = std::thread(LogFlusherThread);
+    g_LogStarted = true;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Producer side. Bounded multi-producer ring: a slot is free for position
+// pos when its seq == pos, and ready for the flusher when seq == pos + 1.
+/////////////////////////////////////////////////////////////////////////////
+
+LogRecord* LogBegin(int level, const char* fmt)
+{
+    std::call_once(g_LogStartOnce, LogStart);
+
+    uint32_t pos = g_LogEnqueuePos.load(std::memory_order_relaxed);
+
+    for (;;) {
+        LogRecord* r = &g_LogRing[pos & (LOG_RING_SLOTS - 1)];
+        int32_t dif = (int32_t)(r->seq.load(std::memory_order_acquire) - pos);
+
+        if (dif == 0) {
+            if (g_LogEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                r->level = (uint8_t)level;
+                r->nargs = 0;
+                r->str_used = 0;
+                r->time_ns = LogNowNs();
+                r->fmt = fmt;
+                return r;
+            }
+        }
+        else if (dif < 0) {
+            g_LogDropped.fetch_add(1, std::memory_order_relaxed);
+            return NULL;
+        }
+        else {
+            pos = g_LogEnqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void LogCommit(LogRecord* r)
+{
+    // seq still holds the claimed position
+    r->seq.store(r->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void LogPutStr(LogRecord* r, const char* s)
+{
+    if (r->nargs >= LOG_MAX_ARGS)
+        return;
+
+    uint32_t at = r->str_used;
+    uint32_t o = at;
+
+    if (s) {
+        while (*s && o < LOG_STR_BYTES - 1)
+            r->str[o++] = *s++;
+    }
+    else {
+        const char* n = "(null)";
+        while (*n && o < LOG_STR_BYTES - 1)
+            r->str[o++] = *n++;
+    }
+    r->str[o < LOG_STR_BYTES ? o : LOG_STR_BYTES - 1] = 0;
+    r->str_used = (uint16_t)(o < LOG_STR_BYTES - 1 ? o + 1 : LOG_STR_BYTES - 1);
+
+    r->args[r->nargs].type = LOG_ARG_STR;
+    r->args[r->nargs].str = at < LOG_STR_BYTES ? at : LOG_STR_BYTES - 1;
+    r->nargs++;
+}
+
+// hidapi reports strings as wchar_t; keep ASCII and replace the rest
+
+void LogPutWStr(LogRecord* r, const wchar_t* s)
+{
+    if (r->nargs >= LOG_MAX_ARGS)
+        return;
+
+    uint32_t at = r->str_used;
+    uint32_t o = at;
+
+    if (!s)
+        s = L"(null)";
+    while (*s && o < LOG_STR_BYTES - 1) {
+        r->str[o++] = (*s > 0 && *s < 0x80) ? (char)*s : '?';
+        s++;
+    }
+    r->str[o < LOG_STR_BYTES ? o : LOG_STR_BYTES - 1] = 0;
+    r->str_used = (uint16_t)(o < LOG_STR_BYTES - 1 ? o + 1 : LOG_STR_BYTES - 1);
+
+    r->args[r->nargs].type = LOG_ARG_STR;
+    r->args[r->nargs].str = at < LOG_STR_BYTES ? at : LOG_STR_BYTES - 1;
+    r->nargs++;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Flusher side
+/////////////////////////////////////////////////////////////////////////////
+
+// printf-style formatting against the captured argument types. Length
+// modifiers in the format are ignored, the stored type decides.
+
+static size_t LogFormat(const LogRecord* r, char* out, size_t size)
+{
+    const char* f = r->fmt;
+    size_t o = 0;
+    int argi = 0;
+
+    while (*f && o + 1 < size) {
+        if (*f != '%') {
+            out[o++] = *f++;
+            continue;
+        }
+        if (f[1] == '%') {
+            out[o++] = '%';
+            f += 2;
+            continue;
+        }
+
+        char spec[32];
+        int sl = 0;
+        spec[sl++] = *f++;
+        while (*f && strchr("-+ #0", *f) && sl < 12)
+            spec[sl++] = *f++;
+        while (*f && (isdigit((unsigned char)*f) || *f == '.') && sl < 24)
+            spec[sl++] = *f++;
+        while (*f && strchr("hlLqjzt", *f))
+            f++;
+        char conv = *f ? *f++ : 0;
+
+        const LogArg* a = argi < r->nargs ? &r->args[argi++] : NULL;
+        char tmp[LOG_STR_BYTES + 32];
+        int n = 0;
+
+        if (!a) {
+            n = snprintf(tmp, sizeof(tmp), "(missing)");
+        }
+        else if (a->type == LOG_ARG_STR || conv == 's') {
+            spec[sl++] = 's';
+            spec[sl] = 0;
+            n = snprintf(tmp, sizeof(tmp), spec, a->type == LOG_ARG_STR ? r->str + a->str : "(?)");
+        }
+        else if (strchr("fFeEgGaA", conv)) {
+            spec[sl++] = conv;
+            spec[sl] = 0;
+            n = snprintf(tmp, sizeof(tmp), spec, a->type == LOG_ARG_DOUBLE ? a->d : (double)a->i);
+        }
+        else if (conv == 'c') {
+            spec[sl++] = 'c';
+            spec[sl] = 0;
+            n = snprintf(tmp, sizeof(tmp), spec, (int)a->i);
+        }
+        else if (conv == 'p') {
+            spec[sl++] = 'p';
+            spec[sl] = 0;
+            n = snprintf(tmp, sizeof(tmp), spec, a->p);
+        }
+        else if (strchr("diuxXo", conv)) {
+            spec[sl++] = 'l';
+            spec[sl++] = 'l';
+            spec[sl++] = conv;
+            spec[sl] = 0;
+            long long v = a->type == LOG_ARG_DOUBLE ? (long long)a->d : (long long)a->i;
+            n = snprintf(tmp, sizeof(tmp), spec, v);
+        }
+
+        for (int i = 0; i < n && i < (int)sizeof(tmp) - 1 && o + 1 < size; i++)
+            out[o++] = tmp[i];
+    }
+
+    out[o] = 0;
+    return o;
+}
+
+static void LogDrainLocked()
+{
+    static const char level_char[] = { '-', 'E', 'W', 'I', 'D' };
+    bool wrote = false;
+
+    for (;;) {
+        LogRecord* r = &g_LogRing[g_LogDequeuePos & (LOG_RING_SLOTS - 1)];
+        if ((int32_t)(r->seq.load(std::memory_order_acquire) - (g_LogDequeuePos + 1)) < 0)
+            break;
+
+        char line[512];
+        LogFormat(r, line, sizeof(line));
+
+        double t = (double)(r->time_ns - g_LogStartNs) / 1e9;
+        fprintf(stdout, "[%11.6f] %c %s\n", t, level_char[r->level <= LOG_LEVEL_DEBUG ? r->level : 0], line);
+        wrote = true;
+
+        r->seq.store(g_LogDequeuePos + LOG_RING_SLOTS, std::memory_order_release);
+        g_LogDequeuePos++;
+    }
+
+    if (wrote)
+        fflush(stdout);
+}
+
+static void LogFlusherThread()
+{
+    CRtWorkerThread worker;
+    std::unique_lock<std::mutex> lock(g_LogFlusherLock);
+
+    while (!g_LogFlusherStop) {
+        lock.unlock();
+        {
+            std::lock_guard<std::mutex> flush(g_LogFlushLock);
+            LogDrainLocked();
+        }
+        lock.lock();
+
+        g_LogFlusherWake.wait_for(lock, std::chrono::milliseconds(5), [] { return g_LogFlusherStop; });
+    }
+}
+
+void LogFlush()
+{
+    std::call_once(g_LogStartOnce, LogStart);
+
+    std::lock_guard<std::mutex> lock(g_LogFlushLock);
+    LogDrainLocked();
+}
+
+void LogSetLevel(int level)
+{
+    if (level < LOG_LEVEL_OFF) level = LOG_LEVEL_OFF;
+    if (level > LOG_LEVEL_DEBUG) level = LOG_LEVEL_DEBUG;
+    g_LogLevel.store(level, std::memory_order_relaxed);
+}
+
+int LogGetLevel()
+{
+    return g_LogLevel.load(std::memory_order_relaxed);
+}
+
+uint32_t LogDropped()
+{
+    return g_LogDropped.load(std::memory_order_relaxed);
+}
+
+// Stop the flusher and print whatever is still queued when the library is
+// unloaded. A joinable std::thread must not be destroyed.
+static struct CLogExitFlush {
+    ~CLogExitFlush()
+    {
+        if (g_LogFlusher.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(g_LogFlusherLock);
+                g_LogFlusherStop = true;
+            }
+            g_LogFlusherWake.notify_all();
+            g_LogFlusher.join();
+        }
+        if (g_LogStarted)
+            LogFlush();
+    }
+} g_LogExitFlush;
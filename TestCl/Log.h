@@ -0,0 +1,143 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+///////////////////////////////////////////////////////////////////////////////
+// Asynchronous logging.
+//
+// ULS_LOG() stores the format string pointer and the raw argument values in a
+// slot of a lock-free ring and returns; a background thread formats and prints
+// the records. A call below the current level costs one relaxed load.
+//
+// The format string must be a literal (only its pointer is kept). Strings
+// passed as %s / %ls are copied into the record, truncated to LOG_STR_BYTES
+// in total, so hid_error() results and device paths are safe to log.
+///////////////////////////////////////////////////////////////////////////////
+
+#define LOG_LEVEL_OFF		0
+#define LOG_LEVEL_ERROR		1
+#define LOG_LEVEL_WARN		2
+#define LOG_LEVEL_INFO		3
+#define LOG_LEVEL_DEBUG		4
+
+#define LOG_RING_SLOTS		1024		// Power of two
+#define LOG_MAX_ARGS		8
+#define LOG_STR_BYTES		128
+
+#define ULS_LOG(level, ...) \
+    do { \
+        if ((level) <= g_LogLevel.load(std::memory_order_relaxed)) \
+            LogWrite((level), __VA_ARGS__); \
+    } while (0)
+
+#define LOG_ERROR(...)	ULS_LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...)	ULS_LOG(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...)	ULS_LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...)	ULS_LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+extern std::atomic<int> g_LogLevel;
+
+enum LogArgType : uint8_t {
+    LOG_ARG_INT,
+    LOG_ARG_UINT,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_STR,					// Offset into LogRecord::str
+    LOG_ARG_PTR
+};
+
+struct LogArg {
+    LogArgType type;
+    union {
+        int64_t  i;
+        uint64_t u;
+        double   d;
+        uint32_t str;
+        const void* p;
+    };
+};
+
+struct LogRecord {
+    std::atomic<uint32_t> seq;		// Ring slot sequence, see LogBegin()
+    uint8_t  level;
+    uint8_t  nargs;
+    uint16_t str_used;
+    uint64_t time_ns;				// Monotonic
+    const char* fmt;
+    LogArg   args[LOG_MAX_ARGS];
+    char     str[LOG_STR_BYTES];
+};
+
+LogRecord* LogBegin(int level, const char* fmt);	// NULL if the ring is full
+void LogCommit(LogRecord* r);
+
+void LogSetLevel(int level);
+int  LogGetLevel();
+void LogFlush();									// Print everything queued so far
+uint32_t LogDropped();								// Records lost to a full ring
+
+// Argument capture, one overload per kind of value
+
+inline void LogPut(LogRecord* r, LogArgType t, int64_t i)
+{
+    if (r->nargs < LOG_MAX_ARGS) {
+        r->args[r->nargs].type = t;
+        r->args[r->nargs].i = i;
+        r->nargs++;
+    }
+}
+
+void LogPutStr(LogRecord* r, const char* s);
+void LogPutWStr(LogRecord* r, const wchar_t* s);
+
+inline void LogArgs(LogRecord*) {}
+
+template<typename... Rest> void LogArgs(LogRecord* r, int v, Rest... rest) { LogPut(r, LOG_ARG_INT, v); LogArgs(r, rest...); }
+template<typename... Rest> void LogArgs(LogRecord* r, long v, Rest... rest) { LogPut(r, LOG_ARG_INT, v); LogArgs(r, rest...); }
+template<typename... Rest> void LogArgs(LogRecord* r, long long v, Rest... rest) { LogPut(r, LOG_ARG_INT, v); LogArgs(r, rest...); }
+template<typename... Rest> void LogArgs(LogRecord* r, unsigned int v, Rest... rest) { LogPut(r, LOG_ARG_UINT, (int64_t)v); LogArgs(r, rest...); }
+template<typename... Rest> void LogArgs(LogRecord* r, unsigned long v, Rest... rest) { LogPut(r, LOG_ARG_UINT, (int64_t)v); LogArgs(r, rest...); }
+template<typename... Rest> void LogArgs(LogRecord* r, unsigned long long v, Rest... rest) { LogPut(r, LOG_ARG_UINT, (int64_t)v); LogArgs(r, rest...); }
+template<typename... Rest> void LogArgs(LogRecord* r, char v, Rest... rest) { LogPut(r, LOG_ARG_INT, v); LogArgs(r, rest...); }
+template<typename... Rest> void LogArgs(LogRecord* r, unsigned char v, Rest... rest) { LogPut(r, LOG_ARG_UINT, v); LogArgs(r, rest...); }
+template<typename... Rest> void LogArgs(LogRecord* r, short v, Rest... rest) { LogPut(r, LOG_ARG_INT, v); LogArgs(r, rest...); }
+template<typename... Rest> void LogArgs(LogRecord* r, unsigned short v, Rest... rest) { LogPut(r, LOG_ARG_UINT, v); LogArgs(r, rest...); }
+template<typename... Rest> void LogArgs(LogRecord* r, bool v, Rest... rest) { LogPut(r, LOG_ARG_INT, v); LogArgs(r, rest...); }
+
+template<typename... Rest> void LogArgs(LogRecord* r, double v, Rest... rest)
+{
+    if (r->nargs < LOG_MAX_ARGS) {
+        r->args[r->nargs].type = LOG_ARG_DOUBLE;
+        r->args[r->nargs].d = v;
+        r->nargs++;
+    }
+    LogArgs(r, rest...);
+}
+
+template<typename... Rest> void LogArgs(LogRecord* r, float v, Rest... rest) { LogArgs(r, (double)v, rest...); }
+template<typename... Rest> void LogArgs(LogRecord* r, const char* v, Rest... rest) { LogPutStr(r, v); LogArgs(r, rest...); }
+template<typename... Rest> void LogArgs(LogRecord* r, char* v, Rest... rest) { LogPutStr(r, v); LogArgs(r, rest...); }
+template<typename... Rest> void LogArgs(LogRecord* r, const wchar_t* v, Rest... rest) { LogPutWStr(r, v); LogArgs(r, rest...); }
+template<typename... Rest> void LogArgs(LogRecord* r, wchar_t* v, Rest... rest) { LogPutWStr(r, v); LogArgs(r, rest...); }
+
+template<typename T, typename... Rest> void LogArgs(LogRecord* r, T* v, Rest... rest)
+{
+    if (r->nargs < LOG_MAX_ARGS) {
+        r->args[r->nargs].type = LOG_ARG_PTR;
+        r->args[r->nargs].p = v;
+        r->nargs++;
+    }
+    LogArgs(r, rest...);
+}
+
+template<typename... Args> void LogWrite(int level, const char* fmt, Args... args)
+{
+    LogRecord* r = LogBegin(level, fmt);
+    if (!r)
+        return;
+    LogArgs(r, args...);
+    LogCommit(r);
+}
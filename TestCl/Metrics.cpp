@@ -0,0 +1,283 @@
+// Copyright 2023, All rights reserved
+
+#include "Metrics.h"
+#include "RtSched.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+std::atomic<uint64_t> g_MetricCounter[METRIC_COUNTER_COUNT];
+std::atomic<int64_t> g_MetricGauge[METRIC_GAUGE_COUNT];
+
+struct MetricHist {
+    std::atomic<uint64_t> bucket[METRIC_HIST_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+};
+
+static MetricHist g_MetricHist[METRIC_HIST_COUNT];
+
+static const char* const g_CounterName[METRIC_COUNTER_COUNT] = {
+    "uls_hid_reports_written_total",
+    "uls_hid_reports_read_total",
+    "uls_hid_read_timeouts_total",
+    "uls_capture_retries_total",
+    "uls_usb_resets_total",
+    "uls_eeprom_parity_errors_total",
+    "uls_rows_dropped_total",
+    "uls_sensor_timeouts_total",
+    "uls_frames_total",
+    "uls_frames_incomplete_total",
+    "uls_capture_frame_allocations_total",
+    "uls_frame_pool_exhausted_total",
+    "uls_device_removals_total",
+    "uls_device_reconnects_total",
+    "uls_stale_reports_discarded_total",
+};
+
+static const char* const g_GaugeName[METRIC_GAUGE_COUNT] = {
+    "uls_input_ring_used",
+    "uls_input_ring_capacity",
+    "uls_recorder_queued_frames",
+};
+
+static const char* const g_HistName[METRIC_HIST_COUNT] = {
+    "uls_command_round_trip_microseconds",
+    "uls_frame_assembly_microseconds",
+    "uls_row_correction_nanoseconds",
+    "uls_device_reconnect_microseconds",
+    "uls_usb_recovery_microseconds",
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// Histograms
+/////////////////////////////////////////////////////////////////////////////
+
+static int MetricBucket(uint64_t v)
+{
+    if (v < METRIC_HIST_SUB)
+        return (int)v;
+
+    if (v >> 33)
+        v = (1ull << 33) - 1;				// Clamp into the last bucket
+
+    int msb = 63;
+    while (!(v >> msb))
+        msb--;
+
+    int sub = (int)(v >> (msb - METRIC_HIST_SUB_BITS)) & (METRIC_HIST_SUB - 1);
+    return (msb - METRIC_HIST_SUB_BITS + 1) * METRIC_HIST_SUB + sub;
+}
+
+uint64_t MetricBucketUpper(int bucket)
+{
+    if (bucket < METRIC_HIST_SUB)
+        return (uint64_t)bucket;
+
+    int shift = bucket / METRIC_HIST_SUB - 1;
+    int sub = bucket % METRIC_HIST_SUB;
+    uint64_t lower = (uint64_t)(METRIC_HIST_SUB + sub) << shift;
+    return lower + (1ull << shift) - 1;
+}
+
+void MetricRecord(MetricHistogram h, uint64_t value)
+{
+    MetricHist& m = g_MetricHist[h];
+
+    m.bucket[MetricBucket(value)].fetch_add(1, std::memory_order_relaxed);
+    m.count.fetch_add(1, std::memory_order_relaxed);
+    m.sum.fetch_add(value, std::memory_order_relaxed);
+
+    uint64_t cur = m.max.load(std::memory_order_relaxed);
+    while (value > cur && !m.max.compare_exchange_weak(cur, value, std::memory_order_relaxed))
+        ;
+}
+
+static uint64_t MetricPercentile(const uint64_t* buckets, uint64_t total, double q)
+{
+    if (!total)
+        return 0;
+
+    uint64_t rank = (uint64_t)(q * (double)total);
+    if (rank >= total)
+        rank = total - 1;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < METRIC_HIST_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen > rank)
+            return MetricBucketUpper(b);
+    }
+    return MetricBucketUpper(METRIC_HIST_BUCKETS - 1);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Snapshots
+/////////////////////////////////////////////////////////////////////////////
+
+static void MetricHistCopy(const MetricHist& m, uint64_t* buckets, MetricHistSummary* s)
+{
+    uint64_t total = 0;
+    for (int b = 0; b < METRIC_HIST_BUCKETS; b++) {
+        buckets[b] = m.bucket[b].load(std::memory_order_relaxed);
+        total += buckets[b];
+    }
+
+    // Buckets are read one by one while writers keep going, so the bucket
+    // total rather than 'count' is used for the percentiles.
+    s->count = m.count.load(std::memory_order_relaxed);
+    s->sum = m.sum.load(std::memory_order_relaxed);
+    s->max = m.max.load(std::memory_order_relaxed);
+    s->p50 = MetricPercentile(buckets, total, 0.50);
+    s->p90 = MetricPercentile(buckets, total, 0.90);
+    s->p99 = MetricPercentile(buckets, total, 0.99);
+}
+
+void MetricsGet(MetricsSnapshot* out)
+{
+    memset(out, 0, sizeof(*out));
+    out->version = METRICS_VERSION;
+    out->size = sizeof(*out);
+
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++)
+        out->counter[i] = g_MetricCounter[i].load(std::memory_order_relaxed);
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++)
+        out->gauge[i] = g_MetricGauge[i].load(std::memory_order_relaxed);
+
+    uint64_t buckets[METRIC_HIST_BUCKETS];
+    for (int i = 0; i < METRIC_HIST_COUNT; i++)
+        MetricHistCopy(g_MetricHist[i], buckets, &out->hist[i]);
+}
+
+void MetricsReset()
+{
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++)
+        g_MetricCounter[i].store(0, std::memory_order_relaxed);
+
+    for (int i = 0; i < METRIC_HIST_COUNT; i++) {
+        MetricHist& m = g_MetricHist[i];
+        for (int b = 0; b < METRIC_HIST_BUCKETS; b++)
+            m.bucket[b].store(0, std::memory_order_relaxed);
+        m.count.store(0, std::memory_order_relaxed);
+        m.sum.store(0, std::memory_order_relaxed);
+        m.max.store(0, std::memory_order_relaxed);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Prometheus text file
+/////////////////////////////////////////////////////////////////////////////
+
+int MetricsWriteText(const char* path)
+{
+    std::string tmp = std::string(path) + ".tmp";
+
+    FILE* f = fopen(tmp.c_str(), "w");
+    if (!f)
+        return 0;
+
+    MetricsSnapshot s;
+    MetricsGet(&s);
+
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        fprintf(f, "# TYPE %s counter\n", g_CounterName[i]);
+        fprintf(f, "%s %llu\n", g_CounterName[i], (unsigned long long)s.counter[i]);
+    }
+
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++) {
+        fprintf(f, "# TYPE %s gauge\n", g_GaugeName[i]);
+        fprintf(f, "%s %lld\n", g_GaugeName[i], (long long)s.gauge[i]);
+    }
+
+    // Cumulative buckets; empty buckets are skipped, which the format allows
+    uint64_t buckets[METRIC_HIST_BUCKETS];
+    for (int i = 0; i < METRIC_HIST_COUNT; i++) {
+        MetricHistSummary sum;
+        MetricHistCopy(g_MetricHist[i], buckets, &sum);
+
+        fprintf(f, "# TYPE %s histogram\n", g_HistName[i]);
+        uint64_t cum = 0;
+        for (int b = 0; b < METRIC_HIST_BUCKETS; b++) {
+            if (!buckets[b])
+                continue;
+            cum += buckets[b];
+            fprintf(f, "%s_bucket{le=\"%llu\"} %llu\n", g_HistName[i],
+                (unsigned long long)MetricBucketUpper(b), (unsigned long long)cum);
+        }
+        fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", g_HistName[i], (unsigned long long)cum);
+        fprintf(f, "%s_sum %llu\n", g_HistName[i], (unsigned long long)sum.sum);
+        fprintf(f, "%s_count %llu\n", g_HistName[i], (unsigned long long)cum);
+    }
+
+    bool ok = !ferror(f);
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) {
+        remove(tmp.c_str());
+        return 0;
+    }
+
+#ifdef _WIN32
+    remove(path);						// rename() does not replace on Windows
+#endif
+    return rename(tmp.c_str(), path) == 0;
+}
+
+static std::thread g_MetricsExporter;
+static std::mutex g_MetricsExportLock;
+static std::condition_variable g_MetricsExportWake;
+static bool g_MetricsExportStop = false;
+
+static void MetricsExportThread(std::string path, int period_ms)
+{
+    CRtWorkerThread worker;
+    std::unique_lock<std::mutex> lock(g_MetricsExportLock);
+
+    while (!g_MetricsExportStop) {
+        lock.unlock();
+        MetricsWriteText(path.c_str());
+        lock.lock();
+
+        g_MetricsExportWake.wait_for(lock, std::chrono::milliseconds(period_ms),
+            [] { return g_MetricsExportStop; });
+    }
+
+    lock.unlock();
+    MetricsWriteText(path.c_str());			// Final values on stop
+}
+
+int MetricsExportStart(const char* path, int period_ms)
+{
+    if (!path || period_ms <= 0)
+        return 0;
+
+    MetricsExportStop();
+
+    g_MetricsExportStop = false;
+    g_MetricsExporter = std::thread(MetricsExportThread, std::string(path), period_ms);
+    return 1;
+}
+
+void MetricsExportStop()
+{
+    if (!g_MetricsExporter.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(g_MetricsExportLock);
+        g_MetricsExportStop = true;
+    }
+    g_MetricsExportWake.notify_all();
+    g_MetricsExporter.join();
+}
+
+// A joinable std::thread must not be destroyed, stop the exporter on unload
+static struct CMetricsExitStop {
+    ~CMetricsExitStop()
+    {
+        MetricsExportStop();
+    }
+} g_MetricsExitStop;
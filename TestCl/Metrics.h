@@ -0,0 +1,125 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+
+///////////////////////////////////////////////////////////////////////////////
+// Library metrics.
+//
+// Counters and gauges are single atomics, updated with relaxed operations from
+// the capture path. Latency histograms are log-linear: each power of two is
+// split into METRIC_HIST_SUB linear sub-buckets, so any recorded value is
+// known to within 25% while the whole range 0 .. 2^32 fits in 132 buckets.
+//
+// MetricsGet() copies everything into a MetricsSnapshot, which is also the
+// layout handed to callers of get_metrics() in the C API.
+///////////////////////////////////////////////////////////////////////////////
+
+enum MetricCounter {
+    METRIC_REPORTS_WRITTEN,			// HID output reports sent
+    METRIC_REPORTS_READ,			// HID input reports received
+    METRIC_READ_TIMEOUTS,			// Input report waits that timed out
+    METRIC_CAPTURE_RETRIES,			// get(): capture attempts after the first
+    METRIC_USB_RESETS,				// reset_usb_endpoints() calls
+    METRIC_PARITY_ERRORS,			// EEPROM packets with a bad parity byte
+    METRIC_ROWS_DROPPED,			// Rows missing from a completed frame
+    METRIC_SENSOR_TIMEOUTS,			// 0xF1 sensor communication time out rows
+    METRIC_FRAMES,					// Frames completed
+    METRIC_FRAMES_INCOMPLETE,		// Frames completed with rows missing
+    METRIC_FRAME_ALLOCS,			// Steady state frames that hit the heap (ULS_ALLOC_CHECK builds)
+    METRIC_FRAME_POOL_EXHAUSTED,	// Captures that found no free frame buffer
+    METRIC_DEVICE_REMOVALS,			// Device unplugged while open
+    METRIC_DEVICE_RECONNECTS,		// Device reopened and restored after a removal
+    METRIC_STALE_REPORTS,			// Queued input reports discarded before a command
+    METRIC_COUNTER_COUNT
+};
+
+enum MetricGauge {
+    METRIC_RING_USED,				// Input ring occupancy, reports
+    METRIC_RING_CAPACITY,
+    METRIC_RECORDER_QUEUED,			// Frames waiting for the run recorder writer
+    METRIC_GAUGE_COUNT
+};
+
+enum MetricHistogram {
+    METRIC_HIST_COMMAND_US,			// Command write to response read, us
+    METRIC_HIST_FRAME_US,			// Capture command to last row, us
+    METRIC_HIST_CORRECTION_NS,		// Trim correction of one row, ns
+    METRIC_HIST_RECONNECT_US,		// Device arrival to trim and settings restored, us
+    METRIC_HIST_RECOVERY_US,		// UsbRecover() from start to the device answering and restored (or giving up), us
+    METRIC_HIST_COUNT
+};
+
+#define METRIC_HIST_SUB_BITS	2
+#define METRIC_HIST_SUB			(1 << METRIC_HIST_SUB_BITS)
+#define METRIC_HIST_BUCKETS		((32 + 1) * METRIC_HIST_SUB)
+
+struct MetricHistSummary {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t p50;					// Upper bound of the bucket holding the percentile
+    uint64_t p90;
+    uint64_t p99;
+};
+
+struct MetricsSnapshot {
+    uint32_t version;				// METRICS_VERSION
+    uint32_t size;					// sizeof(MetricsSnapshot)
+    uint64_t counter[METRIC_COUNTER_COUNT];
+    int64_t  gauge[METRIC_GAUGE_COUNT];
+    MetricHistSummary hist[METRIC_HIST_COUNT];
+};
+
+#define METRICS_VERSION			5
+
+extern std::atomic<uint64_t> g_MetricCounter[METRIC_COUNTER_COUNT];
+extern std::atomic<int64_t> g_MetricGauge[METRIC_GAUGE_COUNT];
+
+inline void MetricInc(MetricCounter c, uint64_t n = 1)
+{
+    g_MetricCounter[c].fetch_add(n, std::memory_order_relaxed);
+}
+
+inline void MetricSet(MetricGauge g, int64_t v)
+{
+    g_MetricGauge[g].store(v, std::memory_order_relaxed);
+}
+
+void MetricRecord(MetricHistogram h, uint64_t value);
+uint64_t MetricBucketUpper(int bucket);		// Largest value that lands in 'bucket'
+
+void MetricsGet(MetricsSnapshot* out);
+void MetricsReset();
+
+// Prometheus text exposition written to 'path' every period_ms milliseconds.
+// The file is written beside the target and renamed over it, so a scraper
+// (node_exporter textfile collector) never sees a partial file.
+int  MetricsExportStart(const char* path, int period_ms);	// 1: success; 0: error
+void MetricsExportStop();
+int  MetricsWriteText(const char* path);					// One shot, 1: success; 0: error
+
+// Records the lifetime of a scope into a histogram
+
+class CMetricTimer {
+public:
+    CMetricTimer(MetricHistogram h, bool ns = false)
+        : m_Hist(h), m_Ns(ns), m_Start(std::chrono::steady_clock::now()) {}
+
+    ~CMetricTimer()
+    {
+        std::chrono::steady_clock::duration d = std::chrono::steady_clock::now() - m_Start;
+        if (m_Ns)
+            MetricRecord(m_Hist, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+        else
+            MetricRecord(m_Hist, (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+    }
+
+protected:
+    MetricHistogram m_Hist;
+    bool m_Ns;
+    std::chrono::steady_clock::time_point m_Start;
+};
@@ -0,0 +1,400 @@
+// Copyright 2023, All rights reserved
+
+#include "RtSched.h"
+#include "Log.h"
+#include <atomic>
+#include <mutex>
+#include <cerrno>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+struct RtBuffer {
+    const void* p;
+    size_t bytes;
+    bool locked;
+};
+
+struct RtWorker {
+    bool used;
+#ifdef _WIN32
+    HANDLE thread;
+    DWORD_PTR old_mask;
+#else
+    pthread_t thread;
+    cpu_set_t old_mask;
+#endif
+};
+
+static std::atomic<int> g_RtFifoPriority(0);
+static std::atomic<int> g_RtIoCpu(-1);
+static int g_RtWorkerCpu = -1;				// Guarded by g_RtLock
+static bool g_RtLockBuffers = false;		// Guarded by g_RtLock
+
+static std::atomic<int> g_RtPolicy(-1);
+static std::atomic<int> g_RtPriority(0);
+static std::atomic<int> g_RtCpu(-1);
+static std::atomic<int> g_RtError(0);
+
+static std::mutex g_RtLock;
+static RtBuffer g_RtBuffers[RT_MAX_BUFFERS];
+static int g_RtBufferCount = 0;
+static RtWorker g_RtWorkers[RT_MAX_WORKERS];
+
+static int RtLastError()
+{
+#ifdef _WIN32
+    return (int)GetLastError();
+#else
+    return errno;
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Buffers
+/////////////////////////////////////////////////////////////////////////////
+
+static bool RtLockBuffer(RtBuffer& b)
+{
+#ifdef _WIN32
+    bool ok = VirtualLock((LPVOID)b.p, b.bytes) != 0;
+#else
+    bool ok = mlock(b.p, b.bytes) == 0;
+#endif
+    if (!ok)
+        g_RtError.store(RtLastError(), std::memory_order_relaxed);
+    b.locked = ok;
+    return ok;
+}
+
+static size_t RtPageSize()
+{
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwPageSize;
+#else
+    return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// True if another locked buffer has bytes in the page at 'page'
+static bool RtPageShared(const RtBuffer& self, uintptr_t page, size_t page_size)
+{
+    for (int i = 0; i < g_RtBufferCount; i++) {
+        const RtBuffer& o = g_RtBuffers[i];
+        if (&o == &self || !o.locked)
+            continue;
+        uintptr_t start = (uintptr_t)o.p;
+        if (start < page + page_size && start + o.bytes > page)
+            return true;
+    }
+    return false;
+}
+
+// Page locks do not nest: unlocking a buffer's whole range would also unlock
+// the first or last page of a neighbouring buffer that shares it. Those pages
+// stay locked until the last buffer on them goes.
+
+static void RtUnlockBuffer(RtBuffer& b)
+{
+    if (!b.locked)
+        return;
+    b.locked = false;
+
+    size_t page_size = RtPageSize();
+    uintptr_t first = (uintptr_t)b.p & ~(uintptr_t)(page_size - 1);
+    uintptr_t end = ((uintptr_t)b.p + b.bytes + page_size - 1) & ~(uintptr_t)(page_size - 1);
+
+    if (RtPageShared(b, first, page_size))
+        first += page_size;
+    if (end > first && RtPageShared(b, end - page_size, page_size))
+        end -= page_size;
+    if (end <= first)
+        return;
+
+#ifdef _WIN32
+    VirtualUnlock((LPVOID)first, end - first);
+#else
+    munlock((const void*)first, end - first);
+#endif
+}
+
+void RtSchedRegisterBuffer(const void* p, size_t bytes)
+{
+    if (!p || !bytes)
+        return;
+
+    std::lock_guard<std::mutex> lock(g_RtLock);
+
+    // No logging here: the log ring registers itself while the logger starts
+    if (g_RtBufferCount >= RT_MAX_BUFFERS) {
+        g_RtError.store(ENOMEM, std::memory_order_relaxed);
+        return;
+    }
+
+    RtBuffer& b = g_RtBuffers[g_RtBufferCount++];
+    b.p = p;
+    b.bytes = bytes;
+    b.locked = false;
+
+    if (g_RtLockBuffers)
+        RtLockBuffer(b);
+}
+
+void RtSchedUnregisterBuffer(const void* p)
+{
+    std::lock_guard<std::mutex> lock(g_RtLock);
+
+    for (int i = 0; i < g_RtBufferCount; i++) {
+        if (g_RtBuffers[i].p == p) {
+            RtUnlockBuffer(g_RtBuffers[i]);
+            g_RtBuffers[i] = g_RtBuffers[--g_RtBufferCount];
+            return;
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Worker threads
+/////////////////////////////////////////////////////////////////////////////
+
+// cpu < 0 puts the worker back on the affinity it started with
+static void RtPinWorker(RtWorker& w, int cpu)
+{
+#ifdef _WIN32
+    DWORD_PTR mask = cpu >= 0 ? ((DWORD_PTR)1 << cpu) : w.old_mask;
+    if (!SetThreadAffinityMask(w.thread, mask))
+        g_RtError.store(RtLastError(), std::memory_order_relaxed);
+#else
+    cpu_set_t set;
+    if (cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+    }
+    else {
+        set = w.old_mask;
+    }
+    int err = pthread_setaffinity_np(w.thread, sizeof(set), &set);
+    if (err)
+        g_RtError.store(err, std::memory_order_relaxed);
+#endif
+}
+
+CRtWorkerThread::CRtWorkerThread()
+    : m_Slot(-1)
+{
+    std::lock_guard<std::mutex> lock(g_RtLock);
+
+    for (int i = 0; i < RT_MAX_WORKERS; i++) {
+        RtWorker& w = g_RtWorkers[i];
+        if (w.used)
+            continue;
+
+#ifdef _WIN32
+        if (!DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &w.thread,
+            0, FALSE, DUPLICATE_SAME_ACCESS))
+            return;
+        DWORD_PTR process_mask, system_mask;
+        GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask);
+        w.old_mask = process_mask;
+#else
+        w.thread = pthread_self();
+        pthread_getaffinity_np(w.thread, sizeof(w.old_mask), &w.old_mask);
+#endif
+        w.used = true;
+        m_Slot = i;
+
+        if (g_RtWorkerCpu >= 0)
+            RtPinWorker(w, g_RtWorkerCpu);
+        return;
+    }
+}
+
+CRtWorkerThread::~CRtWorkerThread()
+{
+    if (m_Slot < 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(g_RtLock);
+#ifdef _WIN32
+    CloseHandle(g_RtWorkers[m_Slot].thread);
+#endif
+    g_RtWorkers[m_Slot].used = false;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Capture scope
+/////////////////////////////////////////////////////////////////////////////
+
+CRtCaptureScope::CRtCaptureScope()
+    : m_Raised(false), m_Pinned(false), m_OldPolicy(0), m_OldPriority(0)
+{
+    int prio = g_RtFifoPriority.load(std::memory_order_relaxed);
+    int cpu = g_RtIoCpu.load(std::memory_order_relaxed);
+
+    if (!prio && cpu < 0)
+        return;
+
+#ifdef _WIN32
+    HANDLE self = GetCurrentThread();
+
+    if (cpu >= 0) {
+        m_OldMask = (uintptr_t)SetThreadAffinityMask(self, (DWORD_PTR)1 << cpu);
+        m_Pinned = m_OldMask != 0;
+        if (!m_Pinned)
+            g_RtError.store(RtLastError(), std::memory_order_relaxed);
+    }
+
+    if (prio) {
+        m_OldPriority = GetThreadPriority(self);
+        m_Raised = SetThreadPriority(self, THREAD_PRIORITY_TIME_CRITICAL) != 0;
+        if (!m_Raised)
+            g_RtError.store(RtLastError(), std::memory_order_relaxed);
+    }
+
+    g_RtPolicy.store(m_Raised ? RT_POLICY_FIFO : RT_POLICY_OTHER, std::memory_order_relaxed);
+    g_RtPriority.store(m_Raised ? THREAD_PRIORITY_TIME_CRITICAL : GetThreadPriority(self), std::memory_order_relaxed);
+#else
+    pthread_t self = pthread_self();
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int err = pthread_getaffinity_np(self, sizeof(m_OldMask), &m_OldMask);
+        if (!err)
+            err = pthread_setaffinity_np(self, sizeof(set), &set);
+        m_Pinned = !err;
+        if (err)
+            g_RtError.store(err, std::memory_order_relaxed);
+    }
+
+    sched_param param;
+    pthread_getschedparam(self, &m_OldPolicy, &param);
+    m_OldPriority = param.sched_priority;
+
+    if (prio) {
+        sched_param fifo;
+        fifo.sched_priority = prio;
+        int err = pthread_setschedparam(self, SCHED_FIFO, &fifo);	// EPERM without CAP_SYS_NICE or RLIMIT_RTPRIO
+        m_Raised = !err;
+        if (err)
+            g_RtError.store(err, std::memory_order_relaxed);
+    }
+
+    g_RtPolicy.store(m_Raised ? RT_POLICY_FIFO : RT_POLICY_OTHER, std::memory_order_relaxed);
+    g_RtPriority.store(m_Raised ? prio : m_OldPriority, std::memory_order_relaxed);
+#endif
+
+    g_RtCpu.store(m_Pinned ? cpu : -1, std::memory_order_relaxed);
+}
+
+CRtCaptureScope::~CRtCaptureScope()
+{
+#ifdef _WIN32
+    HANDLE self = GetCurrentThread();
+    if (m_Raised)
+        SetThreadPriority(self, m_OldPriority);
+    if (m_Pinned)
+        SetThreadAffinityMask(self, (DWORD_PTR)m_OldMask);
+#else
+    pthread_t self = pthread_self();
+    if (m_Raised) {
+        sched_param param;
+        param.sched_priority = m_OldPriority;
+        pthread_setschedparam(self, m_OldPolicy, &param);
+    }
+    if (m_Pinned)
+        pthread_setaffinity_np(self, sizeof(m_OldMask), &m_OldMask);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Configuration
+/////////////////////////////////////////////////////////////////////////////
+
+int RtSchedConfigure(const RtSchedConfig& cfg)
+{
+    int prio = cfg.fifo_priority;
+    if (prio < 0) prio = 0;
+    if (prio > 99) prio = 99;
+
+    g_RtFifoPriority.store(prio, std::memory_order_relaxed);
+    g_RtIoCpu.store(cfg.io_cpu, std::memory_order_relaxed);
+    g_RtError.store(0, std::memory_order_relaxed);
+
+    {
+        std::lock_guard<std::mutex> lock(g_RtLock);
+
+        g_RtWorkerCpu = cfg.worker_cpu;
+        for (int i = 0; i < RT_MAX_WORKERS; i++) {
+            if (g_RtWorkers[i].used)
+                RtPinWorker(g_RtWorkers[i], cfg.worker_cpu);
+        }
+
+        g_RtLockBuffers = cfg.lock_buffers != 0;
+        for (int i = 0; i < g_RtBufferCount; i++) {
+            if (g_RtLockBuffers && !g_RtBuffers[i].locked)
+                RtLockBuffer(g_RtBuffers[i]);
+            else if (!g_RtLockBuffers)
+                RtUnlockBuffer(g_RtBuffers[i]);
+        }
+    }
+
+    // Find out now, rather than on the first capture, what the caller is allowed
+    {
+        CRtCaptureScope trial;
+    }
+    if (!prio && cfg.io_cpu < 0) {
+        g_RtPolicy.store(RT_POLICY_OTHER, std::memory_order_relaxed);
+        g_RtPriority.store(0, std::memory_order_relaxed);
+        g_RtCpu.store(-1, std::memory_order_relaxed);
+    }
+
+    RtSchedStatus st;
+    RtSchedGetStatus(&st);
+    LOG_INFO("RtSched: captures under %s priority %d on cpu %d, workers on cpu %d, %lld bytes locked (error %d)",
+        st.policy == RT_POLICY_FIFO ? "FIFO" : "OTHER", st.priority, st.cpu, cfg.worker_cpu,
+        (long long)st.locked_bytes, st.error);
+
+    return st.policy;
+}
+
+RtSchedConfig RtSchedGetConfig()
+{
+    std::lock_guard<std::mutex> lock(g_RtLock);
+
+    RtSchedConfig cfg;
+    cfg.fifo_priority = g_RtFifoPriority.load(std::memory_order_relaxed);
+    cfg.io_cpu = g_RtIoCpu.load(std::memory_order_relaxed);
+    cfg.worker_cpu = g_RtWorkerCpu;
+    cfg.lock_buffers = g_RtLockBuffers;
+    return cfg;
+}
+
+void RtSchedGetStatus(RtSchedStatus* status)
+{
+    status->policy = g_RtPolicy.load(std::memory_order_relaxed);
+    status->priority = g_RtPriority.load(std::memory_order_relaxed);
+    status->cpu = g_RtCpu.load(std::memory_order_relaxed);
+    status->error = g_RtError.load(std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(g_RtLock);
+
+    status->workers = 0;
+    if (g_RtWorkerCpu >= 0) {
+        for (int i = 0; i < RT_MAX_WORKERS; i++)
+            status->workers += g_RtWorkers[i].used;
+    }
+
+    status->locked_bytes = 0;
+    for (int i = 0; i < g_RtBufferCount; i++) {
+        if (g_RtBuffers[i].locked)
+            status->locked_bytes += (int64_t)g_RtBuffers[i].bytes;
+    }
+}
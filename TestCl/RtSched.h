@@ -0,0 +1,82 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#ifndef _WIN32
+#include <sched.h>
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Real-time scheduling for the device I/O path.
+//
+// Captures run on the caller's thread (get() from Python). CRtCaptureScope
+// raises that thread to SCHED_FIFO and pins it to the I/O core for the length
+// of one capture, then restores its previous policy and affinity, so the rest
+// of the process stays under the normal scheduler.
+//
+// The library's own threads (run recorder writer, log flusher, metrics
+// exporter) declare themselves with CRtWorkerThread and are kept on the
+// processing core. Buffers the library preallocates are registered and
+// mlock()ed when buffer locking is on, in place of mlockall() on the whole
+// process.
+//
+// On Windows FIFO maps to THREAD_PRIORITY_TIME_CRITICAL and locking to
+// VirtualLock().
+///////////////////////////////////////////////////////////////////////////////
+
+#define RT_POLICY_OTHER		0
+#define RT_POLICY_FIFO		1
+
+#define RT_MAX_BUFFERS		64
+#define RT_MAX_WORKERS		16
+
+struct RtSchedConfig {
+    int fifo_priority;				// SCHED_FIFO priority (1-99) for captures, 0: leave the policy alone
+    int io_cpu;						// Core captures run on, -1: not pinned
+    int worker_cpu;					// Core the worker threads run on, -1: not pinned
+    int lock_buffers;				// Lock the registered buffers in memory
+};
+
+struct RtSchedStatus {
+    int policy;						// RT_POLICY_* the last capture ran under, -1 before the first
+    int priority;
+    int cpu;						// Core the last capture ran on, -1 if not pinned
+    int error;						// errno (GetLastError() on Windows) of the last failed call, 0 if none
+    int workers;					// Worker threads currently pinned
+    int64_t locked_bytes;
+};
+
+int  RtSchedConfigure(const RtSchedConfig& cfg);	// Returns the policy a trial elevation of the calling thread achieved
+RtSchedConfig RtSchedGetConfig();
+void RtSchedGetStatus(RtSchedStatus* status);
+
+void RtSchedRegisterBuffer(const void* p, size_t bytes);
+void RtSchedUnregisterBuffer(const void* p);
+
+class CRtCaptureScope {
+public:
+    CRtCaptureScope();
+    ~CRtCaptureScope();
+
+protected:
+    bool m_Raised;
+    bool m_Pinned;
+    int m_OldPolicy;
+    int m_OldPriority;
+#ifdef _WIN32
+    uintptr_t m_OldMask;
+#else
+    cpu_set_t m_OldMask;
+#endif
+};
+
+class CRtWorkerThread {
+public:
+    CRtWorkerThread();
+    ~CRtWorkerThread();
+
+protected:
+    int m_Slot;
+};
@@ -0,0 +1,586 @@
+// Copyright 2023, All rights reserved
+
+#include "RunRecorder.h"
+#include "RtSched.h"
+#include "Log.h"
+#include <cmath>
+#include <cstring>
+#include <chrono>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static uint32_t HeaderSizeOnDisk()
+{
+    return (uint32_t)((sizeof(RunFileHeader) + RUNFILE_ALIGN - 1) / RUNFILE_ALIGN * RUNFILE_ALIGN);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Recorder
+/////////////////////////////////////////////////////////////////////////////
+
+CRunRecorder::CRunRecorder()
+    : m_File(NULL), m_Codec(RUNFILE_CODEC_RAW), m_Offset(0), m_HeaderSize(0), m_Ring(NULL),
+      m_Head(0), m_Tail(0), m_Written(0), m_Dropped(0), m_ShortWrites(0), m_StageUsed(0), m_Stop(false)
+{
+}
+
+CRunRecorder::~CRunRecorder()
+{
+    Close();
+}
+
+int CRunRecorder::Open(const char* path, const char* serial, const CTrimReader& trim, int codec)
+{
+    if (m_File)
+        Close();
+
+    if (codec != RUNFILE_CODEC_RAW && codec != RUNFILE_CODEC_PACKED && codec != RUNFILE_CODEC_DELTA)
+        return 0;
+    m_Codec = codec;
+
+    m_File = fopen(path, "wb");
+    if (!m_File)
+        return 0;
+
+    // We do our own batching, keep stdio from splitting the writes
+    setvbuf(m_File, NULL, _IONBF, 0);
+
+    m_HeaderSize = HeaderSizeOnDisk();
+    std::vector<uint8_t> hbuf(m_HeaderSize, 0);
+    RunFileHeader* h = (RunFileHeader*)&hbuf[0];
+
+    memcpy(h->magic, RUNFILE_MAGIC, sizeof(h->magic));
+    h->version = RUNFILE_VERSION;
+    h->header_size = m_HeaderSize;
+    h->record_size = m_Codec == RUNFILE_CODEC_RAW ? sizeof(RunFrameRecord) : 0;
+    h->num_nodes = trim.NumNode < RUNFILE_MAX_NODES ? trim.NumNode : RUNFILE_MAX_NODES;
+    if (serial)
+        strncpy(h->serial, serial, sizeof(h->serial) - 1);
+    h->trim_id = trim.id;
+    h->trim_version = trim.version;
+    h->serial_number1 = trim.serial_number1;
+    h->serial_number2 = trim.serial_number2;
+    h->num_channels = trim.num_channels;
+    h->num_wells = trim.num_wells;
+    h->well_format = trim.well_format;
+    h->channel_format = trim.channel_format;
+    h->start_time_us = FrameTimestampNow();
+
+    for (uint32_t n = 0; n < h->num_nodes; n++) {
+        const CTrimNode& src = trim.Node[n];
+        RunTrimNode& dst = h->node[n];
+
+#ifdef _WIN32
+        CT2CA name(src.name);
+        strncpy(dst.name, (const char*)name, sizeof(dst.name) - 1);
+#else
+        strncpy(dst.name, src.name.c_str(), sizeof(dst.name) - 1);
+#endif
+        for (int i = 0; i < TRIM_IMAGER_SIZE; i++) {
+            for (int j = 0; j < 6; j++)
+                dst.kbi[i][j] = src.kbi[i][j];
+            dst.fpni[0][i] = src.fpni[0][i];
+            dst.fpni[1][i] = src.fpni[1][i];
+            dst.tempcal[i] = src.tempcal[i];
+        }
+        dst.rampgen = src.rampgen;
+        dst.range = src.range;
+        dst.auto_v20[0] = src.auto_v20[0];
+        dst.auto_v20[1] = src.auto_v20[1];
+        dst.auto_v15 = src.auto_v15;
+        dst.version = src.version;
+    }
+
+    if (fwrite(h, 1, m_HeaderSize, m_File) != m_HeaderSize) {
+        fclose(m_File);
+        m_File = NULL;
+        return 0;
+    }
+
+    m_Offset = m_HeaderSize;
+    m_Ring = new RunFrameRecord[RUNREC_RING_SLOTS];
+    RtSchedRegisterBuffer(m_Ring, sizeof(RunFrameRecord) * RUNREC_RING_SLOTS);
+    m_Head = 0;
+    m_Tail = 0;
+    m_Written = 0;
+    m_Dropped = 0;
+    m_ShortWrites = 0;
+    m_Index.clear();
+    m_Index.reserve(4096);
+    m_Stop = false;
+
+    if (m_Codec != RUNFILE_CODEC_RAW) {
+        m_Encoder.Reset();
+        m_Stage.resize(RUNREC_STAGE_BYTES);
+        m_StageUsed = 0;
+        memset(m_LastKey, 0, sizeof(m_LastKey));
+    }
+
+    m_Writer = std::thread(&CRunRecorder::WriterThread, this);
+
+    return 1;
+}
+
+int CRunRecorder::Close()
+{
+    if (!m_File)
+        return 1;
+
+    m_Stop = true;
+    m_Wake.notify_one();
+    if (m_Writer.joinable())
+        m_Writer.join();
+
+    // Writer thread has drained the ring, append index and footer
+
+    RunFileFooter footer;
+    memset(&footer, 0, sizeof(footer));
+    memcpy(footer.magic, RUNFILE_INDEX_MAGIC, sizeof(footer.magic));
+    footer.index_offset = m_Offset;
+    footer.frame_count = m_Index.size();
+
+    if (!m_Index.empty())
+        Write(&m_Index[0], m_Index.size() * sizeof(RunIndexEntry));
+    Write(&footer, sizeof(footer));
+
+    if (fclose(m_File) != 0) {
+        m_ShortWrites.fetch_add(1, std::memory_order_relaxed);
+        LOG_ERROR("Run file: error closing the file");
+    }
+    m_File = NULL;
+
+    RtSchedUnregisterBuffer(m_Ring);
+    delete[] m_Ring;
+    m_Ring = NULL;
+
+    uint32_t failed = ShortWrites();
+    if (failed) {
+        LOG_ERROR("Run file: %u failed writes, %u frames recorded, file is incomplete", failed, FramesWritten());
+        return 0;
+    }
+    return 1;
+}
+
+// Writer thread and Close() only. Records after a short write land at the
+// wrong offset, so the run is not recovered, only reported.
+
+bool CRunRecorder::Write(const void* data, size_t bytes)
+{
+    size_t done = fwrite(data, 1, bytes, m_File);
+    if (done == bytes)
+        return true;
+
+    if (m_ShortWrites.fetch_add(1, std::memory_order_relaxed) == 0)
+        LOG_ERROR("Run file: short write, %llu of %llu bytes, later failures are only counted",
+            (unsigned long long)done, (unsigned long long)bytes);
+    return false;
+}
+
+uint32_t CRunRecorder::FramesQueued() const
+{
+    return m_Head.load(std::memory_order_acquire) - m_Tail.load(std::memory_order_acquire);
+}
+
+// 0 to 127 degrees C in half degrees, which covers a thermal cycle
+
+static uint8_t RunTemperatureCode(float celsius)
+{
+    if (std::isnan(celsius))
+        return RUNFILE_TEMP_UNKNOWN;
+    int code = (int)std::lround(celsius * 2);
+    return (uint8_t)(code < 0 ? 0 : code > RUNFILE_TEMP_UNKNOWN - 1 ? RUNFILE_TEMP_UNKNOWN - 1 : code);
+}
+
+// Called from the capture path. Single producer.
+
+bool CRunRecorder::Append(const FrameMeta& meta, const int* frame, int stride)
+{
+    if (!m_File)
+        return false;
+
+    uint32_t head = m_Head.load(std::memory_order_relaxed);
+    uint32_t tail = m_Tail.load(std::memory_order_acquire);
+
+    if (head - tail >= RUNREC_RING_SLOTS) {
+        m_Dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    RunFrameRecord& r = m_Ring[head % RUNREC_RING_SLOTS];
+    int n = meta.frame_size;
+    if (n > 24) n = 24;
+
+    r.hdr.magic = RUNFILE_FRAME_MAGIC;
+    r.hdr.seq = meta.seq;
+    r.hdr.chan = meta.chan;
+    r.hdr.gain_mode = meta.gain_mode;
+    r.hdr.frame_size = (uint8_t)n;
+    r.hdr.flags = meta.flags;
+    r.hdr.int_time = meta.int_time;
+    r.hdr.timestamp_us = meta.timestamp_us;
+    r.hdr.payload_bytes = (uint32_t)(n * n * sizeof(int32_t));
+    r.hdr.codec = RUNFILE_CODEC_RAW;
+    r.hdr.temperature = RunTemperatureCode(meta.temperature);
+    r.hdr.key_back = 0;
+
+    for (int i = 0; i < n; i++)
+        memcpy(&r.pixels[i * n], &frame[i * stride], n * sizeof(int32_t));
+    memset(&r.pixels[n * n], 0, (RUNFILE_MAX_PIXELS - n * n) * sizeof(int32_t));
+
+    m_Head.store(head + 1, std::memory_order_release);
+
+    if (head + 1 - tail >= RUNREC_BATCH)
+        m_Wake.notify_one();
+
+    return true;
+}
+
+void CRunRecorder::WriteSlots(uint32_t first, uint32_t count)
+{
+    uint32_t slot = first % RUNREC_RING_SLOTS;
+
+    for (uint32_t i = 0; i < count; i++) {
+        RunIndexEntry e;
+        e.offset = m_Offset + (uint64_t)i * sizeof(RunFrameRecord);
+        e.seq = m_Ring[slot + i].hdr.seq;
+        e.size = sizeof(RunFrameRecord);
+        m_Index.push_back(e);
+    }
+
+    // Slots are contiguous in memory, so this is one large sequential write
+
+    Write(&m_Ring[slot], count * sizeof(RunFrameRecord));
+    m_Offset += (uint64_t)count * sizeof(RunFrameRecord);
+
+    m_Written.fetch_add(count, std::memory_order_relaxed);
+}
+
+// Encoded runs: records vary in size, so they are encoded back to back into
+// the stage buffer and written out a chunk at a time.
+
+void CRunRecorder::EncodeSlots(uint32_t first, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        const RunFrameRecord& r = m_Ring[(first + i) % RUNREC_RING_SLOTS];
+
+        if (m_StageUsed + sizeof(RunFrameHeader) + FRAME_CODEC_MAX_BYTES > m_Stage.size())
+            FlushStage();
+
+        RunFrameHeader* h = (RunFrameHeader*)&m_Stage[m_StageUsed];
+        uint8_t* payload = &m_Stage[m_StageUsed + sizeof(RunFrameHeader)];
+
+        int chan = r.hdr.chan < FRAME_CODEC_CHANNELS ? r.hdr.chan : 0;
+        int n = r.hdr.frame_size * r.hdr.frame_size;
+        uint32_t pos = (uint32_t)m_Index.size();
+
+        // key_back must fit, a channel left idle for a long time restarts with a key frame
+        bool delta = m_Codec == RUNFILE_CODEC_DELTA && pos - m_LastKey[chan] < 0xffff;
+        int bytes = m_Encoder.Encode(chan, r.pixels, n, delta, payload);
+
+        if (m_Encoder.SinceKey(chan) == 0)
+            m_LastKey[chan] = pos;
+
+        *h = r.hdr;
+        h->payload_bytes = (uint32_t)bytes;
+        h->codec = ((const FrameCodecHeader*)payload)->codec;
+        h->key_back = (uint16_t)(pos - m_LastKey[chan]);
+
+        RunIndexEntry e;
+        e.offset = m_Offset;
+        e.seq = r.hdr.seq;
+        e.size = (uint32_t)(sizeof(RunFrameHeader) + bytes);
+        m_Index.push_back(e);
+
+        m_StageUsed += e.size;
+        m_Offset += e.size;
+    }
+
+    m_Written.fetch_add(count, std::memory_order_relaxed);
+}
+
+void CRunRecorder::FlushStage()
+{
+    if (m_StageUsed)
+        Write(&m_Stage[0], m_StageUsed);
+    m_StageUsed = 0;
+}
+
+void CRunRecorder::WriterThread()
+{
+    CRtWorkerThread worker;
+    bool timed_out = false;
+
+    for (;;) {
+        bool stopping = m_Stop.load();
+
+        uint32_t tail = m_Tail.load(std::memory_order_relaxed);
+        uint32_t pending = m_Head.load(std::memory_order_acquire) - tail;
+
+        // Write full batches as they fill; partial batches only when a slow run
+        // (long integration times) has left them sitting in memory, or on close.
+
+        if (pending >= RUNREC_BATCH || (pending && (stopping || timed_out))) {
+            while (pending) {
+                // Do not wrap within one write
+                uint32_t contiguous = RUNREC_RING_SLOTS - tail % RUNREC_RING_SLOTS;
+                uint32_t n = pending < contiguous ? pending : contiguous;
+
+                if (m_Codec == RUNFILE_CODEC_RAW)
+                    WriteSlots(tail, n);
+                else
+                    EncodeSlots(tail, n);
+                tail += n;
+                pending -= n;
+                m_Tail.store(tail, std::memory_order_release);
+            }
+            FlushStage();
+            fflush(m_File);
+        }
+        else if (stopping) {
+            break;
+        }
+
+        if (!stopping) {
+            std::unique_lock<std::mutex> lock(m_WakeLock);
+            timed_out = m_Wake.wait_for(lock, std::chrono::milliseconds(500)) == std::cv_status::timeout;
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Reader
+/////////////////////////////////////////////////////////////////////////////
+
+CRunFileReader::CRunFileReader()
+    : m_Base(NULL), m_Size(0), m_Index(NULL), m_FrameCount(0)
+{
+    for (int c = 0; c < FRAME_CODEC_CHANNELS; c++)
+        m_Decoded[c] = -1;
+#ifdef _WIN32
+    m_FileHandle = INVALID_HANDLE_VALUE;
+    m_MapHandle = NULL;
+#endif
+}
+
+CRunFileReader::~CRunFileReader()
+{
+    Close();
+}
+
+int CRunFileReader::Open(const char* path)
+{
+    Close();
+
+#ifdef _WIN32
+    m_FileHandle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_FileHandle == INVALID_HANDLE_VALUE)
+        return 0;
+
+    LARGE_INTEGER sz;
+    GetFileSizeEx(m_FileHandle, &sz);
+    m_Size = (uint64_t)sz.QuadPart;
+
+    m_MapHandle = CreateFileMapping(m_FileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!m_MapHandle) {
+        Close();
+        return 0;
+    }
+    m_Base = (const uint8_t*)MapViewOfFile(m_MapHandle, FILE_MAP_READ, 0, 0, 0);
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
+    }
+    m_Size = (uint64_t)st.st_size;
+
+    void* p = m_Size ? mmap(NULL, m_Size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    m_Base = (p == MAP_FAILED) ? NULL : (const uint8_t*)p;
+#endif
+
+    if (!m_Base || m_Size < sizeof(RunFileHeader) ||
+        memcmp(Header()->magic, RUNFILE_MAGIC, sizeof(Header()->magic)) != 0 ||
+        Header()->version > RUNFILE_VERSION) {
+        Close();
+        return 0;
+    }
+
+    const RunFileHeader* h = Header();
+
+    // Prefer the trailing index; fall back to the fixed record size if the run
+    // was not closed cleanly.
+
+    if (m_Size >= h->header_size + sizeof(RunFileFooter)) {
+        const RunFileFooter* f = (const RunFileFooter*)(m_Base + m_Size - sizeof(RunFileFooter));
+        if (memcmp(f->magic, RUNFILE_INDEX_MAGIC, sizeof(f->magic)) == 0 &&
+            f->index_offset + f->frame_count * sizeof(RunIndexEntry) + sizeof(RunFileFooter) == m_Size) {
+            m_Index = (const RunIndexEntry*)(m_Base + f->index_offset);
+            m_FrameCount = (uint32_t)f->frame_count;
+            return 1;
+        }
+    }
+
+    if (h->record_size) {
+        m_FrameCount = (uint32_t)((m_Size - h->header_size) / h->record_size);
+        return 1;
+    }
+
+    // Encoded run without an index, walk the records once
+
+    uint64_t offset = h->header_size;
+    while (offset + sizeof(RunFrameHeader) <= m_Size) {
+        const RunFrameHeader* r = (const RunFrameHeader*)(m_Base + offset);
+        if (r->magic != RUNFILE_FRAME_MAGIC || offset + sizeof(RunFrameHeader) + r->payload_bytes > m_Size)
+            break;
+        m_Offsets.push_back(offset);
+        offset += sizeof(RunFrameHeader) + r->payload_bytes;
+    }
+    m_FrameCount = (uint32_t)m_Offsets.size();
+
+    return 1;
+}
+
+void CRunFileReader::Close()
+{
+#ifdef _WIN32
+    if (m_Base)
+        UnmapViewOfFile(m_Base);
+    if (m_MapHandle)
+        CloseHandle(m_MapHandle);
+    if (m_FileHandle != INVALID_HANDLE_VALUE)
+        CloseHandle(m_FileHandle);
+    m_MapHandle = NULL;
+    m_FileHandle = INVALID_HANDLE_VALUE;
+#else
+    if (m_Base)
+        munmap((void*)m_Base, m_Size);
+#endif
+    m_Base = NULL;
+    m_Size = 0;
+    m_Index = NULL;
+    m_Offsets.clear();
+    m_FrameCount = 0;
+
+    m_Decoder.Reset();
+    for (int c = 0; c < FRAME_CODEC_CHANNELS; c++)
+        m_Decoded[c] = -1;
+}
+
+uint64_t CRunFileReader::FrameOffset(uint32_t k) const
+{
+    if (m_Index)
+        return m_Index[k].offset;
+    if (!m_Offsets.empty())
+        return m_Offsets[k];
+    return Header()->header_size + (uint64_t)k * Header()->record_size;
+}
+
+const RunFrameHeader* CRunFileReader::Frame(uint32_t k) const
+{
+    if (!m_Base || k >= m_FrameCount)
+        return NULL;
+
+    uint64_t offset = FrameOffset(k);
+
+    if (offset + sizeof(RunFrameHeader) > m_Size)
+        return NULL;
+
+    const RunFrameHeader* r = (const RunFrameHeader*)(m_Base + offset);
+    if (r->magic != RUNFILE_FRAME_MAGIC || offset + sizeof(RunFrameHeader) + r->payload_bytes > m_Size)
+        return NULL;
+
+    return r;
+}
+
+// Brings the decoder for the channel of frame k up to k. It continues from the
+// frame it last produced when that lies between k's key frame and k, and
+// replays from the key frame otherwise (random access, going backwards).
+
+int CRunFileReader::DecodeDelta(uint32_t k, const RunFrameHeader* r, int* outbuf) const
+{
+    if (r->key_back > k)
+        return 0;
+
+    int n = r->frame_size * r->frame_size;
+    int chan = r->chan < FRAME_CODEC_CHANNELS ? r->chan : 0;
+    uint32_t j = k - r->key_back;
+
+    // The slot is shared by channels >= FRAME_CODEC_CHANNELS, so check whose frame it holds
+    int64_t last = m_Decoded[chan];
+    if (last >= (int64_t)j && last < (int64_t)k) {
+        const RunFrameHeader* f = Frame((uint32_t)last);
+        if (f && f->chan == r->chan)
+            j = (uint32_t)last + 1;
+    }
+
+    m_Decoded[chan] = -1;
+    for (; j <= k; j++) {
+        const RunFrameHeader* f = Frame(j);
+        if (!f)
+            return 0;
+        if (f->chan == r->chan &&
+            m_Decoder.Decode(chan, (const uint8_t*)f + sizeof(RunFrameHeader), (int)f->payload_bytes, outbuf, n) != n)
+            return 0;
+    }
+    m_Decoded[chan] = k;
+
+    return 1;
+}
+
+int CRunFileReader::ReadFrame(uint32_t k, int* outbuf, FrameMeta* meta) const
+{
+    const RunFrameHeader* r = Frame(k);
+    if (!r)
+        return 0;
+
+    // A corrupt or truncated record must not run past the caller's 24 x 24
+    // buffer or the mapping
+    int n = r->frame_size;
+    if (n != 12 && n != 24)
+        return 0;
+
+    const uint8_t* payload = (const uint8_t*)r + sizeof(RunFrameHeader);
+
+    if (outbuf) {
+        if (r->codec == RUNFILE_CODEC_RAW) {
+            if (r->payload_bytes < n * n * sizeof(int32_t))
+                return 0;
+            memcpy(outbuf, payload, n * n * sizeof(int32_t));
+        }
+        else if (r->codec == RUNFILE_CODEC_PACKED) {
+            if (FrameUnpack(payload, (int)r->payload_bytes, outbuf, n * n) != n * n)
+                return 0;
+        }
+        else if (r->codec == RUNFILE_CODEC_DELTA) {
+            if (!DecodeDelta(k, r, outbuf))
+                return 0;
+        }
+        else {
+            return 0;
+        }
+    }
+
+    if (meta) {
+        meta->seq = r->seq;
+        meta->chan = r->chan;
+        meta->gain_mode = r->gain_mode;
+        meta->frame_size = r->frame_size;
+        meta->flags = r->flags;
+        meta->int_time = r->int_time;
+        meta->timestamp_us = r->timestamp_us;
+        meta->temperature = Header()->version < 2 || r->temperature == RUNFILE_TEMP_UNKNOWN ? NAN : r->temperature * 0.5f;
+    }
+
+    return n;
+}
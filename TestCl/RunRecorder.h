@@ -0,0 +1,207 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+#include "TrimReader.h"
+#include "FrameMeta.h"
+#include "FrameCodec.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Run file layout (all fields little endian, as written by the host):
+//
+//   RunFileHeader				padded to RUNFILE_ALIGN, serial + trim snapshot
+//   RunFrameRecord[n]			one per captured frame, fixed size for RAW runs,
+//								RunFrameHeader + FrameCodec payload otherwise
+//   RunIndexEntry[n]			written on close
+//   RunFileFooter				written on close, locates the index
+//
+// In RAW runs records are fixed size, so frame k lives at header_size + k * record_size
+// even if the recorder never got to write the index (power loss, crash). Encoded
+// runs set record_size to 0 and a reader without an index walks the records.
+///////////////////////////////////////////////////////////////////////////////
+
+#define RUNFILE_MAGIC			"ULSRUN1"
+#define RUNFILE_INDEX_MAGIC		"ULSIDX1"
+#define RUNFILE_FRAME_MAGIC		0x314d5246		// "FRM1"
+#define RUNFILE_VERSION			2				// 2: RunFrameHeader::temperature
+#define RUNFILE_ALIGN			4096
+#define RUNFILE_MAX_NODES		16
+#define RUNFILE_MAX_PIXELS		(24 * 24)
+#define RUNFILE_TEMP_UNKNOWN	0xff
+
+#define RUNFILE_CODEC_RAW		0				// int32 pixels, frame_size x frame_size, row major
+#define RUNFILE_CODEC_PACKED	FRAME_CODEC_PACKED
+#define RUNFILE_CODEC_DELTA		FRAME_CODEC_DELTA
+
+#define RUNREC_RING_SLOTS		256				// Frames buffered between capture and the writer thread
+#define RUNREC_BATCH			32				// Frames gathered before a write is issued
+#define RUNREC_STAGE_BYTES		(1 << 20)		// Encoded runs are staged and written in chunks of this size
+
+struct RunTrimNode {
+    char     name[16];
+    int32_t  kbi[TRIM_IMAGER_SIZE][6];
+    int32_t  fpni[2][TRIM_IMAGER_SIZE];
+    double   tempcal[TRIM_IMAGER_SIZE];
+    uint8_t  rampgen;
+    uint8_t  range;
+    uint8_t  auto_v20[2];
+    uint8_t  auto_v15;
+    uint8_t  version;
+    uint8_t  reserved[2];
+};
+
+struct RunFileHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;			// Offset of the first frame record
+    uint32_t record_size;			// Size of one RunFrameRecord, 0 if records are encoded
+    uint32_t num_nodes;
+    char     serial[32];			// Device serial number string
+    uint8_t  trim_id;
+    uint8_t  trim_version;
+    uint8_t  serial_number1;
+    uint8_t  serial_number2;
+    uint8_t  num_channels;
+    uint8_t  num_wells;
+    uint8_t  well_format;
+    uint8_t  channel_format;
+    uint64_t start_time_us;
+    RunTrimNode node[RUNFILE_MAX_NODES];
+};
+
+struct RunFrameHeader {
+    uint32_t magic;					// RUNFILE_FRAME_MAGIC
+    uint32_t seq;
+    uint8_t  chan;
+    uint8_t  gain_mode;
+    uint8_t  frame_size;
+    uint8_t  flags;
+    float    int_time;
+    uint64_t timestamp_us;
+    uint32_t payload_bytes;			// Valid bytes following this header
+    uint8_t  codec;					// RUNFILE_CODEC_*
+    uint8_t  temperature;			// Half degrees C, RUNFILE_TEMP_UNKNOWN if none (version 1: 0)
+    uint16_t key_back;				// Delta frames: records back to the key frame of this channel
+};
+
+struct RunFrameRecord {
+    RunFrameHeader hdr;
+    int32_t  pixels[RUNFILE_MAX_PIXELS];
+};
+
+struct RunIndexEntry {
+    uint64_t offset;				// File offset of the RunFrameHeader
+    uint32_t seq;
+    uint32_t size;					// Header plus payload
+};
+
+struct RunFileFooter {
+    char     magic[8];
+    uint64_t index_offset;
+    uint64_t frame_count;
+};
+
+static_assert(sizeof(RunFrameHeader) == 32, "run file frame header layout changed");
+static_assert(sizeof(RunIndexEntry) == 16, "run file index layout changed");
+static_assert(sizeof(RunFileFooter) == 24, "run file footer layout changed");
+
+// Writes a run file from the capture path. Append() only copies the frame into a
+// preallocated ring slot and never touches the file; a writer thread drains the
+// ring in batches with large sequential writes. If the ring is full the frame is
+// dropped and counted rather than stalling acquisition. A failed write (disk
+// full, I/O error) is counted and logged; the run goes on and Close() fails.
+
+class CRunRecorder {
+public:
+    CRunRecorder();
+    ~CRunRecorder();
+
+    int  Open(const char* path, const char* serial, const CTrimReader& trim, int codec = RUNFILE_CODEC_RAW);	// 1: success; 0: error
+    int  Close();								// 1: success; 0: a write failed, the run file is incomplete
+    bool IsOpen() const { return m_File != NULL; }
+
+    bool Append(const FrameMeta& meta, const int* frame, int stride);
+
+    uint32_t FramesWritten() const { return m_Written.load(std::memory_order_relaxed); }
+    uint32_t FramesDropped() const { return m_Dropped.load(std::memory_order_relaxed); }
+    uint32_t FramesQueued() const;
+    uint32_t ShortWrites() const { return m_ShortWrites.load(std::memory_order_relaxed); }
+
+protected:
+    void WriterThread();
+    void WriteSlots(uint32_t first, uint32_t count);
+    void EncodeSlots(uint32_t first, uint32_t count);
+    void FlushStage();
+    bool Write(const void* data, size_t bytes);
+
+    FILE* m_File;
+    int m_Codec;
+    uint64_t m_Offset;						// Next record offset in the file
+    uint32_t m_HeaderSize;
+
+    RunFrameRecord* m_Ring;
+    std::atomic<uint32_t> m_Head;			// Next slot the capture path fills
+    std::atomic<uint32_t> m_Tail;			// Next slot the writer thread flushes
+
+    std::atomic<uint32_t> m_Written;
+    std::atomic<uint32_t> m_Dropped;
+    std::atomic<uint32_t> m_ShortWrites;
+
+    std::vector<RunIndexEntry> m_Index;
+
+    // Encoded runs only, owned by the writer thread
+    CFrameCodec m_Encoder;
+    std::vector<uint8_t> m_Stage;
+    size_t m_StageUsed;
+    uint32_t m_LastKey[FRAME_CODEC_CHANNELS];	// Index position of each channel's last key frame
+
+    std::thread m_Writer;
+    std::atomic<bool> m_Stop;
+    std::mutex m_WakeLock;
+    std::condition_variable m_Wake;
+};
+
+// Read side: maps the whole file and gives O(1) access to any frame. Delta
+// frames are decoded by one decoder kept per reader, which continues from the
+// last frame read on the channel, so reading a run in order does not replay
+// from the key frame every time. Not thread safe: one reader per thread.
+
+class CRunFileReader {
+public:
+    CRunFileReader();
+    ~CRunFileReader();
+
+    int  Open(const char* path);				// 1: success; 0: error
+    void Close();
+
+    const RunFileHeader* Header() const { return (const RunFileHeader*)m_Base; }
+    uint32_t FrameCount() const { return m_FrameCount; }
+    const RunFrameHeader* Frame(uint32_t k) const;
+    int  ReadFrame(uint32_t k, int* outbuf, FrameMeta* meta) const;	// Returns frame size, 0 on error
+
+protected:
+    uint64_t FrameOffset(uint32_t k) const;
+    int  DecodeDelta(uint32_t k, const RunFrameHeader* r, int* outbuf) const;
+
+    const uint8_t* m_Base;
+    uint64_t m_Size;
+    const RunIndexEntry* m_Index;
+    std::vector<uint64_t> m_Offsets;			// Encoded run without an index: offsets found by walking the records
+    uint32_t m_FrameCount;
+
+    mutable CFrameCodec m_Decoder;
+    mutable int64_t m_Decoded[FRAME_CODEC_CHANNELS];	// Frame the decoder last produced for each channel, -1 if none
+
+#ifdef _WIN32
+    HANDLE m_FileHandle;
+    HANDLE m_MapHandle;
+#endif
+};
@@ -0,0 +1,301 @@
+// Copyright 2023, All rights reserved
+
+///////////////////////////////////////////////////////////////////////////////
+// Self-check for the vectorised host side code:
+//
+//   FrameStatsRow		SSE2 / NEON results against a plain scalar reference,
+//						flag counts included, on random rows of every width
+//   FramePack			pack / unpack round trip, every bit width
+//   CFrameCodec		encode / decode round trip over long runs of packed and
+//						delta frames, with frame size changes and key frames
+//
+// Every input is generated from a fixed seed, so a failure repeats. Prints
+// the first mismatches and exits non-zero if there were any.
+//
+// Standalone program, not part of the DLL. Build with FrameStats.cpp and
+// FrameCodec.cpp only.
+//
+//   SelfCheck [--seed n] [--rounds n]
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "FrameStats.h"
+#include "FrameCodec.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SELFCHECK_PATH "SSE2"
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SELFCHECK_PATH "NEON"
+#else
+#define SELFCHECK_PATH "scalar"
+#endif
+
+#define SELFCHECK_MAX_REPORTS	10
+
+static uint32_t g_Seed;
+static int g_Failures;
+
+static uint32_t Rand()
+{
+    g_Seed = g_Seed * 1664525u + 1013904223u;
+    return g_Seed >> 8;
+}
+
+static void Fail(const char* what, int round, const char* detail)
+{
+    if (g_Failures++ < SELFCHECK_MAX_REPORTS)
+        fprintf(stderr, "SelfCheck: %s, round %d: %s\n", what, round, detail);
+}
+
+// First pixel that differs, -1 if none
+static int FirstDiff(const int32_t* a, const int32_t* b, int n)
+{
+    for (int i = 0; i < n; i++) {
+        if (a[i] != b[i])
+            return i;
+    }
+    return -1;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Frame statistics
+/////////////////////////////////////////////////////////////////////////////
+
+static void ReferenceRow(FrameStats* st, int row, const int32_t* pixels, const uint8_t* flags, int n)
+{
+    int32_t lo = pixels[0], hi = pixels[0], sum = 0;
+    uint64_t sq = 0;
+    int nonzero = 0, sat = 0, under = 0;
+
+    for (int i = 0; i < n; i++) {
+        int32_t v = pixels[i];
+        if (v < lo) lo = v;
+        if (v > hi) hi = v;
+        sum += v;
+        sq += (uint64_t)((int64_t)v * v);
+        if (v) nonzero++;
+        if (PIXEL_FLAG_IS_OVERFLOW(flags[i])) sat++;
+        else if (PIXEL_FLAG_IS_UNDERFLOW(flags[i])) under++;
+    }
+
+    if (lo < st->min) st->min = lo;
+    if (hi > st->max) st->max = hi;
+    st->sum += sum;
+    st->sum_sq += sq;
+    st->nonzero += (uint16_t)nonzero;
+    st->saturated += (uint16_t)sat;
+    st->underflow += (uint16_t)under;
+    st->row_sum[row] = sum;
+    if (!nonzero)
+        st->empty_row_mask |= 1u << row;
+}
+
+// Corrected pixels are mostly 12 bit, but the statistics must hold for
+// anything a correction can produce: zeros, negatives, wide values
+static int32_t RandomPixel(int kind)
+{
+    switch (kind) {
+    case 0:		return (int32_t)(Rand() % 4096);
+    case 1:		return Rand() % 3 ? 0 : (int32_t)(Rand() % 4096);
+    case 2:		return (int32_t)(Rand() % 8192) - 4096;
+    default:	return (int32_t)(Rand() % (1u << 24)) - (1 << 23);
+    }
+}
+
+static void CheckFrameStats(int round)
+{
+    static const int widths[] = { 4, 8, 12, 16, 20, 24 };
+    int n = widths[Rand() % 6];
+    int rows = 1 + Rand() % n;
+    int kind = Rand() % 4;
+
+    int32_t pixels[24][24];
+    uint8_t flags[24][24];
+    FrameStats st, ref;
+    FrameStatsBegin(&st);
+    FrameStatsBegin(&ref);
+
+    uint32_t row_mask = 0;
+    for (int r = 0; r < rows; r++) {
+        bool empty = Rand() % 8 == 0;
+        for (int c = 0; c < n; c++) {
+            pixels[r][c] = empty ? 0 : RandomPixel(kind);
+            flags[r][c] = Rand() % 2 ? 0 : (uint8_t)Rand();		// Every byte value, not just 1-8
+        }
+
+        // Some rows are never received
+        if (Rand() % 16 == 0)
+            continue;
+        row_mask |= 1u << r;
+        FrameStatsRow(&st, r, pixels[r], flags[r], n);
+        ReferenceRow(&ref, r, pixels[r], flags[r], n);
+    }
+
+    FrameStatsEnd(&st, rows, row_mask);
+    FrameStatsEnd(&ref, rows, row_mask);
+
+    char detail[160];
+#define STATS_FIELD(f) \
+    if (st.f != ref.f) { \
+        snprintf(detail, sizeof(detail), "width %d, " #f " %lld expected %lld", n, (long long)st.f, (long long)ref.f); \
+        Fail("FrameStats", round, detail); \
+    }
+    STATS_FIELD(min)
+    STATS_FIELD(max)
+    STATS_FIELD(sum)
+    STATS_FIELD(sum_sq)
+    STATS_FIELD(nonzero)
+    STATS_FIELD(saturated)
+    STATS_FIELD(underflow)
+    STATS_FIELD(empty_rows)
+    STATS_FIELD(empty_row_mask)
+#undef STATS_FIELD
+
+    if (memcmp(st.row_sum, ref.row_sum, sizeof(st.row_sum))) {
+        snprintf(detail, sizeof(detail), "width %d, row sums differ", n);
+        Fail("FrameStats", round, detail);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Codecs
+/////////////////////////////////////////////////////////////////////////////
+
+static void CheckPack(int round)
+{
+    static int32_t pixels[FRAME_CODEC_MAX_PIXELS];
+    static int32_t back[FRAME_CODEC_MAX_PIXELS];
+    static uint8_t buf[FRAME_CODEC_MAX_BYTES];
+
+    // Every width from a constant frame to full 32 bit, any base
+    int count = 1 + Rand() % FRAME_CODEC_MAX_PIXELS;
+    int bits = round % 33;
+    int32_t base = (int32_t)(Rand() << 8 ^ Rand());
+    uint32_t range = bits == 32 ? 0xffffffffu : (1u << bits) - 1;
+    for (int i = 0; i < count; i++) {
+        uint32_t v = bits ? (Rand() << 16 ^ Rand()) & range : 0;
+        pixels[i] = (int32_t)((uint32_t)base + v);
+    }
+
+    char detail[160];
+    int len = FramePack(pixels, count, buf);
+    if (!len || len > (int)FRAME_CODEC_MAX_BYTES) {
+        snprintf(detail, sizeof(detail), "%d pixels of %d bits packed into %d bytes", count, bits, len);
+        Fail("FramePack", round, detail);
+        return;
+    }
+
+    memset(back, 0, sizeof(back));
+    int n = FrameUnpack(buf, len, back, FRAME_CODEC_MAX_PIXELS);
+    int d = FirstDiff(pixels, back, count);
+    if (n != count) {
+        snprintf(detail, sizeof(detail), "%d pixels of %d bits unpacked as %d", count, bits, n);
+        Fail("FramePack", round, detail);
+    }
+    else if (d >= 0) {
+        snprintf(detail, sizeof(detail), "%d bits, pixel %d unpacked as %d, expected %d", bits, d, back[d], pixels[d]);
+        Fail("FramePack", round, detail);
+    }
+}
+
+static void CheckDeltaRun(int round)
+{
+    static int32_t frames[FRAME_CODEC_CHANNELS][FRAME_CODEC_MAX_PIXELS];
+    static int32_t back[FRAME_CODEC_MAX_PIXELS];
+    static uint8_t buf[FRAME_CODEC_MAX_BYTES];
+    static CFrameCodec enc, dec;
+
+    int counts[FRAME_CODEC_CHANNELS] = { 0 };
+    enc.Reset();
+    dec.Reset();
+
+    char detail[160];
+
+    // Longer than a key interval, channels interleaved as in a kinetic run
+    for (int f = 0; f < FRAME_CODEC_KEY_INTERVAL * 3; f++) {
+        int chan = 1 + Rand() % 4;
+        int32_t* p = frames[chan];
+
+        // New frame size now and then, otherwise drift with the odd jump
+        if (!counts[chan] || Rand() % 32 == 0) {
+            counts[chan] = Rand() % 2 ? 12 * 12 : 24 * 24;
+            for (int i = 0; i < counts[chan]; i++)
+                p[i] = (int32_t)(Rand() % 4096);
+        }
+        else {
+            for (int i = 0; i < counts[chan]; i++) {
+                if (Rand() % 64 == 0)
+                    p[i] = (int32_t)(Rand() << 6) - (1 << 29);		// Needs a 5 byte varint
+                else
+                    p[i] += (int32_t)(Rand() % 9) - 4;
+            }
+        }
+
+        bool delta = Rand() % 8 != 0;
+        int len = enc.Encode(chan, p, counts[chan], delta, buf);
+        if (!len || len > (int)FRAME_CODEC_MAX_BYTES) {
+            snprintf(detail, sizeof(detail), "frame %d, channel %d encoded into %d bytes", f, chan, len);
+            Fail("CFrameCodec", round, detail);
+            return;
+        }
+
+        memset(back, 0, sizeof(back));
+        int n = dec.Decode(chan, buf, len, back, FRAME_CODEC_MAX_PIXELS);
+        int d = FirstDiff(p, back, counts[chan]);
+        const char* kind = buf[0] == FRAME_CODEC_DELTA ? "delta" : "packed";
+        if (n != counts[chan] || d >= 0) {
+            if (n != counts[chan])
+                snprintf(detail, sizeof(detail), "frame %d, channel %d (%s): %d of %d pixels decoded",
+                    f, chan, kind, n, counts[chan]);
+            else
+                snprintf(detail, sizeof(detail), "frame %d, channel %d (%s): pixel %d decoded as %d, expected %d",
+                    f, chan, kind, d, back[d], p[d]);
+            Fail("CFrameCodec", round, detail);
+            return;
+        }
+
+        if (enc.SinceKey(chan) != dec.SinceKey(chan)) {
+            snprintf(detail, sizeof(detail), "frame %d, channel %d: %d frames since key encoding, %d decoding",
+                f, chan, enc.SinceKey(chan), dec.SinceKey(chan));
+            Fail("CFrameCodec", round, detail);
+            return;
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t seed = 1;
+    int rounds = 2000;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+            seed = (uint32_t)strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "--rounds") && i + 1 < argc)
+            rounds = atoi(argv[++i]);
+        else {
+            fprintf(stderr, "usage: %s [--seed n] [--rounds n]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    g_Seed = seed;
+    for (int r = 0; r < rounds; r++)
+        CheckFrameStats(r);
+    for (int r = 0; r < rounds; r++)
+        CheckPack(r);
+    for (int r = 0; r < rounds / 20 + 1; r++)
+        CheckDeltaRun(r);
+
+    if (g_Failures) {
+        printf("SelfCheck (%s, seed %u): %d mismatches\n", SELFCHECK_PATH, seed, g_Failures);
+        return 1;
+    }
+
+    printf("SelfCheck (%s, seed %u): frame statistics, packed and delta codecs match over %d rounds\n",
+        SELFCHECK_PATH, seed, rounds);
+    return 0;
+}
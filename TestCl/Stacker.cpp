@@ -0,0 +1,123 @@
+// Copyright 2023, All rights reserved
+
+#include "Stacker.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#define STACK_MAD_SIGMA		1.4826	// MAD to standard deviation, normal noise
+#define STACK_MIN_SIGMA		1.0		// Counts; quiet pixels have a MAD of 0
+
+CFrameStacker::CFrameStacker()
+{
+    // Allocated once: Add() runs after every frame of a stack
+    m_Window = new int[STACK_WINDOW][FRAME_MAX_SIZE][FRAME_MAX_SIZE];
+    Begin(12, 0);
+}
+
+CFrameStacker::~CFrameStacker()
+{
+    delete[] m_Window;
+}
+
+void CFrameStacker::Begin(int size, float clip_sigma)
+{
+    m_Size = size;
+    m_ClipSigma = clip_sigma;
+    m_WindowFrames = 0;
+    m_WindowNext = 0;
+    memset(m_Sum, 0, sizeof(m_Sum));
+    memset(m_SumSq, 0, sizeof(m_SumSq));
+    memset(m_Count, 0, sizeof(m_Count));
+    memset(&m_Stats, 0, sizeof(m_Stats));
+}
+
+void CFrameStacker::Add(const int (*frame)[FRAME_MAX_SIZE])
+{
+    for (int r = 0; r < m_Size; r++) {
+        for (int c = 0; c < m_Size; c++) {
+            int64_t v = frame[r][c];
+            m_Sum[r][c] += v;
+            m_SumSq[r][c] += v * v;
+            m_Count[r][c]++;
+        }
+    }
+
+    if (m_ClipSigma > 0) {
+        memcpy(m_Window[m_WindowNext], frame, sizeof(m_Window[0]));
+        m_WindowNext = (m_WindowNext + 1) % STACK_WINDOW;
+        if (m_WindowFrames < STACK_WINDOW)
+            m_WindowFrames++;
+    }
+
+    m_Stats.frames++;
+}
+
+// Bounds from the median and median absolute deviation of the window: with
+// the plain mean and deviation, one outlier among 8 frames can never be more
+// than 2.5 of its own inflated sigmas out
+
+void CFrameStacker::Clip()
+{
+    double v[STACK_WINDOW], dev[STACK_WINDOW];
+    int n = m_WindowFrames;
+
+    for (int r = 0; r < m_Size; r++) {
+        for (int c = 0; c < m_Size; c++) {
+            for (int k = 0; k < n; k++)
+                v[k] = m_Window[k][r][c];
+
+            std::nth_element(v, v + n / 2, v + n);
+            double median = v[n / 2];
+            for (int k = 0; k < n; k++)
+                dev[k] = std::fabs(v[k] - median);
+            std::nth_element(dev, dev + n / 2, dev + n);
+
+            double sigma = STACK_MAD_SIGMA * dev[n / 2];
+            if (sigma < STACK_MIN_SIGMA)
+                sigma = STACK_MIN_SIGMA;
+            double limit = m_ClipSigma * sigma;
+            uint32_t dropped = 0;
+
+            for (int k = 0; k < n && m_Count[r][c] > 2; k++) {	// Keep two values at least
+                int64_t x = m_Window[k][r][c];
+                if (std::fabs(x - median) <= limit)
+                    continue;
+
+                m_Sum[r][c] -= x;
+                m_SumSq[r][c] -= x * x;
+                m_Count[r][c]--;
+                dropped++;
+            }
+
+            if (dropped) {
+                m_Stats.rejected += dropped;
+                m_Stats.clipped_pixels++;
+            }
+        }
+    }
+}
+
+int CFrameStacker::Finish(float* mean, float* noise)
+{
+    if (!m_Stats.frames)
+        return 0;
+
+    if (m_ClipSigma > 0 && m_Stats.frames >= STACK_MIN_CLIP)
+        Clip();
+
+    for (int r = 0; r < m_Size; r++) {
+        for (int c = 0; c < m_Size; c++) {
+            uint32_t n = m_Count[r][c];
+            double m = (double)m_Sum[r][c] / n;
+            double var = n > 1 ? ((double)m_SumSq[r][c] - m * m_Sum[r][c]) / (n - 1) : 0.0;
+
+            if (mean)
+                mean[r * m_Size + c] = (float)m;
+            if (noise)
+                noise[r * m_Size + c] = var > 0 ? (float)std::sqrt(var) : 0.0f;
+        }
+    }
+
+    return (int)m_Stats.frames;
+}
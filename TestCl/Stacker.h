@@ -0,0 +1,59 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include "FrameMeta.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Frame stacking.
+//
+// Running per-pixel sums and sums of squares over a series of frames, kept in
+// buffers allocated once, so a stack of any length costs one pass over each
+// frame as it completes. The last STACK_WINDOW frames are also kept; with
+// sigma clipping on, a second pass over that window drops, pixel by pixel,
+// values more than clip_sigma robust standard deviations (from the median
+// absolute deviation) from the median, and takes them out of the sums.
+// Earlier frames of a longer stack are never rejected.
+///////////////////////////////////////////////////////////////////////////////
+
+#define STACK_WINDOW		32
+#define STACK_MIN_CLIP		3			// Frames needed before clipping means anything
+
+struct StackStats {
+    uint32_t frames;				// Frames stacked
+    uint32_t rejected;				// Pixel values dropped by sigma clipping
+    uint32_t clipped_pixels;		// Pixels that lost at least one value
+};
+
+class CFrameStacker {
+public:
+    CFrameStacker();
+    ~CFrameStacker();
+
+    void Begin(int size, float clip_sigma);		// clip_sigma <= 0: no clipping
+    void Add(const int (*frame)[FRAME_MAX_SIZE]);
+
+    // Clips if asked, then writes the mean and the standard deviation of a
+    // single frame for every pixel, row major, size x size. Either may be NULL.
+    // Returns the number of frames stacked.
+    int Finish(float* mean, float* noise);
+
+    const StackStats& Stats() const { return m_Stats; }
+    int Size() const { return m_Size; }
+
+protected:
+    void Clip();
+
+    int m_Size;
+    float m_ClipSigma;
+    int64_t m_Sum[FRAME_MAX_SIZE][FRAME_MAX_SIZE];
+    int64_t m_SumSq[FRAME_MAX_SIZE][FRAME_MAX_SIZE];
+    uint32_t m_Count[FRAME_MAX_SIZE][FRAME_MAX_SIZE];	// Values kept per pixel
+
+    int (*m_Window)[FRAME_MAX_SIZE][FRAME_MAX_SIZE];	// Ring of the last STACK_WINDOW frames
+    int m_WindowFrames;
+    int m_WindowNext;
+
+    StackStats m_Stats;
+};
@@ -0,0 +1,125 @@
+// Copyright 2023, All rights reserved
+
+#include "TempComp.h"
+#include "Log.h"
+#include <cmath>
+#include <cstring>
+
+CTempComp::CTempComp()
+    : m_Enabled(true)
+{
+    for (int i = 0; i < 4; i++)
+        m_Celsius[i] = NAN;
+    ClearDrift(0);
+}
+
+int CTempComp::Slot(int chan, int gain)
+{
+    if (chan < 1 || chan > 4)
+        return -1;
+    return (chan - 1) * 2 + (gain ? 1 : 0);
+}
+
+void CTempComp::SetTemperature(int chan, double celsius)
+{
+    for (int i = 0; i < 4; i++) {
+        if (chan == 0 || chan == i + 1)
+            m_Celsius[i] = celsius;
+    }
+}
+
+double CTempComp::Temperature(int chan) const
+{
+    return chan >= 1 && chan <= 4 ? m_Celsius[chan - 1] : NAN;
+}
+
+void CTempComp::ClearDrift(int chan)
+{
+    for (int s = 0; s < 4 * 2; s++) {
+        if (chan && s / 2 != chan - 1)
+            continue;
+        memset(&m_Fit[s], 0, sizeof(m_Fit[s]));
+    }
+}
+
+void CTempComp::AddDarkSample(int chan, int gain, float int_time, double celsius, double level)
+{
+    int s = Slot(chan, gain);
+    if (s < 0 || std::isnan(celsius))
+        return;
+
+    Fit& f = m_Fit[s];
+
+    // Dark level also grows with integration time: only one time per fit. A
+    // rate already fitted stays in use until the new samples give one.
+    if (f.n && f.int_time != int_time)
+        f.n = 0;
+    if (!f.n) {
+        f.int_time = int_time;
+        f.sum_t = f.sum_v = f.sum_tt = f.sum_tv = 0;
+        f.t_min = f.t_max = celsius;
+    }
+
+    f.n++;
+    f.sum_t += celsius;
+    f.sum_v += level;
+    f.sum_tt += celsius * celsius;
+    f.sum_tv += celsius * level;
+    if (celsius < f.t_min) f.t_min = celsius;
+    if (celsius > f.t_max) f.t_max = celsius;
+
+    if (f.t_max - f.t_min < TEMP_MIN_SPAN)
+        return;
+
+    double mean_t = f.sum_t / f.n;
+    double var = f.sum_tt / f.n - mean_t * mean_t;
+    double rate = (f.sum_tv / f.n - mean_t * f.sum_v / f.n) / var;
+    if (!(std::fabs(rate) <= TEMP_MAX_DRIFT)) {
+        LOG_WARN("Temperature: channel %d gain %d dark drift %.2f counts/C ignored", chan, gain, rate);
+        return;
+    }
+
+    f.valid = true;
+    f.rate = rate;
+    f.ref = mean_t;
+    LOG_INFO("Temperature: channel %d gain %d dark drift %.3f counts/C from %d frames", chan, gain, rate, f.n);
+}
+
+bool CTempComp::Drift(int chan, int gain, double* rate, double* ref) const
+{
+    int s = Slot(chan, gain);
+    if (s < 0 || !m_Fit[s].valid)
+        return false;
+
+    *rate = m_Fit[s].rate;
+    *ref = m_Fit[s].ref;
+    return true;
+}
+
+void CTempComp::SetDrift(int chan, int gain, double rate, double ref)
+{
+    int s = Slot(chan, gain);
+    if (s < 0)
+        return;
+
+    m_Fit[s].n = 0;
+    m_Fit[s].valid = true;
+    m_Fit[s].rate = rate;
+    m_Fit[s].ref = ref;
+}
+
+int CTempComp::Offset(int chan, int gain, double celsius, bool dark, double dark_celsius) const
+{
+    double rate, ref;
+    if (!m_Enabled || std::isnan(celsius) || !Drift(chan, gain, &rate, &ref))
+        return 0;
+
+    // A dark frame taken at an unknown temperature leaves nothing to refer to
+    if (dark) {
+        if (std::isnan(dark_celsius))
+            return 0;
+        ref = dark_celsius;
+    }
+
+    return (int)std::lround(rate * (celsius - ref));
+}
@@ -0,0 +1,70 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Temperature compensation.
+//
+// Each sensor's temperature comes either from its junction reading, through
+// the tempcal line calibrated into its trim,
+//
+//   celsius = tempcal[0] * junction + tempcal[1]
+//
+// or directly from the application (block or probe temperature). It applies
+// to every frame of the channel from then on and is recorded in FrameMeta.
+//
+// The dark level of a channel drifts linearly with temperature, at a rate per
+// channel and gain fitted from the mean of dark frames captured at different
+// temperatures (at least TEMP_MIN_SPAN apart, at one integration time) or set
+// by the application. Frames are brought back to the level they would have
+// at the reference temperature: that of the dark frame subtracted, or with
+// none, the mean temperature of the fit.
+///////////////////////////////////////////////////////////////////////////////
+
+#define TEMP_MIN_SPAN		2.0		// Degrees C between dark samples before a rate is fitted
+#define TEMP_MAX_DRIFT		50.0	// Counts per degree C, anything steeper is not believed
+
+class CTempComp {
+public:
+    CTempComp();
+
+    static double JunctionToCelsius(const double* tempcal, double junction) { return tempcal[0] * junction + tempcal[1]; }
+
+    void SetTemperature(int chan, double celsius);		// chan 0: every channel; NAN: unknown
+    double Temperature(int chan) const;					// NAN if unknown
+
+    // Mean level of a dark frame of the channel taken at 'celsius'
+    void AddDarkSample(int chan, int gain, float int_time, double celsius, double level);
+
+    // Counts per degree C and the temperature they are referred to; false if
+    // the channel has no rate for the gain
+    bool Drift(int chan, int gain, double* rate, double* ref) const;
+    void SetDrift(int chan, int gain, double rate, double ref);
+    void ClearDrift(int chan);							// chan 0: every channel
+
+    // Counts to subtract from a frame of the channel at 'celsius'. 'dark': a
+    // dark frame taken at dark_celsius (NAN if unknown) is subtracted from it
+    int Offset(int chan, int gain, double celsius, bool dark, double dark_celsius) const;
+
+    void SetEnabled(bool enable) { m_Enabled = enable; }
+    bool IsEnabled() const { return m_Enabled; }
+
+protected:
+    static int Slot(int chan, int gain);
+
+    struct Fit {
+        float int_time;				// Of the samples being summed
+        int n;
+        double sum_t, sum_v, sum_tt, sum_tv;
+        double t_min, t_max;
+        bool valid;					// rate and ref hold a fitted or set drift
+        double rate;
+        double ref;
+    };
+
+    bool m_Enabled;
+    double m_Celsius[4];
+    Fit m_Fit[4 * 2];
+};
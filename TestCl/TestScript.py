@@ -45,10 +45,20 @@ ULS24.get.argtypes = [ctypes.c_int]
 ULS24.setinttime.argtypes = [ctypes.c_float]
 ULS24.setgain.argtypes = [ctypes.c_int]
 ULS24.get_frame12.argtypes = [ctypes.POINTER(ctypes.c_int)]
-ULS24.check_data_flow_wrapper.argtypes = []
-ULS24.check_data_flow_wrapper.restype = ctypes.c_int
+ULS24.stale_report_stats.argtypes = [ctypes.POINTER(ctypes.c_int), ctypes.c_int]
+ULS24.stale_report_stats.restype = ctypes.c_int
 ULS24.cancel_capture.argtypes = []
 
+class FrameStats(ctypes.Structure):
+    _fields_ = [("min", ctypes.c_int32), ("max", ctypes.c_int32),
+                ("sum", ctypes.c_int64), ("sum_sq", ctypes.c_uint64),
+                ("nonzero", ctypes.c_uint16), ("saturated", ctypes.c_uint16),
+                ("underflow", ctypes.c_uint16), ("empty_rows", ctypes.c_uint16),
+                ("empty_row_mask", ctypes.c_uint32), ("row_sum", ctypes.c_int32 * 24)]
+
+ULS24.get_latest_stats.argtypes = [ctypes.POINTER(FrameStats), ctypes.c_void_p]
+ULS24.get_latest_stats.restype = ctypes.c_int
+
 # Ensure we always clean up
 def cleanup():
     try:
@@ -68,29 +78,15 @@ if platform.system() == 'Linux':
         print(f"Note: Could not apply all optimizations: {e}")
 
 try:
-    # Reset and initialize
+    # Reset and initialize. Each call waits for the device's answer and
+    # discards stale input reports first, so no sleeps are needed between them
     print("Resetting device...")
     ULS24.reset()
-    time.sleep(0.5)  # Give device time to initialize
     
     print("Setting up sensor...")
     ULS24.selchan(1)  # Select channel 1
-    time.sleep(0.1)
-    
     ULS24.setinttime(4.0)  # Set integration time to 4ms
-    time.sleep(0.1)
-    
     ULS24.setgain(1)  # Set gain mode (1 = high gain)
-    time.sleep(0.1)
-    
-    # Clear any pending data
-    count = count = ULS24.check_data_flow_wrapper()
-    if count > 0:
-        print(f"Cleared {count} pending reports")
-        
-    # Allow more time for device to stabilize
-    print("Waiting for device to stabilize...")
-    time.sleep(1.0)
     
     # Capture frame with retry capability
     print("\nCapturing frame (this may take a moment)...")
@@ -102,6 +98,10 @@ try:
     end_time = time.time()
     print(f"Frame capture completed in {end_time - start_time:.2f} seconds")
     
+    stale = (ctypes.c_int * 6)()
+    if ULS24.stale_report_stats(stale, 6) and stale[1] > 0:
+        print(f"Discarded {stale[1]} stale reports ({stale[2]} rows)")
+    
     # Get frame data
     print("Retrieving frame data...")
     FrameArrayType = ctypes.c_int * (12 * 12)
@@ -111,25 +111,29 @@ try:
     # Convert to numpy array for analysis
     frame_np = np.ctypeslib.as_array(frame_buffer).reshape((12, 12))
     
-    # Analyze the frame
-    non_zero = np.count_nonzero(frame_np)
-    total_elements = frame_np.size
-    print(f"\nFrame statistics:")
-    print(f"- Non-zero values: {non_zero}/{total_elements} ({non_zero/total_elements*100:.1f}%)")
-    print(f"- Min value: {np.min(frame_np)}")
-    print(f"- Max value: {np.max(frame_np)}")
-    print(f"- Mean value: {np.mean(frame_np):.2f}")
+    # Statistics are computed by the library while the frame is assembled
+    stats = FrameStats()
+    size = ULS24.get_latest_stats(ctypes.byref(stats), None)
+    if size == 0:
+        print("\nNo frame statistics: no frame has been captured")
+    else:
+        total_elements = size * size
+        print(f"\nFrame statistics:")
+        print(f"- Non-zero values: {stats.nonzero}/{total_elements} ({stats.nonzero/total_elements*100:.1f}%)")
+        print(f"- Min value: {stats.min}")
+        print(f"- Max value: {stats.max}")
+        print(f"- Mean value: {stats.sum/total_elements:.2f}")
+        print(f"- Saturated pixels: {stats.saturated}, underflow: {stats.underflow}")
     
     print("\nFrame data:")
     print(frame_np)
     
     # Check for missing rows (all zeros)
-    zero_rows = []
-    for i in range(12):
-        if np.count_nonzero(frame_np[i]) == 0:
-            zero_rows.append(i)
+    zero_rows = [i for i in range(size) if stats.empty_row_mask & (1 << i)]
             
-    if zero_rows:
+    if size == 0:
+        print("\nWarning: No frame data to check")
+    elif zero_rows:
         print(f"\nWarning: Found {len(zero_rows)} empty rows: {zero_rows}")
     else:
         print("\nSuccess: All rows contain data!")
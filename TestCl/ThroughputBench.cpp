@@ -0,0 +1,289 @@
+// Copyright 2023, All rights reserved
+
+///////////////////////////////////////////////////////////////////////////////
+// End-to-end capture benchmark against the emulated ULS24 (DeviceSim.cpp).
+//
+// Drives the C exports (selchan, setinttime, setgain, get, get_frame12) and
+// through them CInterfaceObject, ProcessRowData and the trim correction, with
+// the device's per-report latency, jitter, row loss and sensor time outs set
+// on the command line. Three modes:
+//
+//   oneshot	configure, capture and read out one frame at a time
+//   batched	one frame from each of the 4 channels per batch, back to back
+//   streaming	a capture thread feeds a consumer thread through a ring;
+//				latency runs from capture start to the consumer holding the frame
+//
+// Reports p50/p99/p99.9 frame latency and sustained frames per second.
+//
+// Links the library sources with DeviceSim.cpp in place of HidMgr.cpp:
+//
+//   ThroughputBench [--frames n] [--latency-us n] [--jitter-us n] [--loss p]
+//                   [--sensor-timeout p] [--timeout-us n] [--mode oneshot|batched|streaming|all] [--json]
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+#include "InterfaceObj.h"
+#include "DeviceSim.h"
+#include "Log.h"
+
+// The application owns the interface object, as TestCl does
+CInterfaceObject theInterfaceObject;
+
+extern "C" {
+    void selchan(int chan);
+    int get(int chan);
+    void get_frame12(int* outbuf);
+    void setinttime(float itime);
+    void setgain(int gain);
+}
+
+struct ModeResult {
+    const char* mode;
+    int frames;
+    double seconds;
+    double fps;
+    double p50_ms;
+    double p99_ms;
+    double p999_ms;
+    double max_ms;
+};
+
+static std::vector<ModeResult> g_Results;
+static volatile int g_Sink;
+
+static double NowMs()
+{
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count() / 1e6;
+}
+
+static double Percentile(std::vector<double>& v, double q)
+{
+    if (v.empty())
+        return 0;
+    size_t k = (size_t)(q * (double)(v.size() - 1) + 0.5);
+    return v[std::min(k, v.size() - 1)];
+}
+
+static void AddResult(const char* mode, std::vector<double>& lat, double seconds)
+{
+    std::sort(lat.begin(), lat.end());
+
+    ModeResult r;
+    r.mode = mode;
+    r.frames = (int)lat.size();
+    r.seconds = seconds;
+    r.fps = seconds > 0 ? lat.size() / seconds : 0;
+    r.p50_ms = Percentile(lat, 0.50);
+    r.p99_ms = Percentile(lat, 0.99);
+    r.p999_ms = Percentile(lat, 0.999);
+    r.max_ms = lat.empty() ? 0 : lat.back();
+    g_Results.push_back(r);
+}
+
+static int Consume(const int* frame)
+{
+    int sum = 0;
+    for (int i = 0; i < 144; i++)
+        sum += frame[i];
+    return sum;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Modes
+/////////////////////////////////////////////////////////////////////////////
+
+static void RunOneShot(int frames)
+{
+    std::vector<double> lat;
+    lat.reserve(frames);
+    int frame[144];
+
+    double start = NowMs();
+    for (int i = 0; i < frames; i++) {
+        int chan = i % 4 + 1;
+        double t0 = NowMs();
+        selchan(chan);
+        setinttime(10);
+        get(chan);
+        get_frame12(frame);
+        g_Sink = Consume(frame);
+        lat.push_back(NowMs() - t0);
+    }
+    AddResult("oneshot", lat, (NowMs() - start) / 1000);
+}
+
+static void RunBatched(int frames)
+{
+    std::vector<double> lat;
+    lat.reserve(frames);
+    int frame[144];
+
+    // Configure once, then capture every channel back to back per batch
+    setinttime(10);
+    setgain(1);
+
+    double start = NowMs();
+    for (int i = 0; i < frames; ) {
+        for (int chan = 1; chan <= 4 && i < frames; chan++, i++) {
+            double t0 = NowMs();
+            selchan(chan);
+            get(chan);
+            get_frame12(frame);
+            g_Sink = Consume(frame);
+            lat.push_back(NowMs() - t0);
+        }
+    }
+    AddResult("batched", lat, (NowMs() - start) / 1000);
+}
+
+#define STREAM_SLOTS 16
+
+struct StreamSlot {
+    double t_start;
+    int frame[144];
+};
+
+static void RunStreaming(int frames)
+{
+    static StreamSlot ring[STREAM_SLOTS];
+    std::atomic<int> head(0), tail(0);
+    std::atomic<bool> done(false);
+
+    std::vector<double> lat;
+    lat.reserve(frames);
+
+    setinttime(10);
+    selchan(1);
+
+    double start = NowMs();
+
+    std::thread consumer([&] {
+        for (;;) {
+            int t = tail.load(std::memory_order_relaxed);
+            if (t == head.load(std::memory_order_acquire)) {
+                if (done.load(std::memory_order_acquire) && t == head.load(std::memory_order_acquire))
+                    break;
+                std::this_thread::yield();
+                continue;
+            }
+            StreamSlot& s = ring[t % STREAM_SLOTS];
+            g_Sink = Consume(s.frame);
+            lat.push_back(NowMs() - s.t_start);
+            tail.store(t + 1, std::memory_order_release);
+        }
+    });
+
+    for (int i = 0; i < frames; i++) {
+        double t0 = NowMs();
+        get(1);
+
+        int h = head.load(std::memory_order_relaxed);
+        while (h - tail.load(std::memory_order_acquire) >= STREAM_SLOTS)
+            std::this_thread::yield();			// Consumer fell behind
+
+        StreamSlot& s = ring[h % STREAM_SLOTS];
+        s.t_start = t0;
+        get_frame12(s.frame);
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    done.store(true, std::memory_order_release);
+    consumer.join();
+
+    AddResult("streaming", lat, (NowMs() - start) / 1000);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv)
+{
+    int frames = 200;
+    bool json = false;
+    std::string mode = "all";
+
+    DeviceSimConfig cfg = DeviceSimGetConfig();
+
+    for (int i = 1; i < argc; i++) {
+        const char* a = argv[i];
+        bool more = i + 1 < argc;
+
+        if (!strcmp(a, "--json"))
+            json = true;
+        else if (!strcmp(a, "--frames") && more)
+            frames = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(a, "--latency-us") && more)
+            cfg.report_latency_us = atoi(argv[++i]);
+        else if (!strcmp(a, "--jitter-us") && more)
+            cfg.jitter_us = atoi(argv[++i]);
+        else if (!strcmp(a, "--loss") && more)
+            cfg.row_loss = atof(argv[++i]);
+        else if (!strcmp(a, "--sensor-timeout") && more)
+            cfg.sensor_timeout = atof(argv[++i]);
+        else if (!strcmp(a, "--timeout-us") && more)
+            cfg.timeout_us = atoi(argv[++i]);
+        else if (!strcmp(a, "--mode") && more)
+            mode = argv[++i];
+        else {
+            fprintf(stderr, "usage: %s [--frames n] [--latency-us n] [--jitter-us n] [--loss p] "
+                "[--sensor-timeout p] [--timeout-us n] [--mode oneshot|batched|streaming|all] [--json]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    DeviceSimSetConfig(cfg);
+    LogSetLevel(LOG_LEVEL_WARN);			// get() logs every capture at info level
+
+    if (mode == "all" || mode == "oneshot") {
+        DeviceSimReset();
+        RunOneShot(frames);
+    }
+    if (mode == "all" || mode == "batched") {
+        DeviceSimReset();
+        RunBatched(frames);
+    }
+    if (mode == "all" || mode == "streaming") {
+        DeviceSimReset();
+        RunStreaming(frames);
+    }
+
+    DeviceSimStats st;
+    DeviceSimGetStats(&st);
+
+    if (json) {
+        printf("{\n  \"config\": {\"latency_us\": %d, \"jitter_us\": %d, \"row_loss\": %g, \"sensor_timeout\": %g, \"timeout_us\": %d},\n",
+            cfg.report_latency_us, cfg.jitter_us, cfg.row_loss, cfg.sensor_timeout, cfg.timeout_us);
+        printf("  \"modes\": [\n");
+        for (size_t i = 0; i < g_Results.size(); i++) {
+            const ModeResult& r = g_Results[i];
+            printf("    {\"mode\": \"%s\", \"frames\": %d, \"seconds\": %.3f, \"fps\": %.2f, "
+                "\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"p999_ms\": %.3f, \"max_ms\": %.3f}%s\n",
+                r.mode, r.frames, r.seconds, r.fps, r.p50_ms, r.p99_ms, r.p999_ms, r.max_ms,
+                i + 1 < g_Results.size() ? "," : "");
+        }
+        printf("  ]\n}\n");
+    }
+    else {
+        printf("report latency %d us +/- %d us, row loss %g, sensor time out %g\n",
+            cfg.report_latency_us, cfg.jitter_us, cfg.row_loss, cfg.sensor_timeout);
+        printf("%-10s %8s %9s %9s %9s %9s %9s\n", "mode", "frames", "fps", "p50 ms", "p99 ms", "p99.9 ms", "max ms");
+        for (size_t i = 0; i < g_Results.size(); i++) {
+            const ModeResult& r = g_Results[i];
+            printf("%-10s %8d %9.2f %9.3f %9.3f %9.3f %9.3f\n",
+                r.mode, r.frames, r.fps, r.p50_ms, r.p99_ms, r.p999_ms, r.max_ms);
+        }
+        printf("last mode: %llu reports, %llu rows lost, %llu read time outs\n",
+            (unsigned long long)st.reports, (unsigned long long)st.rows_lost, (unsigned long long)st.read_timeouts);
+    }
+
+    return 0;
+}
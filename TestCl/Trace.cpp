@@ -0,0 +1,150 @@
+// Copyright 2023, All rights reserved
+
+#include "Trace.h"
+#include "RtSched.h"
+#include <cstdio>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> g_TraceEnabled(false);
+
+struct TraceRing {
+    std::atomic<uint64_t> head;		// Events ever written by the owning thread
+    std::atomic<uint64_t> base;		// Events before this were cleared
+    int tid;
+    TraceEvent ev[TRACE_RING_EVENTS];
+};
+
+// Rings are never freed: a thread that exits leaves its events for the next dump
+static TraceRing* g_TraceRings[TRACE_MAX_THREADS];
+static std::atomic<int> g_TraceRingCount(0);
+static std::mutex g_TraceRingLock;
+
+static thread_local TraceRing* t_TraceRing = NULL;
+static thread_local bool t_TraceNoRing = false;		// Ran out of rings
+
+static const uint64_t g_TraceEpochNs = TraceNowNs();
+
+uint64_t TraceNowNs()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static TraceRing* TraceThreadRing()
+{
+    if (t_TraceRing || t_TraceNoRing)
+        return t_TraceRing;
+
+    std::lock_guard<std::mutex> lock(g_TraceRingLock);
+
+    int n = g_TraceRingCount.load(std::memory_order_relaxed);
+    if (n >= TRACE_MAX_THREADS) {
+        t_TraceNoRing = true;
+        return NULL;
+    }
+
+    TraceRing* r = new TraceRing;
+    r->head.store(0, std::memory_order_relaxed);
+    r->base.store(0, std::memory_order_relaxed);
+    r->tid = n + 1;
+
+    g_TraceRings[n] = r;
+    RtSchedRegisterBuffer(r, sizeof(TraceRing));
+    g_TraceRingCount.store(n + 1, std::memory_order_release);
+
+    t_TraceRing = r;
+    return r;
+}
+
+void TraceRecord(const char* name, uint64_t start_ns, uint64_t end_ns, int64_t arg)
+{
+    TraceRing* r = TraceThreadRing();
+    if (!r)
+        return;
+
+    uint64_t h = r->head.load(std::memory_order_relaxed);
+    TraceEvent& e = r->ev[h & (TRACE_RING_EVENTS - 1)];
+    e.name = name;
+    e.start_ns = start_ns;
+    e.dur_ns = end_ns - start_ns;
+    e.arg = arg;
+    r->head.store(h + 1, std::memory_order_release);
+}
+
+void TraceEnable(bool enable)
+{
+    g_TraceEnabled.store(enable, std::memory_order_relaxed);
+}
+
+void TraceClear()
+{
+    int n = g_TraceRingCount.load(std::memory_order_acquire);
+    for (int i = 0; i < n; i++)
+        g_TraceRings[i]->base.store(g_TraceRings[i]->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+}
+
+// Copies the live part of a ring. The owner may keep writing while we copy,
+// so anything it could have overwritten in the meantime is dropped afterwards.
+
+static void TraceCopyRing(const TraceRing* r, std::vector<TraceEvent>& out)
+{
+    uint64_t head = r->head.load(std::memory_order_acquire);
+    uint64_t lo = r->base.load(std::memory_order_relaxed);
+    if (head - lo > TRACE_RING_EVENTS)
+        lo = head - TRACE_RING_EVENTS;
+
+    size_t first = out.size();
+    for (uint64_t i = lo; i < head; i++)
+        out.push_back(r->ev[i & (TRACE_RING_EVENTS - 1)]);
+
+    uint64_t after = r->head.load(std::memory_order_acquire);
+    if (after - lo > TRACE_RING_EVENTS) {
+        size_t lost = (size_t)(after - lo - TRACE_RING_EVENTS);
+        if (lost > out.size() - first)
+            lost = out.size() - first;
+        out.erase(out.begin() + first, out.begin() + first + lost);
+    }
+}
+
+int TraceDump(const char* path)
+{
+    FILE* f = fopen(path, "w");
+    if (!f)
+        return 0;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    bool first = true;
+    std::vector<TraceEvent> events;
+    int n = g_TraceRingCount.load(std::memory_order_acquire);
+
+    for (int t = 0; t < n; t++) {
+        const TraceRing* r = g_TraceRings[t];
+
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"uls thread %d\"}}",
+            first ? "" : ",\n", r->tid, r->tid);
+        first = false;
+
+        events.clear();
+        TraceCopyRing(r, events);
+
+        for (size_t i = 0; i < events.size(); i++) {
+            const TraceEvent& e = events[i];
+            double ts = (double)(int64_t)(e.start_ns - g_TraceEpochNs) / 1000.0;
+            double dur = (double)e.dur_ns / 1000.0;
+
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                e.name, r->tid, ts, dur);
+            if (e.arg != TRACE_NO_ARG)
+                fprintf(f, ",\"args\":{\"v\":%lld}", (long long)e.arg);
+            fprintf(f, "}");
+        }
+    }
+
+    fprintf(f, "\n]}\n");
+
+    bool ok = !ferror(f);
+    return (fclose(f) == 0) && ok;
+}
@@ -0,0 +1,64 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+///////////////////////////////////////////////////////////////////////////////
+// Span tracing of the capture path.
+//
+// TRACE_SPAN("name") times the rest of the enclosing scope. While tracing is
+// off a span costs one relaxed load; while it is on, the span is written into
+// a ring owned by the calling thread, so threads never contend. TraceDump()
+// writes the rings as Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+//
+// Names must be string literals, only the pointer is kept.
+///////////////////////////////////////////////////////////////////////////////
+
+#define TRACE_RING_EVENTS		8192			// Per thread, power of two
+#define TRACE_MAX_THREADS		32
+#define TRACE_NO_ARG			INT64_MIN
+
+struct TraceEvent {
+    const char* name;
+    uint64_t start_ns;				// Monotonic
+    uint64_t dur_ns;
+    int64_t  arg;					// Shown as args.v, TRACE_NO_ARG for none
+};
+
+extern std::atomic<bool> g_TraceEnabled;
+
+uint64_t TraceNowNs();
+void TraceRecord(const char* name, uint64_t start_ns, uint64_t end_ns, int64_t arg);
+
+void TraceEnable(bool enable);
+void TraceClear();
+int  TraceDump(const char* path);			// 1: success; 0: error
+
+class CTraceSpan {
+public:
+    CTraceSpan(const char* name, int64_t arg = TRACE_NO_ARG)
+        : m_Name(g_TraceEnabled.load(std::memory_order_relaxed) ? name : 0), m_Arg(arg)
+    {
+        if (m_Name)
+            m_Start = TraceNowNs();
+    }
+
+    ~CTraceSpan()
+    {
+        if (m_Name)
+            TraceRecord(m_Name, m_Start, TraceNowNs(), m_Arg);
+    }
+
+    void SetArg(int64_t arg) { m_Arg = arg; }
+
+protected:
+    const char* m_Name;
+    int64_t m_Arg;
+    uint64_t m_Start;
+};
+
+#define TRACE_CONCAT2(a, b)		a##b
+#define TRACE_CONCAT(a, b)		TRACE_CONCAT2(a, b)
+#define TRACE_SPAN(...)			CTraceSpan TRACE_CONCAT(trace_span_, __LINE__)(__VA_ARGS__)
@@ -9,7 +9,9 @@
 #include <cctype>
 #include <cstdint>
 #include <cmath>
+#include <cstring>
 #include "TrimReader.h"
+#include "Metrics.h"
 
 
 #define SAW_TOOTH2		// Newer Sawtooth algorithm. USe 2 pass low byte correction
@@ -74,11 +76,15 @@ CTrimReader::CTrimReader()
 	WordIndex = 0;
 
 	fileLoaded = false;
+
+	memset(pixel_flag, 0, sizeof(pixel_flag));
 }
 
 CTrimReader::~CTrimReader()
 {
+#ifdef _WIN32
 	if (fileLoaded) InFile.Close();
+#endif
 }
 
 int CTrimReader::Load(TCHAR* fn)
@@ -121,6 +127,7 @@ int CTrimReader::Load(TCHAR* fn)
 	}
 
 	MaxWord = i;
+	WordIndex = 0;
 	FileBuf.Empty();
 
 	return e;
@@ -150,6 +157,7 @@ int CTrimReader::Load(TCHAR* fn)
         i++;
     }
     MaxWord = i;
+    WordIndex = 0;
     FileBuf.clear();
     return 1;
 #endif
@@ -157,6 +165,11 @@ int CTrimReader::Load(TCHAR* fn)
 
 int CTrimReader::GetWord()
 {
+	if (WordIndex >= MaxWord) {			// Out of words, keep reporting the end
+		CurWord = CString("");
+		return MaxWord;
+	}
+
 	CurWord = WordBuf[WordIndex];
 	WordIndex++;
 
@@ -180,7 +193,7 @@ void CTrimReader::Parse()
 	CString Name;
 	int i = 0;
 
-	if (!InFile)
+	if (!fileLoaded)
 		return;
 
 	for (;;) {
@@ -209,7 +222,7 @@ void CTrimReader::Parse()
 
 void CTrimReader::ParseNode()
 {
-	if (!InFile)
+	if (!fileLoaded)
 		return;
 
 	for (;;) {
@@ -416,7 +429,6 @@ void CTrimReader::ParseValue(int gain)
         curNode->auto_v20[gain] = val;
 }
 #endif
-}
 
 #define DARK_LEVEL 100
 #define DARK_MANAGE
@@ -529,6 +541,8 @@ int CTrimReader::ADCCorrection(int NumData, BYTE HighByte, BYTE LowByte, int pix
 
 #endif
 
+	if (NumData < MAX_ROW_PIXELS) pixel_flag[NumData] = (BYTE)*flag;
+
 	return result;
 }
 
@@ -645,6 +659,8 @@ int CTrimReader::ADCCorrectioni(int NumData, BYTE HighByte, BYTE LowByte, int pi
 
 #endif
 
+	if (NumData < MAX_ROW_PIXELS) pixel_flag[NumData] = (BYTE)*flag;
+
 	return result;
 }
 
@@ -675,6 +691,9 @@ void CTrimReader::OnEEPROMRead()
 	}
 
 
+	if (!parity_ok)
+		MetricInc(METRIC_PARITY_ERRORS);
+
 	if (index < npages - 1)
 		ee_continue = true;
 	else
@@ -19,11 +19,12 @@ typedef char TCHAR;
 typedef std::string CString;
 #endif
 
-#define TRIM_MAX_WORD 1024
+#define TRIM_MAX_WORD 2048		// A trim.dat node is ~120 words, room for all 16 nodes
 #define TRIM_IMAGER_SIZE 12
 #define NUM_EPKT 4
 #define EPKT_SZ 64
 #define MAX_TRIMBUFF 1024
+#define MAX_ROW_PIXELS 24
 
 class CTrimNode {
 public:
@@ -78,6 +79,8 @@ public:
 	BYTE trim_buff[MAX_TRIMBUFF];
 	int tbuff_rptr;
 
+	BYTE pixel_flag[MAX_ROW_PIXELS];		// ADCCorrection flag of each pixel in the last row corrected
+
 	int Load(TCHAR* fn);
 	int GetWord();
 	int Match(CString s);
@@ -0,0 +1,295 @@
+// Copyright 2023, All rights reserved
+
+#include "UsbRecovery.h"
+#include "HidMgr.h"
+#include "Cancel.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <hidapi/hidapi.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+#endif
+
+extern "C" hid_device* DeviceHandle;
+
+static std::mutex g_RecoveryLock;
+static UsbRecoveryStats g_RecoveryStats = { 0, 0, { 0 }, -1, { 0 }, 0 };
+
+static const char* const g_StageName[USB_STAGE_COUNT] = {
+    "drain",
+    "protocol reset",
+    "reopen",
+    "port reset",
+};
+
+const char* UsbRecoveryStageName(int stage)
+{
+    return stage >= 0 && stage < USB_STAGE_COUNT ? g_StageName[stage] : "none";
+}
+
+static int64_t ElapsedUs(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - since).count();
+}
+
+// Calls ready() until it returns true, sleeping USB_BACKOFF_MIN_US, then
+// twice as long each time up to USB_BACKOFF_MAX_US. false once budget_ms has
+// passed or on cancel.
+
+template <class F>
+static bool PollWithBackoff(int budget_ms, F ready)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int64_t delay = USB_BACKOFF_MIN_US;
+
+    for (;;) {
+        if (ready())
+            return true;
+
+        int64_t left = (int64_t)budget_ms * 1000 - ElapsedUs(start);
+        if (left <= 0)
+            return false;
+        if (CancelSleepUs(delay < left ? delay : left))
+            return false;
+
+        delay = delay * 2 < USB_BACKOFF_MAX_US ? delay * 2 : USB_BACKOFF_MAX_US;
+    }
+}
+
+static void ToWide(const char* s, wchar_t* w, int len)
+{
+    int i = 0;
+    for (; s && s[i] && i < len - 1; i++)
+        w[i] = (wchar_t)(unsigned char)s[i];
+    w[i] = 0;
+}
+
+static bool OpenDevice(uint16_t vid, uint16_t pid, const char* serial)
+{
+    wchar_t wserial[64];
+    ToWide(serial, wserial, 64);
+
+    DeviceHandle = hid_open(vid, pid, wserial[0] ? wserial : NULL);
+    if (!DeviceHandle)
+        return false;
+
+    if (hid_set_nonblocking(DeviceHandle, 1) != 0)
+        LOG_WARN("USB recovery: failed to set non-blocking mode: %ls", hid_error(DeviceHandle));
+    return true;
+}
+
+static void CloseDevice()
+{
+    if (DeviceHandle) {
+        hid_close(DeviceHandle);
+        DeviceHandle = NULL;
+    }
+}
+
+int UsbReadResponse(unsigned char* data, size_t length, int budget_ms)
+{
+    int n = 0;
+    if (!DeviceHandle)
+        return 0;
+
+    PollWithBackoff(budget_ms, [&]() {
+        n = hid_read_timeout(DeviceHandle, data, length, 0);
+        return n != 0;
+    });
+    return n > 0 ? n : 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Stages
+/////////////////////////////////////////////////////////////////////////////
+
+static bool SendProtocolReset()
+{
+    if (!DeviceHandle)
+        return false;
+
+    unsigned char reset_data[HIDREPORTNUM] = { 0 };
+    reset_data[0] = 0;		// Report ID
+    reset_data[1] = 0xaa;	// Preamble
+    reset_data[2] = 0x01;	// Command type
+    reset_data[3] = 0x10;	// Reset command
+
+    if (hid_write(DeviceHandle, reset_data, sizeof(reset_data)) < 0) {
+        LOG_WARN("USB recovery: failed to send reset command: %ls", hid_error(DeviceHandle));
+        return false;
+    }
+
+    // The device answers once it has reset; take that as ready rather than
+    // sleeping for the worst case
+    unsigned char response[HIDREPORTNUM];
+    return PollWithBackoff(USB_RESET_BUDGET_MS, [&]() {
+        return hid_read_timeout(DeviceHandle, response, sizeof(response), 0) > 0;
+    });
+}
+
+#ifdef __linux__
+// /dev/bus/usb node of the USB device behind a hidapi path: hidraw backend
+// paths are "/dev/hidrawN", libusb backend paths "bus:device:interface"
+
+static bool UsbNodeForPath(const char* path, char* node, size_t len)
+{
+    unsigned int bus, dev, intf;
+    if (sscanf(path, "%x:%x:%x", &bus, &dev, &intf) == 3) {
+        snprintf(node, len, "/dev/bus/usb/%03u/%03u", bus, dev);
+        return true;
+    }
+
+    const char* name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+
+    std::string link = std::string("/sys/class/hidraw/") + name + "/device";
+    char real[PATH_MAX];
+    if (!realpath(link.c_str(), real))
+        return false;
+
+    // Walk up from the HID device to the USB device that has busnum / devnum
+    std::string dir = real;
+    while (dir.size() > 1) {
+        FILE* fb = fopen((dir + "/busnum").c_str(), "r");
+        FILE* fd = fopen((dir + "/devnum").c_str(), "r");
+        bool found = fb && fd && fscanf(fb, "%u", &bus) == 1 && fscanf(fd, "%u", &dev) == 1;
+        if (fb) fclose(fb);
+        if (fd) fclose(fd);
+        if (found) {
+            snprintf(node, len, "/dev/bus/usb/%03u/%03u", bus, dev);
+            return true;
+        }
+        dir.erase(dir.rfind('/'));
+    }
+    return false;
+}
+
+static bool PortReset(uint16_t vid, uint16_t pid, const char* serial)
+{
+    char node[64] = { 0 };
+    bool found = false;
+
+    wchar_t wserial[64];
+    ToWide(serial, wserial, 64);
+
+    struct hid_device_info* devs = hid_enumerate(vid, pid);
+    for (struct hid_device_info* d = devs; d && !found; d = d->next) {
+        if (wserial[0] && (!d->serial_number || wcscmp(d->serial_number, wserial)))
+            continue;
+        found = d->path && UsbNodeForPath(d->path, node, sizeof(node));
+    }
+    hid_free_enumeration(devs);
+
+    if (!found) {
+        LOG_WARN("USB recovery: no USB device node for port reset");
+        return false;
+    }
+
+    int fd = open(node, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_WARN("USB recovery: cannot open %s for port reset", node);
+        return false;
+    }
+    int r = ioctl(fd, USBDEVFS_RESET, 0);
+    close(fd);
+    if (r < 0) {
+        LOG_WARN("USB recovery: USBDEVFS_RESET on %s failed", node);
+        return false;
+    }
+
+    LOG_INFO("USB recovery: reset %s", node);
+    return true;
+}
+#else
+static bool PortReset(uint16_t, uint16_t, const char*)
+{
+    return false;		// No user mode port reset through hidapi
+}
+#endif
+
+/////////////////////////////////////////////////////////////////////////////
+// State machine
+/////////////////////////////////////////////////////////////////////////////
+
+int UsbRecover(uint16_t vid, uint16_t pid, const char* serial, UsbProbeFn probe, UsbRestoreFn restore, void* ctx)
+{
+    TRACE_SPAN("UsbRecover");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint32_t stage_us[USB_STAGE_COUNT] = { 0 };
+    int resolved = -1;
+
+    for (int stage = 0; stage < USB_STAGE_COUNT && resolved < 0; stage++) {
+        if (CancelPending())
+            break;
+
+        TRACE_SPAN("UsbRecoverStage", stage);
+        std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+        bool ok = false;
+
+        switch (stage) {
+        case USB_STAGE_DRAIN:
+            DrainInputReports();
+            ok = probe(ctx);
+            break;
+        case USB_STAGE_PROTOCOL_RESET:
+            ok = SendProtocolReset() && probe(ctx);
+            break;
+        case USB_STAGE_REOPEN:
+            CloseDevice();
+            ok = PollWithBackoff(USB_REOPEN_BUDGET_MS, [&]() { return OpenDevice(vid, pid, serial); }) && probe(ctx);
+            break;
+        case USB_STAGE_PORT_RESET:
+            if (PortReset(vid, pid, serial)) {
+                CloseDevice();
+                ok = PollWithBackoff(USB_PORT_RESET_BUDGET_MS, [&]() { return OpenDevice(vid, pid, serial); }) && probe(ctx);
+            }
+            break;
+        }
+
+        stage_us[stage] = (uint32_t)ElapsedUs(t);
+        LOG_INFO("USB recovery: %s %s in %.1f ms", g_StageName[stage], ok ? "succeeded" : "did not help", stage_us[stage] / 1000.0);
+        if (ok)
+            resolved = stage;
+    }
+
+    if (resolved > USB_STAGE_DRAIN && restore) {
+        TRACE_SPAN("UsbRestore");
+        std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+        restore(ctx);
+        LOG_INFO("USB recovery: settings restored in %.1f ms", ElapsedUs(t) / 1000.0);
+    }
+
+    uint32_t total = (uint32_t)ElapsedUs(start);
+    MetricRecord(METRIC_HIST_RECOVERY_US, total);
+    if (resolved < 0)
+        LOG_ERROR("USB recovery failed after %.1f ms", total / 1000.0);
+
+    std::lock_guard<std::mutex> lock(g_RecoveryLock);
+    g_RecoveryStats.runs++;
+    if (resolved < 0)
+        g_RecoveryStats.failures++;
+    else
+        g_RecoveryStats.resolved[resolved]++;
+    g_RecoveryStats.last_stage = resolved;
+    memcpy(g_RecoveryStats.last_stage_us, stage_us, sizeof(stage_us));
+    g_RecoveryStats.last_total_us = total;
+
+    return resolved;
+}
+
+void UsbRecoveryGetStats(UsbRecoveryStats* out)
+{
+    std::lock_guard<std::mutex> lock(g_RecoveryLock);
+    *out = g_RecoveryStats;
+}
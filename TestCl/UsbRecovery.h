@@ -0,0 +1,68 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// USB recovery.
+//
+// Brings an unresponsive device back, escalating only as far as needed:
+//
+//   USB_STAGE_DRAIN           discard queued input reports
+//   USB_STAGE_PROTOCOL_RESET  send the 0x10 reset command
+//   USB_STAGE_REOPEN          close and reopen the HID handle
+//   USB_STAGE_PORT_RESET      USBDEVFS_RESET of the USB device (Linux)
+//
+// After each stage the device is probed with a command whose response is
+// cheap to check. Waits are polls with exponential backoff from
+// USB_BACKOFF_MIN_US up to USB_BACKOFF_MAX_US, bounded by a budget per stage,
+// so a device that comes back at once is used at once rather than after a
+// fixed sleep. Waits end early on cancel_capture().
+///////////////////////////////////////////////////////////////////////////////
+
+enum UsbRecoveryStage {
+    USB_STAGE_DRAIN,
+    USB_STAGE_PROTOCOL_RESET,
+    USB_STAGE_REOPEN,
+    USB_STAGE_PORT_RESET,
+    USB_STAGE_COUNT
+};
+
+#define USB_BACKOFF_MIN_US			500
+#define USB_BACKOFF_MAX_US			32000
+#define USB_PROBE_BUDGET_MS			100		// Probe command to its response
+#define USB_RESET_BUDGET_MS			200		// Reset command to a response
+#define USB_REOPEN_BUDGET_MS		1000	// Close to the device opening again
+#define USB_PORT_RESET_BUDGET_MS	3000	// Port reset to re-enumeration
+
+// true if the device answered. Runs with the handle open. Must wait for the
+// answer with UsbReadResponse(): the transport's own read waits out its full
+// time out on a dead device, far past the stage's budget.
+typedef bool (*UsbProbeFn)(void* ctx);
+
+// Puts the device's settings back after a stage past USB_STAGE_DRAIN, which
+// leaves it with power on defaults. Timed as part of the recovery.
+typedef void (*UsbRestoreFn)(void* ctx);
+
+struct UsbRecoveryStats {
+    uint32_t runs;
+    uint32_t failures;
+    uint32_t resolved[USB_STAGE_COUNT];	// Runs that ended at each stage
+    int last_stage;						// Stage that brought the last run back, -1 if it failed
+    uint32_t last_stage_us[USB_STAGE_COUNT];	// Time spent in each stage by the last run, 0 if not reached
+    uint32_t last_total_us;				// Including the restore
+};
+
+// Recovers the device behind DeviceHandle, reopening it by 'serial' (empty or
+// NULL: first matching device), then runs 'restore' (may be NULL) if the stage
+// reset the device. Returns the stage that brought it back, or -1 if none did
+// or it was cancelled.
+int  UsbRecover(uint16_t vid, uint16_t pid, const char* serial, UsbProbeFn probe, UsbRestoreFn restore, void* ctx);
+void UsbRecoveryGetStats(UsbRecoveryStats* out);
+
+// Reads one input report from DeviceHandle, polling with backoff for up to
+// budget_ms. Returns its length, 0 if none came, on error or on cancel.
+int  UsbReadResponse(unsigned char* data, size_t length, int budget_ms);
+const char* UsbRecoveryStageName(int stage);
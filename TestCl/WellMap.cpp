@@ -0,0 +1,158 @@
+// Copyright 2023, All rights reserved
+
+#include "WellMap.h"
+#include "Log.h"
+#include <cmath>
+#include <cstring>
+
+#define WELL_DISC_FILL	0.8		// Disc diameter as a fraction of the grid cell, clear of the walls
+
+CWellMap::CWellMap()
+    : m_Masked(false), m_Size(0)
+{
+    memset(m_TapCount, 0, sizeof(m_TapCount));
+    m_Wells[0] = m_Wells[1] = 0;
+}
+
+int CWellMap::Wells(int size) const
+{
+    return m_Wells[SizeIndex(size)];
+}
+
+void CWellMap::BuildGrid(int size, int num_wells, int cols)
+{
+    int s = SizeIndex(size);
+    int rows = (num_wells + cols - 1) / cols;
+    double cw = (double)size / cols;
+    double ch = (double)size / rows;
+    double radius = 0.5 * WELL_DISC_FILL * (cw < ch ? cw : ch);
+
+    bool taken[FRAME_MAX_SIZE][FRAME_MAX_SIZE];
+
+    memset(m_TapCount[s], 0, sizeof(m_TapCount[s]));
+    memset(taken, 0, sizeof(taken));
+
+    for (int w = 0; w < num_wells; w++) {
+        double cx = (w % cols + 0.5) * cw;
+        double cy = (w / cols + 0.5) * ch;
+
+        for (int r = 0; r < size; r++) {
+            for (int c = 0; c < size; c++) {
+                double d = std::hypot(c + 0.5 - cx, r + 0.5 - cy);
+                if (d > radius + 0.5 || taken[r][c])		// A rim pixel belongs to one well only
+                    continue;
+                taken[r][c] = true;
+
+                Tap& t = m_Taps[s][r][m_TapCount[s][r]++];
+                t.col = (uint8_t)c;
+                t.well = (uint8_t)w;
+                t.weight = d <= radius - 0.5 ? WELL_WEIGHT_ONE : WELL_WEIGHT_ONE / 2;
+            }
+        }
+    }
+
+    m_Wells[s] = num_wells;
+}
+
+int CWellMap::BuildFromFormat(int num_wells, int well_format)
+{
+    if (m_Masked)
+        return m_Wells[0];
+
+    if (num_wells <= 0 || num_wells > WELL_MAX) {
+        if (num_wells)
+            LOG_WARN("Well map: %d wells not supported", num_wells);
+        memset(m_TapCount, 0, sizeof(m_TapCount));
+        m_Wells[0] = m_Wells[1] = 0;
+        return 0;
+    }
+
+    int cols = well_format > 0 && well_format <= num_wells ? well_format : num_wells;
+
+    BuildGrid(12, num_wells, cols);
+    BuildGrid(24, num_wells, cols);
+
+    LOG_INFO("Well map: %d wells, %d per row", num_wells, cols);
+    return num_wells;
+}
+
+int CWellMap::SetMask(int size, const int* mask, const int* weights)
+{
+    if (size != 12 && size != 24)
+        return -1;
+
+    int s = SizeIndex(size);
+    int wells = 0;
+
+    for (int i = 0; i < size * size; i++) {
+        if (mask[i] < 0 || mask[i] > WELL_MAX)
+            return -1;
+        if (mask[i] > wells)
+            wells = mask[i];
+    }
+
+    memset(m_TapCount[s], 0, sizeof(m_TapCount[s]));
+    for (int r = 0; r < size; r++) {
+        for (int c = 0; c < size; c++) {
+            int w = mask[r * size + c];
+            if (!w)
+                continue;
+
+            Tap& t = m_Taps[s][r][m_TapCount[s][r]++];
+            t.col = (uint8_t)c;
+            t.well = (uint8_t)(w - 1);
+            t.weight = (uint16_t)(weights ? weights[r * size + c] : WELL_WEIGHT_ONE);
+        }
+    }
+
+    m_Wells[s] = wells;
+    m_Masked = true;
+
+    LOG_INFO("Well map: mask with %d wells for %dx%d frames", wells, size, size);
+    return wells;
+}
+
+void CWellMap::ClearMask()
+{
+    m_Masked = false;
+    memset(m_TapCount, 0, sizeof(m_TapCount));
+    m_Wells[0] = m_Wells[1] = 0;
+}
+
+void CWellMap::BeginFrame(int size)
+{
+    m_Size = size;
+
+    int n = m_Wells[SizeIndex(size)];
+    memset(m_Sum, 0, n * sizeof(m_Sum[0]));
+    memset(m_Weight, 0, n * sizeof(m_Weight[0]));
+    memset(m_Saturated, 0, n * sizeof(m_Saturated[0]));
+    memset(m_Pixels, 0, n * sizeof(m_Pixels[0]));
+}
+
+void CWellMap::AccumulateRow(int row, const int* pixels, const uint8_t* flags)
+{
+    int s = SizeIndex(m_Size);
+    const Tap* t = m_Taps[s][row];
+
+    for (int k = m_TapCount[s][row]; k > 0; k--, t++) {
+        m_Sum[t->well] += (int64_t)pixels[t->col] * t->weight;
+        m_Weight[t->well] += t->weight;
+        m_Pixels[t->well]++;
+        if (PIXEL_FLAG_IS_OVERFLOW(flags[t->col]))
+            m_Saturated[t->well]++;
+    }
+}
+
+int CWellMap::EndFrame(WellResult* out)
+{
+    int n = m_Wells[SizeIndex(m_Size)];
+
+    for (int w = 0; w < n; w++) {
+        out[w].sum = (int32_t)((m_Sum[w] + WELL_WEIGHT_ONE / 2) / WELL_WEIGHT_ONE);
+        out[w].mean = m_Weight[w] ? (float)m_Sum[w] / (float)m_Weight[w] : 0.0f;
+        out[w].saturated = m_Saturated[w];
+        out[w].pixels = m_Pixels[w];
+    }
+    return n;
+}
@@ -0,0 +1,66 @@
+// Copyright 2023, All rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include "FrameMeta.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Well integration.
+//
+// A well map lists, for each row of the imager, the pixels that belong to a
+// well and their weights (Q8, WELL_WEIGHT_ONE = 1.0). As each row of a frame
+// is corrected its pixels are added to their wells, so when the last row
+// arrives the per-well sum, mean and count of saturated (overflow flagged)
+// pixels are ready without another pass over the frame.
+//
+// The map comes from the EEPROM header: num_wells wells on a regular grid of
+// well_format wells per row (0: a single row), each well being the disc
+// inscribed in its grid cell, pixels on the rim at half weight. A mask set by
+// the caller (well number 1..n per pixel, 0 for none) replaces it.
+///////////////////////////////////////////////////////////////////////////////
+
+#define WELL_WEIGHT_ONE		256
+
+class CWellMap {
+public:
+    CWellMap();
+
+    // Map from the EEPROM header, both frame sizes. Returns the number of wells.
+    int BuildFromFormat(int num_wells, int well_format);
+
+    // Caller mask for one frame size: size x size well numbers, 0 for none;
+    // weights Q8 per pixel, NULL for WELL_WEIGHT_ONE. Returns the number of
+    // wells, -1 if the mask is invalid. A mask stays until ClearMask().
+    int SetMask(int size, const int* mask, const int* weights);
+    void ClearMask();
+    bool HasMask() const { return m_Masked; }
+
+    int Wells(int size) const;
+
+    void BeginFrame(int size);
+    void AccumulateRow(int row, const int* pixels, const uint8_t* flags);
+    int  EndFrame(WellResult* out);		// Returns the number of wells written
+
+protected:
+    struct Tap {
+        uint8_t col;
+        uint8_t well;
+        uint16_t weight;
+    };
+
+    static int SizeIndex(int size) { return size == 24 ? 1 : 0; }
+    void BuildGrid(int size, int num_wells, int cols);
+
+    Tap m_Taps[2][FRAME_MAX_SIZE][FRAME_MAX_SIZE];	// [size][row][n]
+    uint8_t m_TapCount[2][FRAME_MAX_SIZE];
+    int m_Wells[2];
+    bool m_Masked;
+
+    // Frame in progress
+    int m_Size;
+    int64_t m_Sum[WELL_MAX];
+    uint32_t m_Weight[WELL_MAX];
+    uint16_t m_Saturated[WELL_MAX];
+    uint16_t m_Pixels[WELL_MAX];
+};